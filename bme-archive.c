@@ -0,0 +1,642 @@
+/*
+ * bme-archive.c: long-term battery history for hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "bme-archive.h"
+
+/*
+ Block layout:
+   0  'B' 'A'          magic
+   2  version
+   3  flags            BLOCK_FLAG_*
+   4  time             uint32, little endian
+   8  charge_full      varint
+      charge_now       varint
+      voltage          varint
+      temp             zigzag varint
+      flags            zigzag varint
+      records...
+
+ Record layout:
+      time delta       varint, never 0
+      field deltas     zigzag varint, same order as the keyframe
+*/
+
+#define BLOCK_MAGIC_0 'B'
+#define BLOCK_MAGIC_1 'A'
+#define BLOCK_VERSION 1
+#define BLOCK_HEADER_SIZE 8
+
+/* the clock was stepped back, the block starts before the previous one */
+#define BLOCK_FLAG_CLOCK_STEP 0x01
+
+/* 5 fields of at most 10 bytes plus the time delta */
+#define RECORD_MAX_SIZE 60
+
+/* start time and flags of every block of a file, read once at open.
+ * A block with an unreadable header is marked broken and given the time
+ * of the block before it, so the times stay sorted within a run. */
+typedef struct {
+  uint32_t time;
+  unsigned char flags;
+  unsigned char broken;
+} block_index_entry;
+
+typedef struct {
+  block_index_entry *blocks;
+  uint32_t count;
+  uint32_t size;
+} block_index;
+
+struct bme_archive {
+  char *path;
+  int fd;
+  int old_fd;            /* <path>.old, -1 if there is none */
+  block_index index;
+  block_index old_index;
+  unsigned int max_blocks;
+  uint32_t block;        /* index of the block in buf */
+  unsigned int used;     /* bytes of buf in use, 0 if no block started */
+  unsigned int flushed;  /* bytes of buf already written out */
+  int have_last;
+  bme_archive_record last;
+  unsigned char buf[BME_ARCHIVE_BLOCK_SIZE];
+};
+
+typedef struct {
+  const unsigned char *buf;
+  unsigned int pos;
+  int started;
+  bme_archive_record record;
+} block_cursor;
+
+static unsigned int put_varint(unsigned char *buf, uint64_t value)
+{
+  unsigned int len = 0;
+
+  while (value >= 0x80)
+  {
+    buf[len++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  buf[len++] = value;
+
+  return len;
+}
+
+static unsigned int put_zigzag(unsigned char *buf, int64_t value)
+{
+  return put_varint(buf, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static int get_varint(const unsigned char *buf, unsigned int *pos, uint64_t *value)
+{
+  unsigned int shift = 0;
+
+  *value = 0;
+  while (*pos < BME_ARCHIVE_BLOCK_SIZE && shift < 64)
+  {
+    unsigned char byte = buf[(*pos)++];
+
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return 0;
+    shift += 7;
+  }
+
+  return -1;
+}
+
+static int get_zigzag(const unsigned char *buf, unsigned int *pos, int64_t *value)
+{
+  uint64_t raw;
+
+  if (get_varint(buf, pos, &raw))
+    return -1;
+  *value = (int64_t)(raw >> 1) ^ -(int64_t)(raw & 1);
+
+  return 0;
+}
+
+static uint32_t get_le32(const unsigned char *buf)
+{
+  return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+static int block_header_valid(const unsigned char *buf)
+{
+  return buf[0] == BLOCK_MAGIC_0 && buf[1] == BLOCK_MAGIC_1 && buf[2] == BLOCK_VERSION;
+}
+
+static unsigned int encode_keyframe(unsigned char *buf, const bme_archive_record *record, unsigned char flags)
+{
+  unsigned int len = BLOCK_HEADER_SIZE;
+
+  buf[0] = BLOCK_MAGIC_0;
+  buf[1] = BLOCK_MAGIC_1;
+  buf[2] = BLOCK_VERSION;
+  buf[3] = flags;
+  buf[4] = record->time;
+  buf[5] = record->time >> 8;
+  buf[6] = record->time >> 16;
+  buf[7] = record->time >> 24;
+  len += put_varint(buf + len, record->charge_full);
+  len += put_varint(buf + len, record->charge_now);
+  len += put_varint(buf + len, record->voltage);
+  len += put_zigzag(buf + len, record->temp);
+  len += put_zigzag(buf + len, record->flags);
+
+  return len;
+}
+
+static unsigned int encode_record(unsigned char *buf, const bme_archive_record *prev, const bme_archive_record *record)
+{
+  unsigned int len = 0;
+
+  len += put_varint(buf + len, record->time - prev->time);
+  len += put_zigzag(buf + len, (int64_t)record->charge_full - prev->charge_full);
+  len += put_zigzag(buf + len, (int64_t)record->charge_now - prev->charge_now);
+  len += put_zigzag(buf + len, (int64_t)record->voltage - prev->voltage);
+  len += put_zigzag(buf + len, (int64_t)record->temp - prev->temp);
+  len += put_zigzag(buf + len, (int64_t)record->flags - prev->flags);
+
+  return len;
+}
+
+/* decode the next record of a block, returns 0 at its end */
+static int cursor_next(block_cursor *cursor)
+{
+  bme_archive_record *record = &cursor->record;
+  uint64_t value;
+  int64_t delta[5];
+  unsigned int pos = cursor->pos;
+  int i;
+
+  if (!cursor->started)
+  {
+    if (!block_header_valid(cursor->buf))
+      return 0;
+
+    pos = BLOCK_HEADER_SIZE;
+    record->time = get_le32(cursor->buf + 4);
+    if (get_varint(cursor->buf, &pos, &value))
+      return 0;
+    record->charge_full = value;
+    if (get_varint(cursor->buf, &pos, &value))
+      return 0;
+    record->charge_now = value;
+    if (get_varint(cursor->buf, &pos, &value))
+      return 0;
+    record->voltage = value;
+    if (get_zigzag(cursor->buf, &pos, &delta[0]) || get_zigzag(cursor->buf, &pos, &delta[1]))
+      return 0;
+    record->temp = delta[0];
+    record->flags = delta[1];
+
+    cursor->started = 1;
+    cursor->pos = pos;
+    return 1;
+  }
+
+  if (pos >= BME_ARCHIVE_BLOCK_SIZE || !cursor->buf[pos])
+    return 0;
+
+  if (get_varint(cursor->buf, &pos, &value))
+    return 0;
+  for (i = 0; i < 5; i++)
+    if (get_zigzag(cursor->buf, &pos, &delta[i]))
+      return 0;
+
+  record->time += value;
+  record->charge_full += delta[0];
+  record->charge_now += delta[1];
+  record->voltage += delta[2];
+  record->temp += delta[3];
+  record->flags += delta[4];
+  cursor->pos = pos;
+
+  return 1;
+}
+
+static int read_block(int fd, uint32_t block, unsigned char *buf, size_t len)
+{
+  ssize_t ret;
+
+  memset(buf, 0, len);
+  ret = pread(fd, buf, len, (off_t)block * BME_ARCHIVE_BLOCK_SIZE);
+
+  return ret <= 0 ? -1 : 0;
+}
+
+static uint32_t file_blocks(int fd)
+{
+  struct stat st;
+
+  if (fstat(fd, &st))
+    return 0;
+
+  return (st.st_size + BME_ARCHIVE_BLOCK_SIZE - 1) / BME_ARCHIVE_BLOCK_SIZE;
+}
+
+static int index_set(block_index *index, uint32_t block, uint32_t time, unsigned char flags, int broken)
+{
+  if (block >= index->size)
+  {
+    uint32_t size = index->size ? index->size : 64;
+    block_index_entry *blocks;
+
+    while (size <= block)
+      size *= 2;
+    blocks = realloc(index->blocks, size * sizeof(*blocks));
+    if (!blocks)
+      return -1;
+    index->blocks = blocks;
+    index->size = size;
+  }
+
+  index->blocks[block].time = time;
+  index->blocks[block].flags = flags;
+  index->blocks[block].broken = broken;
+  if (block >= index->count)
+    index->count = block + 1;
+
+  return 0;
+}
+
+static void index_load(block_index *index, int fd)
+{
+  unsigned char header[BLOCK_HEADER_SIZE];
+  uint32_t blocks = file_blocks(fd);
+  uint32_t block, time = 0;
+  unsigned char flags;
+
+  index->count = 0;
+  for (block = 0; block < blocks; block++)
+  {
+    if (read_block(fd, block, header, sizeof(header)) || !block_header_valid(header))
+    {
+      if (index_set(index, block, time, 0, 1))
+        return;
+      continue;
+    }
+
+    /* a flagged block may be the broken one, keep the runs sorted anyway */
+    flags = header[3];
+    if (get_le32(header + 4) < time)
+      flags |= BLOCK_FLAG_CLOCK_STEP;
+    time = get_le32(header + 4);
+    if (index_set(index, block, time, flags, 0))
+      return;
+  }
+}
+
+static void index_free(block_index *index)
+{
+  free(index->blocks);
+  memset(index, 0, sizeof(*index));
+}
+
+/* pick up the tail block of an existing file, so appending continues in it */
+static void archive_load_tail(bme_archive *archive)
+{
+  block_cursor cursor;
+  uint32_t blocks = file_blocks(archive->fd);
+
+  if (!blocks)
+    return;
+
+  archive->block = blocks;
+  if (read_block(archive->fd, blocks - 1, archive->buf, sizeof(archive->buf)) ||
+      !block_header_valid(archive->buf))
+    return;
+
+  memset(&cursor, 0, sizeof(cursor));
+  cursor.buf = archive->buf;
+  while (cursor_next(&cursor))
+  {
+    archive->last = cursor.record;
+    archive->have_last = 1;
+  }
+
+  archive->block = blocks - 1;
+  archive->used = archive->flushed = cursor.pos;
+}
+
+bme_archive *bme_archive_open(const char *path, unsigned int max_blocks)
+{
+  bme_archive *archive = calloc(1, sizeof(*archive));
+  char old_path[256];
+
+  if (!archive)
+    return NULL;
+
+  archive->path = strdup(path);
+  archive->max_blocks = max_blocks ? max_blocks : 1;
+  archive->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (!archive->path || archive->fd < 0)
+  {
+    if (archive->fd >= 0)
+      close(archive->fd);
+    free(archive->path);
+    free(archive);
+    return NULL;
+  }
+
+  snprintf(old_path, sizeof(old_path), "%s.old", path);
+  archive->old_fd = open(old_path, O_RDONLY);
+  if (archive->old_fd >= 0)
+    index_load(&archive->old_index, archive->old_fd);
+
+  index_load(&archive->index, archive->fd);
+  archive_load_tail(archive);
+
+  return archive;
+}
+
+void bme_archive_close(bme_archive *archive)
+{
+  if (!archive)
+    return;
+
+  bme_archive_flush(archive);
+  close(archive->fd);
+  if (archive->old_fd >= 0)
+    close(archive->old_fd);
+  index_free(&archive->index);
+  index_free(&archive->old_index);
+  free(archive->path);
+  free(archive);
+}
+
+int bme_archive_flush(bme_archive *archive)
+{
+  ssize_t ret;
+
+  if (archive->flushed >= archive->used)
+    return 0;
+
+  ret = pwrite(archive->fd, archive->buf + archive->flushed, archive->used - archive->flushed,
+               (off_t)archive->block * BME_ARCHIVE_BLOCK_SIZE + archive->flushed);
+  if (ret < 0)
+    return -1;
+
+  archive->flushed += ret;
+
+  return 0;
+}
+
+static int archive_rotate(bme_archive *archive)
+{
+  char old_path[256];
+  int fd;
+
+  snprintf(old_path, sizeof(old_path), "%s.old", archive->path);
+  if (rename(archive->path, old_path))
+    return -1;
+
+  fd = open(archive->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+
+  /* the live file and its index become the old ones */
+  if (archive->old_fd >= 0)
+    close(archive->old_fd);
+  index_free(&archive->old_index);
+  archive->old_fd = archive->fd;
+  archive->old_index = archive->index;
+  memset(&archive->index, 0, sizeof(archive->index));
+
+  archive->fd = fd;
+  archive->block = 0;
+
+  return 0;
+}
+
+int bme_archive_append(bme_archive *archive, const bme_archive_record *record)
+{
+  unsigned char buf[RECORD_MAX_SIZE];
+  unsigned char flags = 0;
+  unsigned int len;
+
+  /* a zero time delta would end the block */
+  if (archive->have_last && record->time == archive->last.time)
+    return 0;
+
+  if (archive->have_last && record->time < archive->last.time)
+    flags = BLOCK_FLAG_CLOCK_STEP;
+  else if (archive->used && archive->have_last)
+  {
+    len = encode_record(buf, &archive->last, record);
+    if (archive->used + len <= BME_ARCHIVE_BLOCK_SIZE)
+    {
+      memcpy(archive->buf + archive->used, buf, len);
+      archive->used += len;
+      archive->last = *record;
+      return 0;
+    }
+  }
+
+  /* start a new block with a keyframe */
+  if (archive->used)
+  {
+    if (bme_archive_flush(archive))
+      return -1;
+    archive->block++;
+  }
+
+  if (archive->block >= archive->max_blocks && archive_rotate(archive))
+    return -1;
+
+  if (index_set(&archive->index, archive->block, record->time, flags, 0))
+    return -1;
+
+  memset(archive->buf, 0, sizeof(archive->buf));
+  archive->used = encode_keyframe(archive->buf, record, flags);
+  archive->flushed = 0;
+  archive->last = *record;
+  archive->have_last = 1;
+
+  return 0;
+}
+
+typedef struct {
+  uint32_t from;
+  uint32_t to;
+  uint32_t step;
+  bme_archive_func func;
+  void *data;
+  int stop;  /* func asked to stop */
+  int done;  /* past to in the current block */
+  /* current downsampling bucket */
+  uint32_t bucket;
+  uint32_t count;
+  int64_t sum[5];
+  int32_t flags;
+} query_state;
+
+static void query_emit_bucket(query_state *query)
+{
+  bme_archive_record record;
+
+  if (!query->count || query->stop)
+    return;
+
+  record.time = query->from + query->bucket * query->step;
+  record.charge_full = query->sum[0] / query->count;
+  record.charge_now = query->sum[1] / query->count;
+  record.voltage = query->sum[2] / query->count;
+  record.temp = query->sum[3] / query->count;
+  record.flags = query->flags;
+  query->count = 0;
+
+  query->stop = query->func(&record, query->data);
+}
+
+static void query_record(query_state *query, const bme_archive_record *record)
+{
+  uint32_t bucket;
+
+  if (record->time < query->from)
+    return;
+  if (record->time > query->to)
+  {
+    query->done = 1;
+    return;
+  }
+
+  if (!query->step)
+  {
+    query->stop = query->func(record, query->data);
+    return;
+  }
+
+  bucket = (record->time - query->from) / query->step;
+  if (query->count && bucket != query->bucket)
+    query_emit_bucket(query);
+  if (!query->count)
+  {
+    query->bucket = bucket;
+    memset(query->sum, 0, sizeof(query->sum));
+    query->flags = 0;
+  }
+
+  query->sum[0] += record->charge_full;
+  query->sum[1] += record->charge_now;
+  query->sum[2] += record->voltage;
+  query->sum[3] += record->temp;
+  if (record->flags >= 0)
+    query->flags |= record->flags;
+  query->count++;
+}
+
+/* the first block of [start, end) that can hold from: the last one
+ * starting at or before it, as a block ends where the next one starts */
+static uint32_t index_find(const block_index *index, uint32_t start, uint32_t end, uint32_t from)
+{
+  uint32_t lo = start, hi = end;
+
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (index->blocks[mid].time <= from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  /* records of a broken block are lost, the ones before may reach from */
+  while (lo > start + 1 && index->blocks[lo - 1].broken)
+    lo--;
+
+  return lo > start ? lo - 1 : start;
+}
+
+/* archive is set for the live file, whose tail block may only be in memory.
+ * A clock step back breaks the time order of the blocks, so each run of
+ * blocks up to the next step is searched on its own. */
+static void query_file(query_state *query, bme_archive *archive, int fd, const block_index *index)
+{
+  unsigned char buf[BME_ARCHIVE_BLOCK_SIZE];
+  uint32_t start, end, block;
+
+  for (start = 0; start < index->count && !query->stop; start = end)
+  {
+    for (end = start + 1; end < index->count; end++)
+      if (!index->blocks[end].broken && (index->blocks[end].flags & BLOCK_FLAG_CLOCK_STEP))
+        break;
+
+    query->done = 0;
+    for (block = index_find(index, start, end, query->from);
+         block < end && !query->stop && !query->done; block++)
+    {
+      block_cursor cursor;
+
+      if (index->blocks[block].broken)
+        continue;
+      if (index->blocks[block].time > query->to)
+        break;
+
+      memset(&cursor, 0, sizeof(cursor));
+      if (archive && block == archive->block && archive->used)
+        cursor.buf = archive->buf;
+      else if (read_block(fd, block, buf, sizeof(buf)))
+        continue;
+      else
+        cursor.buf = buf;
+
+      while (!query->stop && !query->done && cursor_next(&cursor))
+        query_record(query, &cursor.record);
+    }
+  }
+}
+
+int bme_archive_query(bme_archive *archive, uint32_t from, uint32_t to, uint32_t step,
+                      bme_archive_func func, void *data)
+{
+  query_state query;
+
+  if (from > to)
+    return 0;
+
+  memset(&query, 0, sizeof(query));
+  query.from = from;
+  query.to = to;
+  query.step = step;
+  query.func = func;
+  query.data = data;
+
+  if (archive->old_fd >= 0)
+    query_file(&query, NULL, archive->old_fd, &archive->old_index);
+
+  if (!query.stop)
+    query_file(&query, archive, archive->fd, &archive->index);
+
+  query_emit_bucket(&query);
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * bme-archive.h: long-term battery history for hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _BME_ARCHIVE_H_
+#define _BME_ARCHIVE_H_
+
+#include <stdint.h>
+
+/*
+ * The archive is a sequence of fixed size blocks. Every block starts with
+ * a keyframe (block header with absolute time and values), followed by
+ * records holding varint time delta and zigzag varint deltas of all fields.
+ * A zero byte or the end of block terminates the records.
+ *
+ * Blocks are ordered by time unless the clock was stepped back, then a
+ * new block is started and flagged. The start time and flags of every
+ * block are kept in memory, so a time lookup binary searches each run of
+ * blocks between clock steps and only decodes the blocks that can match.
+ * Samples are buffered in memory and only written out by
+ * bme_archive_flush() or when a block is full. Once the file grows past
+ * max_blocks it is moved to <path>.old and a new file is started.
+ */
+
+#define BME_ARCHIVE_BLOCK_SIZE 1024
+
+typedef struct {
+  uint32_t time;        /* seconds since epoch */
+  uint32_t charge_full; /* mAh */
+  uint32_t charge_now;  /* mAh */
+  uint32_t voltage;     /* mV */
+  int32_t temp;         /* 1/10 degree Celsius */
+  int32_t flags;        /* bq27200 flags register, -1 when unknown */
+} bme_archive_record;
+
+typedef struct bme_archive bme_archive;
+
+/* return non-zero to stop the query */
+typedef int (*bme_archive_func)(const bme_archive_record *record, void *data);
+
+bme_archive *bme_archive_open(const char *path, unsigned int max_blocks);
+void bme_archive_close(bme_archive *archive);
+
+/* a record at the time of the last one is dropped, an older one starts
+ * a new block */
+int bme_archive_append(bme_archive *archive, const bme_archive_record *record);
+int bme_archive_flush(bme_archive *archive);
+
+/* call func for records in [from, to]; with step > 0 records are averaged
+ * into buckets of step seconds (flags are or-ed) */
+int bme_archive_query(bme_archive *archive, uint32_t from, uint32_t to, uint32_t step,
+                      bme_archive_func func, void *data);
+
+#endif /* _BME_ARCHIVE_H_ */
@@ -0,0 +1,365 @@
+/*
+ * bme-charger.c: charger detection of hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "bme-loop.h"
+#include "bme-charger.h"
+
+#define POWER_SUPPLY_CLASS "/sys/class/power_supply"
+#define EXTCON_CLASS "/sys/class/extcon"
+
+/* uevents are a few hundred bytes, power_supply ones up to a page */
+#define UEVENT_BUFFER_SIZE 4096
+
+typedef struct {
+  char name[NAME_MAX + 1];      /* sysfs directory, empty when there is none */
+  bme_charger charger;
+} charger_source;
+
+static const char *sysfs_root = NULL;
+static bme_charger_func charger_changed = NULL;
+static charger_source power_supply;
+static charger_source extcon;
+static bme_charger last_charger = CHARGER_NONE;
+
+static const struct {
+  const char *cable;
+  bme_charger charger;
+} extcon_cables[] = {
+  { "USB", CHARGER_HOST_500 },
+  { "SDP", CHARGER_HOST_500 },
+  { "CDP", CHARGER_HOST_500 },
+  { "CHARGE-DOWNSTREAM", CHARGER_HOST_500 },
+  { "DCP", CHARGER_WALL },
+  { "TA", CHARGER_WALL },
+  { "ACA", CHARGER_WALL },
+  { "FAST-CHARGER", CHARGER_WALL },
+  { "SLOW-CHARGER", CHARGER_WALL },
+};
+
+/* value of key in NUL separated key=value pairs, the uevent format */
+static const char * uevent_get(const char *vars, size_t len, const char *key)
+{
+  const char *end = vars + len;
+  size_t key_len = strlen(key);
+
+  for (; vars < end; vars += strlen(vars) + 1)
+    if (!strncmp(vars, key, key_len) && vars[key_len] == '=')
+      return vars + key_len + 1;
+
+  return NULL;
+}
+
+/* POWER_SUPPLY_TYPE (USB, USB_DCP, ...) or the [selected] entry of
+ * POWER_SUPPLY_USB_TYPE (SDP, DCP, ...) */
+static bme_charger usb_type_charger(const char *type, int current_max_ua)
+{
+  const char *selected = strchr(type, '[');
+
+  if (selected)
+    type = selected + 1;
+  if (!strncmp(type, "USB_", 4))
+    type += 4;
+
+  if (!strncmp(type, "DCP", 3) || !strncmp(type, "ACA", 3) || !strncmp(type, "PD", 2))
+    return CHARGER_WALL;
+  if (!strncmp(type, "CDP", 3))
+    return CHARGER_HOST_500;
+
+  /* a host allows 100 mA until it enumerated us */
+  if ((!strncmp(type, "USB", 3) || !strncmp(type, "SDP", 3)) &&
+      (current_max_ua < 0 || current_max_ua > 100000))
+    return CHARGER_HOST_500;
+
+  return CHARGER_HOST_100;
+}
+
+static bme_charger power_supply_charger(const char *vars, size_t len)
+{
+  const char *online = uevent_get(vars, len, "POWER_SUPPLY_ONLINE");
+  const char *type = uevent_get(vars, len, "POWER_SUPPLY_USB_TYPE");
+  const char *current_max = uevent_get(vars, len, "POWER_SUPPLY_CURRENT_MAX");
+
+  if (!online || !atoi(online))
+    return CHARGER_NONE;
+
+  if (!type)
+    type = uevent_get(vars, len, "POWER_SUPPLY_TYPE");
+
+  return usb_type_charger(type ? type : "", current_max ? atoi(current_max) : -1);
+}
+
+/* cable=0/1 lines of the extcon state, returns how many of them are
+ * charger cables */
+static int extcon_parse(const char *state, bme_charger *charger)
+{
+  size_t len, cable_len;
+  const char *value;
+  unsigned int i;
+  int n = 0;
+
+  *charger = CHARGER_NONE;
+
+  for (; *state; state += len + (state[len] != 0))
+  {
+    len = strcspn(state, "\n");
+    value = memchr(state, '=', len);
+    if (!value)
+      continue;
+    cable_len = value - state;
+
+    for (i = 0; i < sizeof(extcon_cables)/sizeof(extcon_cables[0]); i++)
+      if (strlen(extcon_cables[i].cable) == cable_len &&
+          !strncmp(extcon_cables[i].cable, state, cable_len))
+      {
+        n++;
+        if (value[1] == '1' && extcon_cables[i].charger > *charger)
+          *charger = extcon_cables[i].charger;
+      }
+  }
+
+  return n;
+}
+
+static int read_file(const char *class, const char *name, const char *file, char *buf, size_t size)
+{
+  char path[256];
+  ssize_t len;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s%s/%s/%s", sysfs_root ? sysfs_root : "", class, name, file);
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return -1;
+  len = read(fd, buf, size - 1);
+  close(fd);
+  if (len < 0)
+    return -1;
+  buf[len] = 0;
+
+  return len;
+}
+
+static void power_supply_read(void)
+{
+  char buf[2048];
+  int len, i;
+
+  if ((len = read_file(POWER_SUPPLY_CLASS, power_supply.name, "uevent", buf, sizeof(buf))) < 0)
+    return;
+
+  /* the file has a pair per line, uevents NUL separated ones */
+  for (i = 0; i < len; i++)
+    if (buf[i] == '\n')
+      buf[i] = 0;
+
+  power_supply.charger = power_supply_charger(buf, len);
+}
+
+static void extcon_read(void)
+{
+  char buf[512];
+
+  if (read_file(EXTCON_CLASS, extcon.name, "state", buf, sizeof(buf)) >= 0)
+    extcon_parse(buf, &extcon.charger);
+}
+
+/* the first USB power_supply and the first extcon with charger cables */
+static void sources_find(void)
+{
+  char path[256], buf[512];
+  struct dirent *entry;
+  bme_charger charger;
+  DIR *dir;
+
+  snprintf(path, sizeof(path), "%s%s", sysfs_root ? sysfs_root : "", POWER_SUPPLY_CLASS);
+  if ((dir = opendir(path)))
+  {
+    while (!power_supply.name[0] && (entry = readdir(dir)))
+      if (entry->d_name[0] != '.' &&
+          read_file(POWER_SUPPLY_CLASS, entry->d_name, "type", buf, sizeof(buf)) > 0 &&
+          !strncmp(buf, "USB", 3))
+        snprintf(power_supply.name, sizeof(power_supply.name), "%s", entry->d_name);
+    closedir(dir);
+  }
+
+  snprintf(path, sizeof(path), "%s%s", sysfs_root ? sysfs_root : "", EXTCON_CLASS);
+  if ((dir = opendir(path)))
+  {
+    while (!extcon.name[0] && (entry = readdir(dir)))
+      if (entry->d_name[0] != '.' &&
+          read_file(EXTCON_CLASS, entry->d_name, "state", buf, sizeof(buf)) > 0 &&
+          extcon_parse(buf, &charger) > 0)
+        snprintf(extcon.name, sizeof(extcon.name), "%s", entry->d_name);
+    closedir(dir);
+  }
+}
+
+static void uevent_process(const char *vars, size_t len)
+{
+  const char *subsystem = uevent_get(vars, len, "SUBSYSTEM");
+  const char *name, *state;
+
+  if (!subsystem)
+    return;
+
+  if (!strcmp(subsystem, "power_supply"))
+  {
+    const char *type = uevent_get(vars, len, "POWER_SUPPLY_TYPE");
+
+    if (!(name = uevent_get(vars, len, "POWER_SUPPLY_NAME")))
+      return;
+
+    /* a charger driver loaded after us */
+    if (!power_supply.name[0] && type && !strncmp(type, "USB", 3))
+      snprintf(power_supply.name, sizeof(power_supply.name), "%s", name);
+
+    if (!strcmp(name, power_supply.name))
+      power_supply.charger = power_supply_charger(vars, len);
+  }
+  else if (!strcmp(subsystem, "extcon") && extcon.name[0])
+  {
+    if (!(name = uevent_get(vars, len, "DEVPATH")) || !(name = strrchr(name, '/')) ||
+        strcmp(name + 1, extcon.name))
+      return;
+
+    if ((state = uevent_get(vars, len, "STATE")))
+      extcon_parse(state, &extcon.charger);
+    else
+      extcon_read();
+  }
+}
+
+static int uevent_cb(int fd, unsigned int events, void *data)
+{
+  char buf[UEVENT_BUFFER_SIZE + 1];
+  struct sockaddr_nl addr;
+  socklen_t addr_len;
+  bme_charger charger;
+  ssize_t len;
+
+  (void)data;
+
+  if (!(events & BME_LOOP_IN))
+  {
+    close(fd);
+    return 0;
+  }
+
+  for (;;)
+  {
+    addr_len = sizeof(addr);
+    len = recvfrom(fd, buf, UEVENT_BUFFER_SIZE, 0, (struct sockaddr *)&addr, &addr_len);
+    if (len < 0)
+      break;
+
+    /* only the kernel, the header is action@devpath */
+    if (addr.nl_pid != 0 || !memchr(buf, '@', strnlen(buf, len)))
+      continue;
+    buf[len] = 0;
+
+    uevent_process(buf, len);
+  }
+
+  if (errno != EAGAIN && errno != EINTR && errno != ENOBUFS)
+  {
+    close(fd);
+    return 0;
+  }
+
+  if (bme_charger_get(&charger) && charger != last_charger)
+  {
+    last_charger = charger;
+    if (charger_changed)
+      charger_changed(charger);
+  }
+
+  return 1;
+}
+
+static int uevent_open(void)
+{
+  struct sockaddr_nl addr;
+  int fd;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    return -1;
+
+  /* group 1 are the kernel's uevents, not udev's */
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      !bme_loop_io_add(fd, BME_LOOP_IN, uevent_cb, NULL))
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int bme_charger_init(const char *root, bme_charger_func changed)
+{
+  sysfs_root = root;
+  charger_changed = changed;
+
+  sources_find();
+  bme_charger_refresh();
+
+  /* a fake tree is read on every poll instead */
+  if (!root)
+    uevent_open();
+
+  return bme_charger_get(&last_charger);
+}
+
+void bme_charger_refresh(void)
+{
+  if (power_supply.name[0])
+    power_supply_read();
+  if (extcon.name[0])
+    extcon_read();
+
+  bme_charger_get(&last_charger);
+}
+
+int bme_charger_get(bme_charger *charger)
+{
+  if (power_supply.name[0])
+    *charger = power_supply.charger;
+  else if (extcon.name[0])
+    *charger = extcon.charger;
+  else
+    return 0;
+
+  return 1;
+}
@@ -0,0 +1,46 @@
+/*
+ * bme-charger.h: charger detection of hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _BME_CHARGER_H_
+#define _BME_CHARGER_H_
+
+#include "bme-policy.h"
+
+/*
+ * The USB power_supply device (type USB*) and the extcon device of the
+ * USB port know what was plugged in well before the bq24150a mode
+ * follows. Both are found in sysfs once, after that their kernel uevents
+ * are parsed into a bme_charger as they arrive, nothing is polled. The
+ * power_supply wins when both exist.
+ */
+
+typedef void (*bme_charger_func)(bme_charger charger);
+
+/* root is a fake sysfs tree or NULL. A fake tree sends no uevents, it is
+ * read again by bme_charger_refresh. changed is called from the main
+ * loop when the detected charger changes. Returns zero when there is
+ * nothing to detect with. */
+int bme_charger_init(const char *root, bme_charger_func changed);
+
+/* reads sysfs again, for a fake tree */
+void bme_charger_refresh(void);
+
+/* returns zero when there is no detection source */
+int bme_charger_get(bme_charger *charger);
+
+#endif /* _BME_CHARGER_H_ */
@@ -0,0 +1,357 @@
+/*
+ * bme-client.c: cached battery state for hald-addon-bme clients
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbus-names.h"
+#include "bme-client.h"
+
+#define BME_SIGNAL_MATCH \
+  "type='signal',sender='" BME_SERVICE "',path='" BME_SIGNAL_PATH "',interface='" BME_SIGNAL_IF "'," \
+  "member='" BME_STATE_CHANGED "'"
+
+#define BME_OWNER_MATCH \
+  "type='signal',sender='" DBUS_SERVICE_DBUS "',path='" DBUS_PATH_DBUS "',interface='" DBUS_INTERFACE_DBUS "'," \
+  "member='NameOwnerChanged',arg0='" BME_SERVICE "'"
+
+typedef struct {
+  bme_client_func func;
+  void *user_data;
+} bme_client_callback;
+
+struct bme_client {
+  DBusConnection *connection;
+  DBusPendingCall *seed;
+  /* fields signalled while the seed call was in flight, those are newer */
+  unsigned int signalled;
+  bme_client_state state;
+  bme_client_callback *callbacks;
+  unsigned int n_callbacks;
+};
+
+static void notify(bme_client *client, unsigned int changed)
+{
+  unsigned int i;
+
+  if (!changed)
+    return;
+
+  for (i = 0; i < client->n_callbacks; i++)
+    if (client->callbacks[i].func)
+      client->callbacks[i].func(client, &client->state, changed, client->callbacks[i].user_data);
+}
+
+#define UPDATE(client, field, value, bit, changed) do { \
+  if ((client)->state.field != (value)) \
+  { \
+    (client)->state.field = (value); \
+    *(changed) |= (bit); \
+  } \
+} while (0)
+
+static bme_client_capacity_state parse_capacity_state(const char *state)
+{
+  if (!strcmp(state, "ok"))
+    return BME_CLIENT_CAPACITY_OK;
+  if (!strcmp(state, "low"))
+    return BME_CLIENT_CAPACITY_LOW;
+  if (!strcmp(state, "empty"))
+    return BME_CLIENT_CAPACITY_EMPTY;
+  if (!strcmp(state, "full"))
+    return BME_CLIENT_CAPACITY_FULL;
+
+  return BME_CLIENT_CAPACITY_UNKNOWN;
+}
+
+/* apply an a{sv} with BME_PROPERTY_* keys, skipping fields in the mask;
+ * fields present in the dict are or-ed into seen */
+static unsigned int apply_properties(bme_client *client, DBusMessageIter *array, unsigned int skip,
+                                     unsigned int *seen)
+{
+  DBusMessageIter dict, entry, variant;
+  unsigned int changed = 0;
+  unsigned int present = 0;
+
+  if (dbus_message_iter_get_arg_type(array) != DBUS_TYPE_ARRAY)
+    return 0;
+
+  for (dbus_message_iter_recurse(array, &dict);
+       dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY;
+       dbus_message_iter_next(&dict))
+  {
+    const char *key;
+    dbus_bool_t b = 0;
+    dbus_uint32_t u = 0;
+    const char *s = "";
+    unsigned int field;
+    int type;
+
+    dbus_message_iter_recurse(&dict, &entry);
+    if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+      continue;
+    dbus_message_iter_get_basic(&entry, &key);
+    dbus_message_iter_next(&entry);
+    if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_VARIANT)
+      continue;
+    dbus_message_iter_recurse(&entry, &variant);
+
+    type = dbus_message_iter_get_arg_type(&variant);
+    if (type == DBUS_TYPE_BOOLEAN)
+      dbus_message_iter_get_basic(&variant, &b);
+    else if (type == DBUS_TYPE_UINT32)
+      dbus_message_iter_get_basic(&variant, &u);
+    else if (type == DBUS_TYPE_STRING)
+      dbus_message_iter_get_basic(&variant, &s);
+    else
+      continue;
+
+    if (!strcmp(key, BME_PROPERTY_CHARGER_CONNECTED))
+      field = BME_CLIENT_CHANGED_CHARGER_CONNECTED;
+    else if (!strcmp(key, BME_PROPERTY_CHARGING))
+      field = BME_CLIENT_CHANGED_CHARGING;
+    else if (!strcmp(key, BME_PROPERTY_BARS) || !strcmp(key, BME_PROPERTY_BARS_MAX))
+      field = BME_CLIENT_CHANGED_BARS;
+    else if (!strcmp(key, BME_PROPERTY_PERCENTAGE))
+      field = BME_CLIENT_CHANGED_PERCENTAGE;
+    else if (!strcmp(key, BME_PROPERTY_CAPACITY_STATE))
+      field = BME_CLIENT_CHANGED_CAPACITY_STATE;
+    else if (!strcmp(key, BME_PROPERTY_TIMELEFT_IDLE) || !strcmp(key, BME_PROPERTY_TIMELEFT_ACTIVE))
+      field = BME_CLIENT_CHANGED_TIMELEFT;
+    else
+      continue;
+
+    present |= field;
+    if (skip & field)
+      continue;
+
+    if (!strcmp(key, BME_PROPERTY_CHARGER_CONNECTED))
+      UPDATE(client, charger_connected, !!b, field, &changed);
+    else if (!strcmp(key, BME_PROPERTY_CHARGING))
+      UPDATE(client, charging, !!b, field, &changed);
+    else if (!strcmp(key, BME_PROPERTY_BARS))
+      UPDATE(client, bars, u, field, &changed);
+    else if (!strcmp(key, BME_PROPERTY_BARS_MAX))
+      UPDATE(client, bars_max, u, field, &changed);
+    else if (!strcmp(key, BME_PROPERTY_PERCENTAGE))
+      UPDATE(client, percentage, u, field, &changed);
+    else if (!strcmp(key, BME_PROPERTY_CAPACITY_STATE))
+      UPDATE(client, capacity_state, parse_capacity_state(s), field, &changed);
+    else if (!strcmp(key, BME_PROPERTY_TIMELEFT_IDLE))
+      UPDATE(client, timeleft_idle, u, field, &changed);
+    else
+      UPDATE(client, timeleft_active, u, field, &changed);
+  }
+
+  if (seen)
+    *seen |= present;
+
+  return changed;
+}
+
+static unsigned int set_valid(bme_client *client, int valid)
+{
+  if (client->state.valid == valid)
+    return 0;
+
+  client->state.valid = valid;
+
+  return BME_CLIENT_CHANGED_VALID;
+}
+
+static void seed_reply(DBusPendingCall *pending, void *user_data)
+{
+  bme_client *client = user_data;
+  DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+  DBusMessageIter iter;
+  unsigned int changed = 0;
+
+  dbus_pending_call_unref(client->seed);
+  client->seed = NULL;
+
+  if (!reply)
+    return;
+
+  if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+      dbus_message_iter_init(reply, &iter))
+  {
+    changed = apply_properties(client, &iter, client->signalled, NULL);
+    changed |= set_valid(client, 1);
+  }
+  dbus_message_unref(reply);
+
+  notify(client, changed);
+}
+
+static void seed(bme_client *client)
+{
+  DBusMessage *msg;
+
+  if (client->seed)
+  {
+    dbus_pending_call_cancel(client->seed);
+    dbus_pending_call_unref(client->seed);
+    client->seed = NULL;
+  }
+
+  client->signalled = 0;
+
+  msg = dbus_message_new_method_call(BME_SERVICE, BME_REQUEST_PATH, BME_REQUEST_IF, BME_STATUS_SNAPSHOT_REQ);
+  if (!msg)
+    return;
+
+  if (dbus_connection_send_with_reply(client->connection, msg, &client->seed, DBUS_TIMEOUT_USE_DEFAULT) &&
+      client->seed)
+    dbus_pending_call_set_notify(client->seed, seed_reply, client, NULL);
+
+  dbus_message_unref(msg);
+}
+
+static DBusHandlerResult filter(DBusConnection *connection, DBusMessage *message, void *user_data)
+{
+  bme_client *client = user_data;
+  const char *interface = dbus_message_get_interface(message);
+
+  (void)connection;
+
+  if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL || !interface)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_is_signal(message, BME_SIGNAL_IF, BME_STATE_CHANGED))
+  {
+    const char *path = dbus_message_get_path(message);
+    DBusMessageIter iter;
+
+    /* fields signalled while the seed call is in flight are newer */
+    if (path && !strcmp(path, BME_SIGNAL_PATH) && dbus_message_iter_init(message, &iter))
+      notify(client, apply_properties(client, &iter, 0, &client->signalled));
+  }
+  else if (dbus_message_is_signal(message, DBUS_INTERFACE_DBUS, "NameOwnerChanged"))
+  {
+    const char *name, *old_owner, *new_owner;
+
+    if (dbus_message_get_args(message, NULL,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_STRING, &old_owner,
+                              DBUS_TYPE_STRING, &new_owner,
+                              DBUS_TYPE_INVALID) &&
+        !strcmp(name, BME_SERVICE))
+    {
+      /* addon went away or was restarted, the cache is stale */
+      notify(client, set_valid(client, 0));
+      if (*new_owner)
+        seed(client);
+    }
+  }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+bme_client *bme_client_new(DBusConnection *connection)
+{
+  bme_client *client;
+
+  if (!connection)
+    return NULL;
+
+  client = calloc(1, sizeof(*client));
+  if (!client)
+    return NULL;
+
+  client->connection = dbus_connection_ref(connection);
+
+  if (!dbus_connection_add_filter(connection, filter, client, NULL))
+  {
+    dbus_connection_unref(connection);
+    free(client);
+    return NULL;
+  }
+
+  dbus_bus_add_match(connection, BME_SIGNAL_MATCH, NULL);
+  dbus_bus_add_match(connection, BME_OWNER_MATCH, NULL);
+
+  seed(client);
+
+  return client;
+}
+
+void bme_client_free(bme_client *client)
+{
+  if (!client)
+    return;
+
+  if (client->seed)
+  {
+    dbus_pending_call_cancel(client->seed);
+    dbus_pending_call_unref(client->seed);
+  }
+
+  dbus_bus_remove_match(client->connection, BME_SIGNAL_MATCH, NULL);
+  dbus_bus_remove_match(client->connection, BME_OWNER_MATCH, NULL);
+  dbus_connection_remove_filter(client->connection, filter, client);
+  dbus_connection_unref(client->connection);
+
+  free(client->callbacks);
+  free(client);
+}
+
+const bme_client_state *bme_client_get_state(bme_client *client)
+{
+  return &client->state;
+}
+
+int bme_client_add_callback(bme_client *client, bme_client_func func, void *user_data)
+{
+  bme_client_callback *callbacks;
+  unsigned int i;
+
+  if (!func)
+    return -1;
+
+  /* reuse slots freed by bme_client_remove_callback() */
+  for (i = 0; i < client->n_callbacks; i++)
+    if (!client->callbacks[i].func)
+      break;
+
+  if (i == client->n_callbacks)
+  {
+    callbacks = realloc(client->callbacks, (client->n_callbacks + 1) * sizeof(*callbacks));
+    if (!callbacks)
+      return -1;
+    client->callbacks = callbacks;
+    client->n_callbacks++;
+  }
+
+  client->callbacks[i].func = func;
+  client->callbacks[i].user_data = user_data;
+
+  return 0;
+}
+
+void bme_client_remove_callback(bme_client *client, bme_client_func func, void *user_data)
+{
+  unsigned int i;
+
+  /* only clear the slot, this may be called from within a callback */
+  for (i = 0; i < client->n_callbacks; i++)
+    if (client->callbacks[i].func == func && client->callbacks[i].user_data == user_data)
+    {
+      client->callbacks[i].func = NULL;
+      break;
+    }
+}
@@ -0,0 +1,69 @@
+/**
+ * @file bme-client.h
+ *
+ * Cached view of the battery state published by hald-addon-bme.
+ *
+ * The state is seeded once with a status_snapshot_req call and then kept
+ * up to date from the state_changed broadcasts, so reading it is a plain
+ * memory access and the client wakes up at most once per addon update.
+ * The client hooks into the given connection with a filter; the
+ * connection has to be dispatched by the caller's main loop
+ * (e.g. dbus_connection_setup_with_g_main()).
+ */
+#ifndef _BME_CLIENT_H_
+#define _BME_CLIENT_H_
+
+#include <dbus/dbus.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  BME_CLIENT_CAPACITY_UNKNOWN = 0,
+  BME_CLIENT_CAPACITY_OK,
+  BME_CLIENT_CAPACITY_LOW,
+  BME_CLIENT_CAPACITY_EMPTY,
+  BME_CLIENT_CAPACITY_FULL
+} bme_client_capacity_state;
+
+/* bits of the changed mask passed to callbacks */
+#define BME_CLIENT_CHANGED_VALID		(1 << 0)
+#define BME_CLIENT_CHANGED_CHARGER_CONNECTED	(1 << 1)
+#define BME_CLIENT_CHANGED_CHARGING		(1 << 2)
+#define BME_CLIENT_CHANGED_BARS			(1 << 3)
+#define BME_CLIENT_CHANGED_PERCENTAGE		(1 << 4)
+#define BME_CLIENT_CHANGED_CAPACITY_STATE	(1 << 5)
+#define BME_CLIENT_CHANGED_TIMELEFT		(1 << 6)
+
+typedef struct {
+  int valid;                  /* false until seeded or signalled */
+  int charger_connected;
+  int charging;
+  unsigned int bars;
+  unsigned int bars_max;
+  unsigned int percentage;
+  bme_client_capacity_state capacity_state;
+  unsigned int timeleft_idle;   /* minutes */
+  unsigned int timeleft_active; /* minutes */
+} bme_client_state;
+
+typedef struct bme_client bme_client;
+
+typedef void (*bme_client_func)(bme_client *client, const bme_client_state *state,
+                                unsigned int changed, void *user_data);
+
+/* connection must be a system bus connection */
+bme_client *bme_client_new(DBusConnection *connection);
+void bme_client_free(bme_client *client);
+
+const bme_client_state *bme_client_get_state(bme_client *client);
+
+int bme_client_add_callback(bme_client *client, bme_client_func func, void *user_data);
+void bme_client_remove_callback(bme_client *client, bme_client_func func, void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BME_CLIENT_H_ */
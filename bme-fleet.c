@@ -0,0 +1,558 @@
+/*
+ * bme-fleet.c: drive many simulated batteries through the hald-addon-bme policy
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * For capacity tests of hald and the UI stack against many batteries, one
+ * process simulates --count of them. Each one gets its own hald device,
+ * FLEET_UDI_PREFIX<n>, carrying the same battery.* and maemo.* properties
+ * hald-addon-bme publishes.
+ *
+ * A battery is a small charge/load model standing in for the bq27200,
+ * rx51-battery and bq24150a sysfs files. It runs the model, then turns it
+ * into the same sample the addon would read and evaluates it with
+ * bme_policy_evaluate() against its own policy state. Only properties
+ * that changed go to hald, all of one battery in a single changeset.
+ *
+ * Every battery is sampled once per --period. The samples are spread
+ * evenly over the period, so hald sees a steady trickle of changesets
+ * instead of a burst of --count of them. --speed runs the simulated clock
+ * faster than the real one, and --dry-run leaves hald out to measure the
+ * simulation alone. On exit the devices are removed again and the CPU
+ * time used is printed.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include <hal/libhal.h>
+
+#include "bme-policy.h"
+
+#define FLEET_UDI_PREFIX "/org/freedesktop/Hal/devices/bme_fleet_"
+#define FLEET_TICK_MS 100
+
+#define FLEET_CHARGE_DESIGN 1320        /* mAh, BL-5J */
+#define FLEET_VOLTAGE_DESIGN 4200       /* mV */
+#define FLEET_CHARGE_CURRENT 600        /* mA */
+#define FLEET_RESISTANCE 150            /* mOhm */
+
+/* what was last sent to hald */
+typedef struct {
+  uint16_t voltage;
+  uint16_t charge_now;
+  uint8_t bars;
+  uint8_t percentage;
+  uint8_t capacity_state;
+  uint8_t charger_connected : 1;
+  uint8_t is_charging : 1;
+  uint8_t positive_rate : 1;
+} fleet_published;
+
+/* per battery state, kept small so thousands of them stay in cache */
+typedef struct {
+  bme_policy_state policy;
+  fleet_published published;
+  uint32_t charge;                /* uAh */
+  uint16_t charge_full;           /* mAh */
+  uint16_t load;                  /* mA drawn without a charger */
+  uint8_t plug_below;             /* % at which the charger is plugged in */
+  uint8_t charger;
+  uint32_t random;
+  time_t next_event;            /* simulated, load or charger changes */
+} fleet_battery;
+
+typedef struct {
+  uint32_t samples;
+  uint32_t changesets;
+  uint32_t properties;
+  uint32_t failed;
+} fleet_stats;
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig)
+{
+  (void)sig;
+  stop = 1;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -n, --count N      number of batteries (100)\n"
+          "  -p, --period S     sampling period of every battery in seconds (30)\n"
+          "  -s, --speed X      simulated seconds per real second (1)\n"
+          "  -t, --time S       stop after S real seconds, 0 runs until SIGINT (0)\n"
+          "  -d, --dry-run      do not create hald devices\n",
+          name);
+}
+
+static uint32_t fleet_random(fleet_battery *b)
+{
+  /* xorshift32 */
+  b->random ^= b->random << 13;
+  b->random ^= b->random >> 17;
+  b->random ^= b->random << 5;
+  return b->random;
+}
+
+static void fleet_udi(char *udi, size_t size, unsigned int index)
+{
+  snprintf(udi, size, FLEET_UDI_PREFIX "%u", index);
+}
+
+static void fleet_battery_init(fleet_battery *b, unsigned int index, time_t now)
+{
+  memset(b, 0, sizeof(*b));
+  bme_policy_state_init(&b->policy);
+  b->random = 2463534242u + index*2654435761u;
+  b->charge_full = FLEET_CHARGE_DESIGN - fleet_random(b)%150;
+  b->charge = (uint32_t)b->charge_full*(20 + fleet_random(b)%81)*10;
+  b->plug_below = 5 + fleet_random(b)%40;
+  b->next_event = now;
+}
+
+/* advance the model by elapsed seconds and fill in what sysfs would show */
+static void fleet_battery_step(fleet_battery *b, time_t now, time_t elapsed, battery *sample)
+{
+  uint32_t full = b->charge_full*1000;
+  int32_t current;
+  int32_t ocv;
+  int percent;
+
+  if (now >= b->next_event)
+  {
+    /* mostly idle, now and then a few minutes of heavy use */
+    b->load = fleet_random(b)%4 ? 10 + fleet_random(b)%30 : 150 + fleet_random(b)%350;
+    b->next_event = now + 60 + fleet_random(b)%900;
+    if (b->charger && b->charge >= full && fleet_random(b)%4 == 0)
+      b->charger = 0;
+  }
+
+  percent = 100ULL*b->charge/full;
+  if (!b->charger && percent < b->plug_below)
+    b->charger = 1;
+
+  if (b->charger)
+  {
+    /* constant current, tapering off over the last 10 % */
+    current = -FLEET_CHARGE_CURRENT;
+    if (percent >= 90)
+      current = -(FLEET_CHARGE_CURRENT*(100 - percent)/10 + 20);
+    if (b->charge >= full)
+      current = 0;
+  }
+  else
+    current = b->load;
+
+  if (current > 0 && (uint32_t)current*elapsed*10/36 > b->charge)
+    b->charge = 0;
+  else
+    b->charge -= current*elapsed*10/36;
+  if (b->charge > full)
+    b->charge = full;
+
+  percent = 100ULL*b->charge/full;
+  ocv = 3300 + 9*percent;
+
+  memset(sample, 0, sizeof(*sample));
+  sample->power_supply_capacity = percent;
+  sample->power_supply_charge_now = b->charge/1000;
+  sample->power_supply_charge_full = b->charge_full;
+  sample->power_supply_charge_design = FLEET_CHARGE_DESIGN;
+  sample->power_supply_voltage_design = FLEET_VOLTAGE_DESIGN;
+  sample->power_supply_current_now = current;
+  sample->power_supply_voltage_now = ocv - current*FLEET_RESISTANCE/1000;
+  sample->power_supply_flags_register = percent <= 6 ? 0x02 : 0;
+  if (b->charge >= full)
+    sample->power_supply_status = STATUS_FULL;
+  else if (current < 0)
+    sample->power_supply_status = STATUS_CHARGING;
+  else
+    sample->power_supply_status = STATUS_DISCHARGING;
+  sample->charger = b->charger ? CHARGER_WALL : CHARGER_NONE;
+}
+
+static const char * capacity_state_string(bme_capacity_state state)
+{
+  switch (state)
+  {
+    case BME_CAPACITY_EMPTY: return "empty";
+    case BME_CAPACITY_LOW: return "low";
+    case BME_CAPACITY_FULL: return "full";
+    default: return "ok";
+  }
+}
+
+/* one changeset with the properties that differ from what hald has */
+static void fleet_battery_publish(LibHalContext *ctx, fleet_battery *b, unsigned int index,
+                                  const bme_policy_result *result, fleet_stats *stats)
+{
+  fleet_published now, *last = &b->published;
+  LibHalChangeSet *cs = NULL;
+  char udi[64];
+  DBusError error;
+  int n = 0;
+
+  memset(&now, 0, sizeof(now));
+  now.voltage = result->battery.power_supply_voltage_now;
+  now.charge_now = result->battery.power_supply_charge_now;
+  now.bars = result->charge_level_current;
+  now.percentage = result->capacity;
+  now.capacity_state = result->capacity_state;
+  now.charger_connected = !!result->charger_connected;
+  now.is_charging = !!result->is_charging;
+  now.positive_rate = !!result->positive_rate;
+
+  if (ctx)
+  {
+    fleet_udi(udi, sizeof(udi), index);
+    cs = libhal_device_new_changeset(udi);
+  }
+
+#define CHANGED(field) (!last->capacity_state || now.field != last->field)
+
+  if (CHANGED(bars))
+  {
+    n++;
+    if (cs)
+      libhal_changeset_set_property_int(cs, "battery.charge_level.current", now.bars);
+  }
+  if (CHANGED(percentage))
+  {
+    n++;
+    if (cs)
+      libhal_changeset_set_property_int(cs, "battery.charge_level.percentage", now.percentage);
+  }
+  if (CHANGED(capacity_state) || result->announce)
+  {
+    n++;
+    if (cs)
+      libhal_changeset_set_property_string(cs, "battery.charge_level.capacity_state",
+                                           capacity_state_string(result->capacity_state));
+  }
+  if (CHANGED(charge_now))
+  {
+    n++;
+    if (cs)
+      libhal_changeset_set_property_int(cs, "battery.reporting.current", now.charge_now);
+  }
+  if (CHANGED(voltage))
+  {
+    n++;
+    if (cs)
+      libhal_changeset_set_property_int(cs, "battery.voltage.current", now.voltage);
+  }
+  if (CHANGED(charger_connected))
+  {
+    n++;
+    if (cs)
+      libhal_changeset_set_property_string(cs, "maemo.charger.connection_status",
+                                           now.charger_connected ? "connected" : "disconnected");
+  }
+  if (CHANGED(is_charging))
+  {
+    n += 3;
+    if (cs)
+    {
+      libhal_changeset_set_property_bool(cs, "battery.rechargeable.is_charging", now.is_charging);
+      libhal_changeset_set_property_bool(cs, "battery.rechargeable.is_discharging", !now.is_charging);
+      libhal_changeset_set_property_string(cs, "maemo.rechargeable.charging_status",
+                                           now.is_charging ? "on" : "off");
+    }
+  }
+  if (CHANGED(positive_rate))
+  {
+    n++;
+    if (cs)
+      libhal_changeset_set_property_bool(cs, "maemo.rechargeable.positive_rate", now.positive_rate);
+  }
+
+#undef CHANGED
+
+  *last = now;
+
+  if (n)
+  {
+    stats->changesets++;
+    stats->properties += n;
+    if (cs)
+    {
+      dbus_error_init(&error);
+      if (!libhal_device_commit_changeset(ctx, cs, &error))
+        stats->failed++;
+      dbus_error_free(&error);
+    }
+  }
+
+  if (cs)
+    libhal_device_free_changeset(cs);
+}
+
+static void fleet_battery_sample(LibHalContext *ctx, const bme_policy_params *params, fleet_battery *b,
+                                 unsigned int index, time_t now, time_t elapsed, fleet_stats *stats)
+{
+  bme_policy_result result;
+  battery sample;
+
+  fleet_battery_step(b, now, elapsed, &sample);
+  bme_policy_evaluate(params, &b->policy, &sample, now, &result);
+  b->policy = result.next;
+  fleet_battery_publish(ctx, b, index, &result, stats);
+  stats->samples++;
+}
+
+/* the static properties hald-addon-bme gets from the fdi file and sets once */
+static int fleet_device_add(LibHalContext *ctx, unsigned int index)
+{
+  char udi[64], product[64];
+  char *tmp_udi;
+  DBusError error;
+  int result = -1;
+
+  dbus_error_init(&error);
+
+  if (!(tmp_udi = libhal_new_device(ctx, &error)))
+    goto out;
+
+  fleet_udi(udi, sizeof(udi), index);
+  snprintf(product, sizeof(product), "Battery (BME fleet %u)", index);
+
+  if (!libhal_device_set_property_string(ctx, tmp_udi, "info.category", "battery", &error) ||
+      !libhal_device_add_capability(ctx, tmp_udi, "battery", &error) ||
+      !libhal_device_set_property_string(ctx, tmp_udi, "info.product", product, &error) ||
+      !libhal_device_set_property_string(ctx, tmp_udi, "battery.type", "pda", &error) ||
+      !libhal_device_set_property_bool(ctx, tmp_udi, "battery.present", 1, &error) ||
+      !libhal_device_set_property_bool(ctx, tmp_udi, "battery.is_rechargeable", 1, &error) ||
+      !libhal_device_set_property_string(ctx, tmp_udi, "battery.charge_level.unit", "bars", &error) ||
+      !libhal_device_set_property_int(ctx, tmp_udi, "battery.charge_level.design", 8, &error) ||
+      !libhal_device_set_property_string(ctx, tmp_udi, "battery.reporting.unit", "mAh", &error) ||
+      !libhal_device_set_property_int(ctx, tmp_udi, "battery.reporting.design", FLEET_CHARGE_DESIGN, &error) ||
+      !libhal_device_set_property_string(ctx, tmp_udi, "battery.voltage.unit", "mV", &error) ||
+      !libhal_device_set_property_int(ctx, tmp_udi, "battery.voltage.design", FLEET_VOLTAGE_DESIGN, &error) ||
+      !libhal_device_commit_to_gdl(ctx, tmp_udi, udi, &error))
+  {
+    libhal_remove_device(ctx, tmp_udi, NULL);
+    goto out;
+  }
+
+  result = 0;
+
+out:
+  if (dbus_error_is_set(&error))
+    fprintf(stderr, "%s%u: %s\n", FLEET_UDI_PREFIX, index, error.message);
+  dbus_error_free(&error);
+  if (tmp_udi)
+    libhal_free_string(tmp_udi);
+  return result;
+}
+
+static void fleet_device_remove(LibHalContext *ctx, unsigned int index)
+{
+  char udi[64];
+
+  fleet_udi(udi, sizeof(udi), index);
+  libhal_remove_device(ctx, udi, NULL);
+}
+
+static LibHalContext * fleet_connect_hal(void)
+{
+  DBusConnection *connection;
+  LibHalContext *ctx;
+  DBusError error;
+
+  dbus_error_init(&error);
+
+  if (!(connection = dbus_bus_get(DBUS_BUS_SYSTEM, &error)))
+  {
+    fprintf(stderr, "system bus: %s\n", error.message);
+    dbus_error_free(&error);
+    return NULL;
+  }
+
+  if (!(ctx = libhal_ctx_new()) ||
+      !libhal_ctx_set_dbus_connection(ctx, connection) ||
+      !libhal_ctx_init(ctx, &error))
+  {
+    fprintf(stderr, "hal context init: %s\n", dbus_error_is_set(&error) ? error.message : "failed");
+    dbus_error_free(&error);
+    if (ctx)
+      libhal_ctx_free(ctx);
+    dbus_connection_unref(connection);
+    return NULL;
+  }
+
+  return ctx;
+}
+
+static int64_t monotonic_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+int main(int argc, char *argv[])
+{
+  static const struct option options[] = {
+    { "count", required_argument, NULL, 'n' },
+    { "period", required_argument, NULL, 'p' },
+    { "speed", required_argument, NULL, 's' },
+    { "time", required_argument, NULL, 't' },
+    { "dry-run", no_argument, NULL, 'd' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  unsigned int count = 100;
+  unsigned int period = 30;
+  unsigned int speed = 1;
+  unsigned int run_time = 0;
+  int dry_run = 0;
+  LibHalContext *ctx = NULL;
+  bme_policy_params params;
+  fleet_battery *batteries;
+  fleet_stats stats;
+  struct sigaction sa;
+  struct timespec deadline;
+  struct rusage usage_self;
+  int64_t start_ms, sim_ms, due_ms;
+  unsigned int added = 0;
+  unsigned int next = 0;
+  uint64_t cycle = 0;
+  double cpu, wall;
+  int opt;
+  unsigned int i;
+
+  while ((opt = getopt_long(argc, argv, "n:p:s:t:dh", options, NULL)) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': count = atoi(optarg); break;
+      case 'p': period = atoi(optarg); break;
+      case 's': speed = atoi(optarg); break;
+      case 't': run_time = atoi(optarg); break;
+      case 'd': dry_run = 1; break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (!count || !period || !speed || optind != argc)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (!(batteries = calloc(count, sizeof(*batteries))))
+  {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (!dry_run)
+  {
+    if (!(ctx = fleet_connect_hal()))
+      return 1;
+    for (added = 0; added < count && !stop; added++)
+      if (fleet_device_add(ctx, added) < 0)
+        break;
+    if (added < count)
+    {
+      count = added;
+      stop = 1;
+    }
+  }
+
+  bme_policy_params_init(&params);
+  for (i = 0; i < count; i++)
+    fleet_battery_init(&batteries[i], i, 0);
+
+  memset(&stats, 0, sizeof(stats));
+  start_ms = monotonic_ms();
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  /* battery i is due at i/count of every period, in simulated time */
+  while (!stop)
+  {
+    sim_ms = (monotonic_ms() - start_ms)*speed;
+
+    for (;;)
+    {
+      due_ms = (cycle*count + next)*period*1000/count;
+      if (due_ms > sim_ms)
+        break;
+      fleet_battery_sample(ctx, &params, &batteries[next], next, due_ms/1000, cycle ? period : 0, &stats);
+      if (++next == count)
+      {
+        next = 0;
+        cycle++;
+      }
+    }
+
+    if (run_time && monotonic_ms() - start_ms >= (int64_t)run_time*1000)
+      break;
+
+    deadline.tv_nsec += FLEET_TICK_MS*1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR && !stop)
+      ;
+  }
+
+  wall = (monotonic_ms() - start_ms)/1000.0;
+  getrusage(RUSAGE_SELF, &usage_self);
+  cpu = usage_self.ru_utime.tv_sec + usage_self.ru_utime.tv_usec/1e6 +
+        usage_self.ru_stime.tv_sec + usage_self.ru_stime.tv_usec/1e6;
+
+  for (i = 0; ctx && i < added; i++)
+    fleet_device_remove(ctx, i);
+
+  printf("batteries\t%u\n", count);
+  printf("bytes_per_battery\t%lu\n", (unsigned long)sizeof(fleet_battery));
+  printf("samples\t%u\n", stats.samples);
+  printf("changesets\t%u\n", stats.changesets);
+  printf("properties\t%u\n", stats.properties);
+  printf("changesets_failed\t%u\n", stats.failed);
+  printf("cpu_percent\t%.3f\n", wall > 0 ? 100*cpu/wall : 0);
+
+  if (ctx)
+  {
+    libhal_ctx_shutdown(ctx, NULL);
+    libhal_ctx_free(ctx);
+  }
+  free(batteries);
+  return 0;
+}
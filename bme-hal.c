@@ -0,0 +1,481 @@
+/*
+ * bme-hal.c: guarded hald property writes of hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bme-hal.h"
+
+#define HAL_SERVICE "org.freedesktop.Hal"
+#define HAL_DEVICE_IF "org.freedesktop.Hal.Device"
+
+/* distinct keys the addon writes, with room to spare */
+#define PENDING_MAX 48
+#define PENDING_STRING_MAX 64
+
+typedef struct {
+  const char *key;
+  int type;                     /* DBUS_TYPE_STRING, _INT32 or _BOOLEAN */
+  int flags;                    /* of a held back write */
+  dbus_int32_t i;
+  char s[PENDING_STRING_MAX];
+} hal_write;
+
+static DBusConnection *hal_connection = NULL;
+static const char *hal_udi = NULL;
+static bme_hal_stats stats;
+static unsigned int failures = 0;
+static time_t retry_at = 0;
+static int deferring = 0;
+
+static hal_write pending[PENDING_MAX];
+static unsigned int n_pending = 0;
+
+/* what hald has, keys are owned */
+#define KNOWN_MAX 64
+
+static hal_write known[KNOWN_MAX];
+static unsigned int n_known = 0;
+
+static time_t monotonic_seconds(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return time(NULL);
+  return ts.tv_sec;
+}
+
+static uint32_t monotonic_ms(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* 1: done, 0: hald refused it, -1: no answer in time. Takes msg, the
+ * reply is only kept when asked for. */
+static int hal_send(DBusMessage *msg, DBusMessage **reply_out)
+{
+  DBusMessage *reply;
+  DBusError error;
+  uint32_t start, elapsed;
+  int result = 1;
+
+  dbus_error_init(&error);
+  stats.calls++;
+  start = monotonic_ms();
+  reply = dbus_connection_send_with_reply_and_block(hal_connection, msg, BME_HAL_CALL_TIMEOUT, &error);
+  elapsed = monotonic_ms() - start;
+  dbus_message_unref(msg);
+
+  if (elapsed > stats.call_max_ms)
+    stats.call_max_ms = elapsed;
+
+  if (reply && reply_out)
+    *reply_out = reply;
+  else if (reply)
+    dbus_message_unref(reply);
+  else if (dbus_error_has_name(&error, DBUS_ERROR_NO_REPLY) ||
+           dbus_error_has_name(&error, DBUS_ERROR_TIMEOUT) ||
+           dbus_error_has_name(&error, DBUS_ERROR_DISCONNECTED) ||
+           !dbus_connection_get_is_connected(hal_connection))
+    result = -1;
+  else
+    result = 0;
+
+  dbus_error_free(&error);
+  return result;
+}
+
+static int hal_call(const hal_write *write)
+{
+  DBusMessage *msg;
+  const char *member;
+  const char *s = write->s;
+  dbus_bool_t b = write->i;
+
+  switch (write->type)
+  {
+    case DBUS_TYPE_STRING:
+      member = "SetPropertyString";
+      break;
+    case DBUS_TYPE_BOOLEAN:
+      member = "SetPropertyBoolean";
+      break;
+    default:
+      member = "SetPropertyInteger";
+      break;
+  }
+
+  msg = dbus_message_new_method_call(HAL_SERVICE, hal_udi, HAL_DEVICE_IF, member);
+  if (!msg)
+    return 0;
+
+  if (!dbus_message_append_args(msg,
+                                DBUS_TYPE_STRING, &write->key,
+                                write->type,
+                                write->type == DBUS_TYPE_STRING ? (const void *)&s :
+                                write->type == DBUS_TYPE_BOOLEAN ? (const void *)&b : (const void *)&write->i,
+                                DBUS_TYPE_INVALID))
+  {
+    dbus_message_unref(msg);
+    return 0;
+  }
+
+  return hal_send(msg, NULL);
+}
+
+static hal_write * pending_find(const char *key)
+{
+  unsigned int i;
+
+  for (i = 0; i < n_pending; i++)
+    if (!strcmp(pending[i].key, key))
+      return &pending[i];
+
+  return NULL;
+}
+
+static void pending_drop(const char *key)
+{
+  hal_write *write = pending_find(key);
+
+  if (write)
+    *write = pending[--n_pending];
+}
+
+/* keeps only the latest value per key */
+static void pending_add(const hal_write *write, int flags)
+{
+  hal_write *slot = pending_find(write->key);
+
+  if (!slot)
+  {
+    if (n_pending == PENDING_MAX)
+      return;
+    slot = &pending[n_pending++];
+  }
+  *slot = *write;
+  slot->flags = flags;
+}
+
+static hal_write * known_find(const char *key, int type)
+{
+  unsigned int i;
+
+  for (i = 0; i < n_known; i++)
+    if (!strcmp(known[i].key, key))
+      return known[i].type == type ? &known[i] : NULL;
+
+  return NULL;
+}
+
+static int known_equal(const hal_write *write)
+{
+  const hal_write *value = known_find(write->key, write->type);
+
+  if (!value)
+    return 0;
+  if (write->type == DBUS_TYPE_STRING)
+    return !strcmp(value->s, write->s);
+  return value->i == write->i;
+}
+
+static void known_drop(const char *key)
+{
+  unsigned int i;
+
+  for (i = 0; i < n_known; i++)
+    if (!strcmp(known[i].key, key))
+    {
+      free((char *)known[i].key);
+      known[i] = known[--n_known];
+      return;
+    }
+}
+
+static void known_set(const hal_write *write)
+{
+  char *key;
+
+  known_drop(write->key);
+  if (n_known == KNOWN_MAX || !(key = strdup(write->key)))
+    return;
+
+  known[n_known] = *write;
+  known[n_known++].key = key;
+}
+
+/* hald answered the call, or did not */
+static void known_update(const hal_write *write, int result)
+{
+  if (result > 0)
+    known_set(write);
+  else
+    known_drop(write->key);
+}
+
+/* sends what is held back, except deferred writes while deferring */
+static void pending_flush(void)
+{
+  hal_write write;
+  unsigned int i = n_pending;
+  int result;
+
+  /* dropping moves the last entry into i, which was visited already */
+  while (i-- > 0)
+  {
+    if (deferring && (pending[i].flags & BME_HAL_DEFERRABLE))
+      continue;
+
+    write = pending[i];
+    result = hal_call(&write);
+    known_update(&write, result);
+    if (result < 0)
+    {
+      stats.calls_failed++;
+      stats.breaker_open = 1;
+      retry_at = monotonic_seconds() + BME_HAL_BREAKER_RETRY;
+      return;
+    }
+    pending_drop(write.key);
+    stats.writes_flushed++;
+  }
+}
+
+static void breaker_close(void)
+{
+  stats.breaker_open = 0;
+  failures = 0;
+  pending_flush();
+}
+
+static int hal_set(const hal_write *write, int flags)
+{
+  int result;
+
+  if (!hal_connection)
+    return 0;
+
+  /* hald has it already, a held back older value is obsolete */
+  if (known_equal(write))
+  {
+    pending_drop(write->key);
+    stats.writes_unchanged++;
+    return 1;
+  }
+
+  if (deferring && (flags & BME_HAL_DEFERRABLE))
+  {
+    stats.writes_deferred++;
+    pending_add(write, flags);
+    return 0;
+  }
+
+  if (stats.breaker_open && !(flags & BME_HAL_CRITICAL) && monotonic_seconds() < retry_at)
+  {
+    stats.writes_shed++;
+    pending_add(write, flags);
+    return 0;
+  }
+
+  result = hal_call(write);
+  known_update(write, result);
+  if (result >= 0)
+  {
+    pending_drop(write->key);
+    failures = 0;
+    if (stats.breaker_open)
+      breaker_close();
+    return result;
+  }
+
+  stats.calls_failed++;
+  if (!(flags & BME_HAL_CRITICAL))
+    pending_add(write, flags);
+
+  if (++failures >= BME_HAL_BREAKER_FAILURES || stats.breaker_open)
+  {
+    stats.breaker_open = 1;
+    retry_at = monotonic_seconds() + BME_HAL_BREAKER_RETRY;
+  }
+
+  return 0;
+}
+
+void bme_hal_init(DBusConnection *connection, const char *udi)
+{
+  hal_connection = connection;
+  hal_udi = udi;
+}
+
+void bme_hal_defer(int defer)
+{
+  deferring = defer;
+
+  /* while hald is unhealthy the breaker flushes */
+  if (!deferring && !stats.breaker_open)
+    pending_flush();
+}
+
+/* GetAllProperties by hand, libhal would wait for the default D-Bus
+ * timeout */
+int bme_hal_load(void)
+{
+  DBusMessageIter iter, dict, entry, variant;
+  DBusMessage *msg, *reply = NULL;
+  const char *s;
+  dbus_int32_t i;
+  dbus_bool_t b;
+  hal_write write;
+  int n = 0;
+
+  if (!hal_connection)
+    return 0;
+
+  msg = dbus_message_new_method_call(HAL_SERVICE, hal_udi, HAL_DEVICE_IF, "GetAllProperties");
+  if (!msg)
+    return 0;
+
+  if (hal_send(msg, &reply) < 0)
+  {
+    stats.calls_failed++;
+    failures++;
+  }
+  if (!reply)
+    return 0;
+
+  if (!dbus_message_iter_init(reply, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+    goto out;
+
+  for (dbus_message_iter_recurse(&iter, &dict);
+       dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY;
+       dbus_message_iter_next(&dict))
+  {
+    dbus_message_iter_recurse(&dict, &entry);
+    if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+      continue;
+    dbus_message_iter_get_basic(&entry, &write.key);
+    if ((strncmp(write.key, "battery.", 8) && strncmp(write.key, "maemo.", 6)) ||
+        !dbus_message_iter_next(&entry))
+      continue;
+    dbus_message_iter_recurse(&entry, &variant);
+
+    write.type = dbus_message_iter_get_arg_type(&variant);
+    write.i = 0;
+    write.s[0] = 0;
+    switch (write.type)
+    {
+      case DBUS_TYPE_STRING:
+        dbus_message_iter_get_basic(&variant, &s);
+        strncpy(write.s, s, sizeof(write.s) - 1);
+        write.s[sizeof(write.s) - 1] = 0;
+        break;
+      case DBUS_TYPE_INT32:
+        dbus_message_iter_get_basic(&variant, &i);
+        write.i = i;
+        break;
+      case DBUS_TYPE_BOOLEAN:
+        dbus_message_iter_get_basic(&variant, &b);
+        write.i = !!b;
+        break;
+      default:
+        continue;
+    }
+
+    known_set(&write);
+    n++;
+  }
+
+out:
+  dbus_message_unref(reply);
+  return n;
+}
+
+int bme_hal_set_string(const char *key, const char *value, int flags)
+{
+  hal_write write;
+
+  write.key = key;
+  write.type = DBUS_TYPE_STRING;
+  write.i = 0;
+  strncpy(write.s, value, sizeof(write.s) - 1);
+  write.s[sizeof(write.s) - 1] = 0;
+
+  return hal_set(&write, flags);
+}
+
+int bme_hal_set_int(const char *key, int32_t value, int flags)
+{
+  hal_write write;
+
+  write.key = key;
+  write.type = DBUS_TYPE_INT32;
+  write.i = value;
+  write.s[0] = 0;
+
+  return hal_set(&write, flags);
+}
+
+int bme_hal_set_bool(const char *key, int value, int flags)
+{
+  hal_write write;
+
+  write.key = key;
+  write.type = DBUS_TYPE_BOOLEAN;
+  write.i = !!value;
+  write.s[0] = 0;
+
+  return hal_set(&write, flags);
+}
+
+int bme_hal_get_string(const char *key, const char **value)
+{
+  const hal_write *write = known_find(key, DBUS_TYPE_STRING);
+
+  if (write)
+    *value = write->s;
+  return write != NULL;
+}
+
+int bme_hal_get_int(const char *key, int32_t *value)
+{
+  const hal_write *write = known_find(key, DBUS_TYPE_INT32);
+
+  if (write)
+    *value = write->i;
+  return write != NULL;
+}
+
+int bme_hal_get_bool(const char *key, int *value)
+{
+  const hal_write *write = known_find(key, DBUS_TYPE_BOOLEAN);
+
+  if (write)
+    *value = write->i;
+  return write != NULL;
+}
+
+const bme_hal_stats *bme_hal_get_stats(void)
+{
+  return &stats;
+}
@@ -0,0 +1,85 @@
+/*
+ * bme-hal.h: guarded hald property writes of hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _BME_HAL_H_
+#define _BME_HAL_H_
+
+#include <stdint.h>
+
+#include <dbus/dbus.h>
+
+/*
+ * Property writes go to hald as blocking calls with a short deadline
+ * instead of the default D-Bus timeout, so a wedged hald stalls the main
+ * loop for at most BME_HAL_CALL_TIMEOUT per call.
+ *
+ * After BME_HAL_BREAKER_FAILURES calls in a row ran into the deadline the
+ * breaker opens: writes are no longer sent but kept, latest value per key,
+ * and sent once hald answers again. Critical writes are always tried.
+ * While open, one shed write every BME_HAL_BREAKER_RETRY seconds probes
+ * hald.
+ *
+ * The values hald is known to have are remembered, starting with what
+ * bme_hal_load finds on the device, and writing the same value again is
+ * not sent at all.
+ *
+ * While bme_hal_defer is on, BME_HAL_DEFERRABLE writes are kept the same
+ * way and sent together when it is turned off again.
+ */
+
+#define BME_HAL_CALL_TIMEOUT 1000	/* ms */
+#define BME_HAL_BREAKER_FAILURES 3
+#define BME_HAL_BREAKER_RETRY 30	/* seconds */
+
+/* flags */
+#define BME_HAL_CRITICAL (1 << 0)	/* never held back */
+#define BME_HAL_DEFERRABLE (1 << 1)	/* held back by bme_hal_defer */
+
+typedef struct {
+  uint32_t calls;
+  uint32_t calls_failed;	/* ran into the deadline or lost hald */
+  uint32_t call_max_ms;		/* slowest call so far */
+  uint32_t writes_shed;		/* not sent because the breaker was open */
+  uint32_t writes_flushed;	/* shed writes sent after hald recovered */
+  uint32_t writes_unchanged;	/* not sent, hald already had the value */
+  uint32_t writes_deferred;	/* held back by bme_hal_defer */
+  int breaker_open;
+} bme_hal_stats;
+
+void bme_hal_init(DBusConnection *connection, const char *udi);
+
+/* reads the battery.* and maemo.* properties hald already has for the
+ * device, within BME_HAL_CALL_TIMEOUT as well, returns how many */
+int bme_hal_load(void);
+
+/* return nonzero when the write reached hald */
+int bme_hal_set_string(const char *key, const char *value, int flags);
+int bme_hal_set_int(const char *key, int32_t value, int flags);
+int bme_hal_set_bool(const char *key, int value, int flags);
+
+/* holds back or flushes BME_HAL_DEFERRABLE writes */
+void bme_hal_defer(int defer);
+
+/* the value hald is known to have, return zero when it is not known */
+int bme_hal_get_string(const char *key, const char **value);
+int bme_hal_get_int(const char *key, int32_t *value);
+int bme_hal_get_bool(const char *key, int *value);
+
+const bme_hal_stats *bme_hal_get_stats(void);
+
+#endif /* _BME_HAL_H_ */
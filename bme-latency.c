@@ -0,0 +1,895 @@
+/*
+ * bme-latency.c: end-to-end latency harness for hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Runs the addon against stand-ins for everything it talks to:
+ *
+ *  - a private dbus-daemon as system bus,
+ *  - hald: a peer to peer DBusServer (HALD_DIRECT_ADDR) taking property
+ *    writes,
+ *  - MCE: com.nokia.mce on the private bus, sending display_status_ind
+ *    and taking LED requests,
+ *  - dsme: a socket at DSME_SOCKFILE counting messages,
+ *  - sysfs: a tree of plain files below HAL_PROP_BME_SYSFS_ROOT.
+ *
+ * Each event sets the display state, changes the fake sysfs files and
+ * then makes the addon poll with SIGUSR1, so the poll period is not part
+ * of the numbers. A fake sysfs tree sends no uevents, charger changes
+ * are seen by that poll as well. Measured is the time until the expected
+ * HAL property write and the expected signal on the bus, and the
+ * status_info_req round trip. The charger and EMPTY events run once with
+ * the display on and once with it off, where the addon holds back
+ * updates but must still publish these right away. At the end the
+ * addon's own counters from stats_info_req tell how many messages it
+ * allocated per signal sent and how many HAL writes it held back.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <dbus/dbus.h>
+
+#include "dbus-names.h"
+#include "bme-loop.h"
+
+#define MCE_SERVICE "com.nokia.mce"
+#define MCE_REQUEST_IF "com.nokia.mce.request"
+#define MCE_SIGNAL_IF "com.nokia.mce.signal"
+#define MCE_SIGNAL_PATH "/com/nokia/mce/signal"
+#define MCE_DISPLAY_SIG "display_status_ind"
+
+#define HAL_DEVICE_IF "org.freedesktop.Hal.Device"
+#define HAL_UDI "/org/freedesktop/Hal/devices/bme"
+
+#define POWER_SUPPLY_DIR "/sys/class/power_supply"
+
+#define STEP_TIMEOUT_MS 2000
+#define STEP_GAP_MS 20
+#define STARTUP_TIMEOUT_MS 10000
+
+typedef int64_t int64;
+
+typedef enum {
+  MEASURE_HAL,
+  MEASURE_BUS,
+  MEASURE_COUNT
+} measure;
+
+typedef struct {
+  const char *name;
+  int64 *samples[MEASURE_COUNT];
+  unsigned int count[MEASURE_COUNT];
+  unsigned int events;
+  unsigned int timeouts;
+  unsigned int hal_writes;
+} scenario;
+
+typedef struct {
+  scenario *scenario;            /* NULL for steps that only reset the state */
+  void (*prepare)(void);
+  const char *hal_key;           /* string property write to wait for */
+  const char *hal_value;
+  const char *signal;            /* com.nokia.bme.signal member to wait for */
+  int status_call;               /* status_info_req round trip instead */
+  const char *display;           /* display_status_ind sent before the poll */
+} step;
+
+static char root[64];
+static char sysfs_root[128];
+static char bus_address[160];
+static pid_t daemon_pid = -1;
+static pid_t addon_pid = -1;
+static DBusConnection *bus;
+static DBusServer *hal_server;
+static int dsme_fd = -1;
+static unsigned int dsme_messages;
+static unsigned int led_requests;
+
+static step *steps;
+static unsigned int step_count;
+static unsigned int step_index;
+static unsigned int step_timer;
+static int64 step_start;
+static int64 step_seen[MEASURE_COUNT];
+static unsigned int step_hal_writes;
+static int addon_ready;
+static int failed;
+
+static scenario charger_scenario = { "charger plug", { NULL, NULL }, { 0, 0 }, 0, 0, 0 };
+static scenario empty_scenario = { "EDV1 empty", { NULL, NULL }, { 0, 0 }, 0, 0, 0 };
+static scenario status_scenario = { "status_info_req", { NULL, NULL }, { 0, 0 }, 0, 0, 0 };
+static scenario charger_off_scenario = { "charger, off", { NULL, NULL }, { 0, 0 }, 0, 0, 0 };
+static scenario empty_off_scenario = { "EDV1, off", { NULL, NULL }, { 0, 0 }, 0, 0, 0 };
+
+static int64 now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static int write_file(const char *name, const char *fmt, ...)
+{
+  char path[256];
+  va_list va;
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "%s%s/%s", sysfs_root, POWER_SUPPLY_DIR, name);
+  if ((fp = fopen(path, "w")) == NULL)
+  {
+    fprintf(stderr, "unable to open %s(%s)\n", path, strerror(errno));
+    return -1;
+  }
+  va_start(va, fmt);
+  vfprintf(fp, fmt, va);
+  va_end(va);
+  fclose(fp);
+  return 0;
+}
+
+static void write_bq27200(int charge_now, int charging, int flags)
+{
+  write_file("bq27200-0/uevent",
+             "POWER_SUPPLY_NAME=bq27200-0\n"
+             "POWER_SUPPLY_STATUS=%s\n"
+             "POWER_SUPPLY_PRESENT=1\n"
+             "POWER_SUPPLY_VOLTAGE_NOW=%d\n"
+             "POWER_SUPPLY_CURRENT_NOW=%d\n"
+             "POWER_SUPPLY_CAPACITY=%d\n"
+             "POWER_SUPPLY_TEMP=250\n"
+             "POWER_SUPPLY_TIME_TO_EMPTY_AVG=36000\n"
+             "POWER_SUPPLY_CHARGE_FULL=1250000\n"
+             "POWER_SUPPLY_CHARGE_NOW=%d\n",
+             charging ? "Charging" : "Discharging",
+             3400000 + charge_now/2,
+             charging ? -500000 : 200000,
+             charge_now/12500,
+             charge_now);
+  write_file("bq27200-0/registers", "0x0a=0x%02x\n0x1c=0x0258\n", flags);
+}
+
+static void prepare_plug(void)
+{
+  write_bq27200(1000000, 1, 0);
+  write_file("bq24150a-0/mode", "dedicated\n");
+}
+
+static void prepare_unplug(void)
+{
+  write_bq27200(1000000, 0, 0);
+  write_file("bq24150a-0/mode", "off\n");
+}
+
+static void prepare_edv1(void)
+{
+  write_bq27200(60000, 0, 0x02);
+}
+
+static void prepare_recover(void)
+{
+  write_bq27200(1000000, 0, 0);
+}
+
+static int setup_sysfs(void)
+{
+  static const char *dirs[] = { "", "/sys", "/sys/class", POWER_SUPPLY_DIR,
+    POWER_SUPPLY_DIR "/bq27200-0", POWER_SUPPLY_DIR "/bq24150a-0", POWER_SUPPLY_DIR "/rx51-battery" };
+  char path[256];
+  unsigned int i;
+
+  for (i = 0; i < sizeof(dirs)/sizeof(dirs[0]); i++)
+  {
+    snprintf(path, sizeof(path), "%s%s", sysfs_root, dirs[i]);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "unable to create %s(%s)\n", path, strerror(errno));
+      return -1;
+    }
+  }
+
+  prepare_unplug();
+  write_file("bq24150a-0/stat_pin_enable", "1\n");
+  return write_file("rx51-battery/uevent",
+                    "POWER_SUPPLY_NAME=rx51-battery\n"
+                    "POWER_SUPPLY_VOLTAGE_MAX_DESIGN=4200000\n"
+                    "POWER_SUPPLY_VOLTAGE_NOW=3900000\n"
+                    "POWER_SUPPLY_CHARGE_FULL_DESIGN=1320000\n");
+}
+
+static void step_next(void);
+static void step_status_reply(DBusPendingCall *call, void *user_data);
+static int step_timeout(void *data);
+
+/* the addon has handled the display change, messages from one sender
+ * arrive in order, now the measured poll */
+static void step_display_reply(DBusPendingCall *call, void *user_data)
+{
+  DBusMessage *reply = dbus_pending_call_steal_reply(call);
+  (void)user_data;
+
+  if (reply)
+    dbus_message_unref(reply);
+
+  if (step_timer)
+  {
+    step_start = now_us();
+    kill(addon_pid, SIGUSR1);
+  }
+}
+
+static int step_begin(void *data)
+{
+  step *s = &steps[step_index];
+  DBusMessage *msg;
+  DBusPendingCall *pending = NULL;
+  (void)data;
+
+  memset(step_seen, 0, sizeof(step_seen));
+  step_hal_writes = 0;
+
+  if (s->prepare)
+    s->prepare();
+
+  step_start = now_us();
+  step_timer = bme_loop_timeout_add(STEP_TIMEOUT_MS, step_timeout, NULL);
+
+  if (s->status_call)
+  {
+    msg = dbus_message_new_method_call(BME_SERVICE, BME_REQUEST_PATH, BME_REQUEST_IF, BME_STATUS_INFO_REQ);
+    if (msg && dbus_connection_send_with_reply(bus, msg, &pending, STEP_TIMEOUT_MS) && pending)
+    {
+      dbus_pending_call_set_notify(pending, step_status_reply, NULL, NULL);
+      dbus_pending_call_unref(pending);
+    }
+  }
+  else
+  {
+    msg = dbus_message_new_signal(MCE_SIGNAL_PATH, MCE_SIGNAL_IF, MCE_DISPLAY_SIG);
+    if (msg && dbus_message_append_args(msg, DBUS_TYPE_STRING, &s->display, DBUS_TYPE_INVALID))
+      dbus_connection_send(bus, msg, NULL);
+    if (msg)
+      dbus_message_unref(msg);
+
+    /* stats_info_req is not rate limited and sends nothing */
+    msg = dbus_message_new_method_call(BME_SERVICE, BME_REQUEST_PATH, BME_REQUEST_IF, BME_STATS_INFO_REQ);
+    if (msg && dbus_connection_send_with_reply(bus, msg, &pending, STEP_TIMEOUT_MS) && pending)
+    {
+      dbus_pending_call_set_notify(pending, step_display_reply, NULL, NULL);
+      dbus_pending_call_unref(pending);
+    }
+  }
+  if (msg)
+    dbus_message_unref(msg);
+  dbus_connection_flush(bus);
+
+  return FALSE;
+}
+
+static void step_finish(int timed_out)
+{
+  step *s = &steps[step_index];
+  measure m;
+
+  if (step_timer)
+    bme_loop_source_remove(step_timer);
+  step_timer = 0;
+
+  if (s->scenario)
+  {
+    s->scenario->events++;
+    s->scenario->hal_writes += step_hal_writes;
+    if (timed_out)
+      s->scenario->timeouts++;
+    for (m = 0; m < MEASURE_COUNT; m++)
+      if (step_seen[m])
+        s->scenario->samples[m][s->scenario->count[m]++] = step_seen[m] - step_start;
+  }
+  else if (timed_out)
+    fprintf(stderr, "reset step timed out\n");
+
+  if (timed_out)
+    failed = 1;
+
+  step_index++;
+  step_next();
+}
+
+static void step_check(void)
+{
+  step *s;
+
+  if (step_index >= step_count || !step_timer)
+    return;
+  s = &steps[step_index];
+
+  if ((s->hal_key && !step_seen[MEASURE_HAL]) ||
+      ((s->signal || s->status_call) && !step_seen[MEASURE_BUS]))
+    return;
+
+  step_finish(0);
+}
+
+static void step_status_reply(DBusPendingCall *call, void *user_data)
+{
+  DBusMessage *reply = dbus_pending_call_steal_reply(call);
+  (void)user_data;
+
+  if (reply && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    step_seen[MEASURE_BUS] = now_us();
+  if (reply)
+    dbus_message_unref(reply);
+  step_check();
+}
+
+static int step_timeout(void *data)
+{
+  (void)data;
+  step_timer = 0;
+  step_finish(1);
+  return FALSE;
+}
+
+static void step_next(void)
+{
+  if (step_index >= step_count)
+  {
+    bme_loop_quit();
+    return;
+  }
+
+  /* let the addon settle before the next event */
+  bme_loop_timeout_add(STEP_GAP_MS, step_begin, NULL);
+}
+
+static int steps_start(void *data)
+{
+  (void)data;
+  step_index = 0;
+  step_next();
+  return FALSE;
+}
+
+static DBusHandlerResult hal_filter(DBusConnection *connection, DBusMessage *message, void *user_data)
+{
+  const char *member = dbus_message_get_member(message);
+  const char *key = NULL, *value = NULL;
+  dbus_bool_t ok = TRUE;
+  DBusMessage *reply;
+  (void)user_data;
+
+  if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL || !member)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (!strncmp(member, "SetProperty", 11))
+  {
+    step_hal_writes++;
+    if (!strcmp(member, "SetPropertyString") &&
+        dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &key, DBUS_TYPE_STRING, &value, DBUS_TYPE_INVALID) &&
+        step_index < step_count && steps[step_index].hal_key && !step_seen[MEASURE_HAL] &&
+        !strcmp(key, steps[step_index].hal_key) && !strcmp(value, steps[step_index].hal_value))
+      step_seen[MEASURE_HAL] = now_us();
+  }
+
+  if (!dbus_message_get_no_reply(message) && (reply = dbus_message_new_method_return(message)))
+  {
+    if (!strcmp(member, "AddonIsReady"))
+      dbus_message_append_args(reply, DBUS_TYPE_BOOLEAN, &ok, DBUS_TYPE_INVALID);
+    dbus_connection_send(connection, reply, NULL);
+    dbus_message_unref(reply);
+  }
+
+  step_check();
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void hal_new_connection(DBusServer *server, DBusConnection *connection, void *data)
+{
+  (void)server;
+  (void)data;
+
+  dbus_connection_ref(connection);
+  dbus_connection_add_filter(connection, hal_filter, NULL, NULL);
+  bme_loop_setup_connection(connection);
+}
+
+static DBusHandlerResult bus_filter(DBusConnection *connection, DBusMessage *message, void *user_data)
+{
+  DBusMessage *reply;
+  const char *name, *old_owner, *new_owner;
+  (void)user_data;
+
+  if (dbus_message_is_signal(message, DBUS_INTERFACE_DBUS, "NameOwnerChanged"))
+  {
+    if (dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &old_owner,
+                              DBUS_TYPE_STRING, &new_owner, DBUS_TYPE_INVALID) &&
+        !strcmp(name, BME_SERVICE))
+    {
+      if (*new_owner && !addon_ready)
+      {
+        addon_ready = 1;
+        /* give the addon time to add its match rules */
+        bme_loop_timeout_add(500, steps_start, NULL);
+      }
+      else if (!*new_owner)
+      {
+        fprintf(stderr, "hald-addon-bme left the bus\n");
+        failed = 1;
+        bme_loop_quit();
+      }
+    }
+    return DBUS_HANDLER_RESULT_HANDLED;
+  }
+
+  if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL &&
+      dbus_message_has_interface(message, BME_SIGNAL_IF))
+  {
+    if (step_index < step_count && steps[step_index].signal && !step_seen[MEASURE_BUS] &&
+        !strcmp(dbus_message_get_member(message), steps[step_index].signal))
+      step_seen[MEASURE_BUS] = now_us();
+    step_check();
+    return DBUS_HANDLER_RESULT_HANDLED;
+  }
+
+  if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+      dbus_message_has_interface(message, MCE_REQUEST_IF))
+  {
+    led_requests++;
+    if (!dbus_message_get_no_reply(message) && (reply = dbus_message_new_method_return(message)))
+    {
+      dbus_connection_send(connection, reply, NULL);
+      dbus_message_unref(reply);
+    }
+    return DBUS_HANDLER_RESULT_HANDLED;
+  }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static int dsme_client_cb(int fd, unsigned int events, void *data)
+{
+  static char buffer[4096];
+  static size_t used;
+  ssize_t len;
+  (void)data;
+
+  if (events & BME_LOOP_IN)
+  {
+    len = read(fd, buffer + used, sizeof(buffer) - used);
+    if (len > 0)
+    {
+      used += len;
+      /* every dsme message starts with its total size */
+      while (used >= sizeof(uint32_t))
+      {
+        uint32_t size;
+        memcpy(&size, buffer, sizeof(size));
+        if (size < sizeof(size) || size > used)
+          break;
+        dsme_messages++;
+        memmove(buffer, buffer + size, used - size);
+        used -= size;
+      }
+      if (used == sizeof(buffer))
+        used = 0;
+      return TRUE;
+    }
+  }
+
+  close(fd);
+  return FALSE;
+}
+
+static int dsme_listen_cb(int fd, unsigned int events, void *data)
+{
+  int client;
+  (void)events;
+  (void)data;
+
+  if ((client = accept(fd, NULL, NULL)) >= 0 &&
+      !bme_loop_io_add(client, BME_LOOP_IN, dsme_client_cb, NULL))
+    close(client);
+  return TRUE;
+}
+
+static int setup_dsme(const char *path)
+{
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+
+  if ((dsme_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      bind(dsme_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(dsme_fd, 4) < 0 ||
+      !bme_loop_io_add(dsme_fd, BME_LOOP_IN, dsme_listen_cb, NULL))
+  {
+    fprintf(stderr, "unable to listen on %s(%s)\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int start_dbus_daemon(const char *dbus_daemon)
+{
+  char config[128];
+  char arg[160];
+  DBusError error;
+  FILE *fp;
+  int i;
+
+  snprintf(config, sizeof(config), "%s/bus.conf", root);
+  snprintf(bus_address, sizeof(bus_address), "unix:path=%s/bus", root);
+
+  if ((fp = fopen(config, "w")) == NULL)
+    return -1;
+  fprintf(fp,
+          "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\"\n"
+          " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+          "<busconfig>\n"
+          "  <type>system</type>\n"
+          "  <listen>%s</listen>\n"
+          "  <auth>EXTERNAL</auth>\n"
+          "  <policy context=\"default\">\n"
+          "    <allow user=\"*\"/>\n"
+          "    <allow own=\"*\"/>\n"
+          "    <allow send_destination=\"*\" eavesdrop=\"true\"/>\n"
+          "    <allow eavesdrop=\"true\"/>\n"
+          "  </policy>\n"
+          "</busconfig>\n", bus_address);
+  fclose(fp);
+
+  snprintf(arg, sizeof(arg), "--config-file=%s", config);
+  if ((daemon_pid = fork()) == 0)
+  {
+    execlp(dbus_daemon, dbus_daemon, arg, "--nofork", (char *)NULL);
+    _exit(127);
+  }
+  if (daemon_pid < 0)
+    return -1;
+
+  dbus_error_init(&error);
+  for (i = 0; i < 250 && !bus; i++)
+  {
+    if ((bus = dbus_connection_open_private(bus_address, &error)) == NULL)
+    {
+      dbus_error_free(&error);
+      usleep(20000);
+    }
+  }
+  if (!bus || !dbus_bus_register(bus, &error))
+  {
+    fprintf(stderr, "unable to connect to %s: %s\n", bus_address,
+            dbus_error_is_set(&error) ? error.message : "no dbus-daemon");
+    dbus_error_free(&error);
+    return -1;
+  }
+
+  dbus_bus_request_name(bus, MCE_SERVICE, DBUS_NAME_FLAG_DO_NOT_QUEUE, &error);
+  dbus_bus_add_match(bus, "type='signal',interface='" BME_SIGNAL_IF "'", &error);
+  dbus_bus_add_match(bus, "type='signal',interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged',"
+                     "arg0='" BME_SERVICE "'", &error);
+  if (dbus_error_is_set(&error))
+  {
+    fprintf(stderr, "unable to set up %s: %s\n", bus_address, error.message);
+    dbus_error_free(&error);
+    return -1;
+  }
+
+  dbus_connection_add_filter(bus, bus_filter, NULL, NULL);
+  return bme_loop_setup_connection(bus);
+}
+
+static int start_hal_server(void)
+{
+  char address[160];
+  DBusError error;
+
+  dbus_error_init(&error);
+  snprintf(address, sizeof(address), "unix:path=%s/hald", root);
+  if ((hal_server = dbus_server_listen(address, &error)) == NULL)
+  {
+    fprintf(stderr, "unable to listen on %s: %s\n", address, error.message);
+    dbus_error_free(&error);
+    return -1;
+  }
+  dbus_server_set_new_connection_function(hal_server, hal_new_connection, NULL, NULL);
+  return bme_loop_setup_server(hal_server);
+}
+
+static int start_addon(const char *addon)
+{
+  char path[160];
+  char *address;
+
+  if ((addon_pid = fork()) != 0)
+    return addon_pid < 0 ? -1 : 0;
+
+  address = dbus_server_get_address(hal_server);
+  setenv("HALD_DIRECT_ADDR", address, 1);
+  setenv("UDI", HAL_UDI, 1);
+  setenv("DBUS_SYSTEM_BUS_ADDRESS", bus_address, 1);
+  snprintf(path, sizeof(path), "%s/dsmesock", root);
+  setenv("DSME_SOCKFILE", path, 1);
+  setenv("HAL_PROP_BME_SYSFS_ROOT", sysfs_root, 1);
+  /* polls are triggered by the harness only */
+  setenv("HAL_PROP_BQ27200_POLL_PERIOD_SECONDS", "3600", 1);
+  setenv("HAL_PROP_BME_ARCHIVE_PERIOD_SECONDS", "0", 1);
+
+  execl(addon, addon, (char *)NULL);
+  fprintf(stderr, "unable to run %s(%s)\n", addon, strerror(errno));
+  _exit(127);
+}
+
+static int startup_timeout(void *data)
+{
+  (void)data;
+  if (!addon_ready)
+  {
+    fprintf(stderr, "hald-addon-bme did not show up on the bus\n");
+    failed = 1;
+    bme_loop_quit();
+  }
+  return FALSE;
+}
+
+static void add_step(scenario *sc, void (*prepare)(void), const char *hal_key,
+                     const char *hal_value, const char *signal, int status_call,
+                     const char *display)
+{
+  step *s = &steps[step_count++];
+
+  s->scenario = sc;
+  s->prepare = prepare;
+  s->hal_key = hal_key;
+  s->hal_value = hal_value;
+  s->signal = signal;
+  s->status_call = status_call;
+  s->display = display;
+}
+
+/* plug and unplug, then EDV1 and recover, with the display in the given
+ * state */
+static void add_events(scenario *charger, scenario *empty, unsigned int iterations, const char *display)
+{
+  unsigned int i;
+
+  for (i = 0; i < iterations; i++)
+  {
+    add_step(charger, prepare_plug, "maemo.charger.connection_status", "connected",
+             BME_CHARGER_CONNECTED, 0, display);
+    add_step(NULL, prepare_unplug, "maemo.charger.connection_status", "disconnected",
+             BME_CHARGER_DISCONNECTED, 0, display);
+  }
+  for (i = 0; i < iterations; i++)
+  {
+    add_step(empty, prepare_edv1, "battery.charge_level.capacity_state", "empty",
+             BME_BATTERY_EMPTY, 0, display);
+    add_step(NULL, prepare_recover, "battery.charge_level.capacity_state", "ok", NULL, 0, display);
+  }
+}
+
+static int build_steps(unsigned int iterations)
+{
+  scenario *scenarios[] = { &charger_scenario, &empty_scenario, &status_scenario,
+                            &charger_off_scenario, &empty_off_scenario };
+  unsigned int i;
+  measure m;
+
+  for (i = 0; i < sizeof(scenarios)/sizeof(scenarios[0]); i++)
+    for (m = 0; m < MEASURE_COUNT; m++)
+      if ((scenarios[i]->samples[m] = calloc(iterations, sizeof(int64))) == NULL)
+        return -1;
+
+  if ((steps = calloc(9*iterations, sizeof(*steps))) == NULL)
+    return -1;
+
+  add_events(&charger_scenario, &empty_scenario, iterations, "on");
+  for (i = 0; i < iterations; i++)
+    add_step(&status_scenario, NULL, NULL, NULL, NULL, 1, NULL);
+  /* none of these may be held back while the display is off */
+  add_events(&charger_off_scenario, &empty_off_scenario, iterations, "off");
+
+  return 0;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+  int64 x = *(const int64 *)a, y = *(const int64 *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void report(scenario *sc)
+{
+  static const char *names[MEASURE_COUNT] = { "hal", "bus" };
+  measure m;
+
+  printf("%-16s events %u, timeouts %u, hal writes/event %.1f\n", sc->name, sc->events, sc->timeouts,
+         sc->events ? (double)sc->hal_writes/sc->events : 0);
+  for (m = 0; m < MEASURE_COUNT; m++)
+  {
+    unsigned int n = sc->count[m];
+    if (!n)
+      continue;
+    qsort(sc->samples[m], n, sizeof(int64), compare_int64);
+    printf("  %s: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", names[m],
+           sc->samples[m][n*50/100]/1000.0, sc->samples[m][n*99/100 < n ? n*99/100 : n-1]/1000.0,
+           sc->samples[m][n-1]/1000.0);
+  }
+}
+
+/* uint32 entries of the stats_info_req reply */
+static int stats_get(DBusMessage *reply, const char *key, uint32_t *value)
+{
+  DBusMessageIter iter, dict, entry, variant;
+  const char *name;
+
+  if (!dbus_message_iter_init(reply, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+    return -1;
+
+  for (dbus_message_iter_recurse(&iter, &dict);
+       dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY;
+       dbus_message_iter_next(&dict))
+  {
+    dbus_message_iter_recurse(&dict, &entry);
+    dbus_message_iter_get_basic(&entry, &name);
+    if (strcmp(name, key) || !dbus_message_iter_next(&entry))
+      continue;
+    dbus_message_iter_recurse(&entry, &variant);
+    if (dbus_message_iter_get_arg_type(&variant) != DBUS_TYPE_UINT32)
+      return -1;
+    dbus_message_iter_get_basic(&variant, value);
+    return 0;
+  }
+
+  return -1;
+}
+
+static void report_signal_stats(void)
+{
+  DBusMessage *msg, *reply = NULL;
+  uint32_t sent, built, deferred;
+  DBusError error;
+
+  dbus_error_init(&error);
+  if ((msg = dbus_message_new_method_call(BME_SERVICE, BME_REQUEST_PATH, BME_REQUEST_IF, BME_STATS_INFO_REQ)))
+  {
+    reply = dbus_connection_send_with_reply_and_block(bus, msg, STEP_TIMEOUT_MS, &error);
+    dbus_message_unref(msg);
+  }
+
+  if (!reply || stats_get(reply, BME_STAT_SIGNALS_SENT, &sent) ||
+      stats_get(reply, BME_STAT_SIGNAL_MESSAGES_BUILT, &built) ||
+      stats_get(reply, BME_STAT_HAL_WRITES_DEFERRED, &deferred))
+    fprintf(stderr, "no addon stats: %s\n", dbus_error_is_set(&error) ? error.message : "bad reply");
+  else
+    printf("signals sent %u, messages built %u, allocations/signal %.2f, hal writes deferred %u\n",
+           sent, built, sent ? (double)built/sent : 0, deferred);
+
+  if (reply)
+    dbus_message_unref(reply);
+  dbus_error_free(&error);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+  (void)sb;
+  (void)type;
+  (void)ftw;
+  return remove(path);
+}
+
+static void stop(pid_t *pid)
+{
+  if (*pid > 0)
+  {
+    kill(*pid, SIGTERM);
+    waitpid(*pid, NULL, 0);
+  }
+  *pid = -1;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *addon = "./hald-addon-bme";
+  const char *dbus_daemon = "dbus-daemon";
+  unsigned int iterations = 100;
+  char path[160];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:d:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      case 'd':
+        dbus_daemon = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n iterations] [-d dbus-daemon] [hald-addon-bme]\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind < argc)
+    addon = argv[optind];
+  if (!iterations)
+    iterations = 1;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  strcpy(root, "/tmp/bme-latency.XXXXXX");
+  if (!mkdtemp(root))
+  {
+    fprintf(stderr, "unable to create %s(%s)\n", root, strerror(errno));
+    return 1;
+  }
+  snprintf(sysfs_root, sizeof(sysfs_root), "%s/root", root);
+  snprintf(path, sizeof(path), "%s/dsmesock", root);
+
+  if (bme_loop_init() < 0 || build_steps(iterations) < 0 || setup_sysfs() < 0 ||
+      setup_dsme(path) < 0 || start_hal_server() < 0 ||
+      start_dbus_daemon(dbus_daemon) < 0 || start_addon(addon) < 0)
+  {
+    failed = 1;
+    goto out;
+  }
+
+  bme_loop_timeout_add(STARTUP_TIMEOUT_MS, startup_timeout, NULL);
+  bme_loop_run();
+
+  report(&charger_scenario);
+  report(&empty_scenario);
+  report(&status_scenario);
+  report(&charger_off_scenario);
+  report(&empty_off_scenario);
+  printf("dsme messages %u, mce led requests %u\n", dsme_messages, led_requests);
+  report_signal_stats();
+
+out:
+  stop(&addon_pid);
+  if (bus)
+  {
+    dbus_connection_close(bus);
+    dbus_connection_unref(bus);
+  }
+  stop(&daemon_pid);
+  if (hal_server)
+    dbus_server_disconnect(hal_server);
+  nftw(root, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+
+  return failed;
+}
@@ -0,0 +1,557 @@
+/*
+ * bme-loop-epoll.c: hald-addon-bme main loop on epoll and timerfd
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Every timer is a timerfd, every fd is registered once with epoll and
+ * may carry several sources (libdbus uses separate read and write watches
+ * on the same socket). Sources removed while the loop is dispatching are
+ * only marked and freed at the end of the iteration.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "bme-loop.h"
+
+#define MAX_EVENTS 16
+
+/* dbus write watches want EPOLLOUT, which has no BME_LOOP_* flag */
+#define LOOP_OUT (1 << 8)
+
+typedef enum {
+  SOURCE_TIMEOUT,
+  SOURCE_IO,
+  SOURCE_DBUS_WATCH,
+  SOURCE_DBUS_TIMEOUT
+} source_type;
+
+typedef struct loop_fd loop_fd;
+
+typedef struct source {
+  unsigned int id;
+  source_type type;
+  int removed;
+  unsigned int events;          /* BME_LOOP_* wanted on fd */
+  loop_fd *fd;
+  union {
+    bme_loop_func timeout;
+    bme_loop_io_func io;
+  } func;
+  void *data;                   /* user data, DBusWatch or DBusTimeout */
+  struct source *next;          /* on loop_fd */
+} source;
+
+struct loop_fd {
+  int fd;
+  int owned;                    /* timerfd, closed with the last source */
+  unsigned int events;          /* registered with epoll */
+  source *sources;
+  loop_fd *next;
+};
+
+typedef struct connection {
+  DBusConnection *connection;
+  struct connection *next;
+} connection;
+
+static int epoll_fd = -1;
+static int running;
+static int dispatching;
+static int pending_removals;
+static unsigned int last_id;
+static loop_fd *fds;
+static connection *connections;
+
+static uint32_t epoll_events(unsigned int events)
+{
+  uint32_t result = 0;
+
+  if (events & BME_LOOP_IN)
+    result |= EPOLLIN;
+  if (events & BME_LOOP_PRI)
+    result |= EPOLLPRI;
+  if (events & LOOP_OUT)
+    result |= EPOLLOUT;
+  return result;
+}
+
+static unsigned int loop_events(uint32_t events)
+{
+  unsigned int result = 0;
+
+  if (events & EPOLLIN)
+    result |= BME_LOOP_IN;
+  if (events & EPOLLPRI)
+    result |= BME_LOOP_PRI;
+  if (events & EPOLLOUT)
+    result |= LOOP_OUT;
+  if (events & EPOLLERR)
+    result |= BME_LOOP_ERR;
+  if (events & EPOLLHUP)
+    result |= BME_LOOP_HUP;
+  return result;
+}
+
+static int loop_fd_update(loop_fd *lfd)
+{
+  struct epoll_event event;
+  unsigned int events = 0;
+  source *s;
+
+  for (s = lfd->sources; s; s = s->next)
+    if (!s->removed)
+      events |= s->events;
+
+  if (events == lfd->events)
+    return 0;
+
+  memset(&event, 0, sizeof(event));
+  event.events = epoll_events(events);
+  event.data.ptr = lfd;
+  lfd->events = events;
+
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, lfd->fd, &event) == 0)
+    return 0;
+  /* the fd was closed and reopened before its old sources were collected */
+  if (errno == ENOENT || errno == EBADF)
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, lfd->fd, &event);
+  return -1;
+}
+
+static loop_fd * loop_fd_get(int fd, int owned)
+{
+  struct epoll_event event;
+  loop_fd *lfd;
+
+  for (lfd = fds; lfd; lfd = lfd->next)
+    if (lfd->fd == fd)
+    {
+      /* a stale entry must not close the new owner's fd */
+      lfd->owned = owned;
+      return lfd;
+    }
+
+  lfd = calloc(1, sizeof(*lfd));
+  if (!lfd)
+    return NULL;
+  lfd->fd = fd;
+  lfd->owned = owned;
+
+  memset(&event, 0, sizeof(event));
+  event.data.ptr = lfd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+  {
+    free(lfd);
+    return NULL;
+  }
+
+  lfd->next = fds;
+  fds = lfd;
+  return lfd;
+}
+
+static source * source_new(int fd, int owned, source_type type, unsigned int events, void *data)
+{
+  loop_fd *lfd;
+  source *s;
+
+  lfd = loop_fd_get(fd, owned);
+  if (!lfd)
+    return NULL;
+
+  s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+
+  do
+    s->id = ++last_id;
+  while (!s->id);
+  s->type = type;
+  s->events = events;
+  s->fd = lfd;
+  s->data = data;
+  s->next = lfd->sources;
+  lfd->sources = s;
+
+  loop_fd_update(lfd);
+  return s;
+}
+
+static void source_remove(source *s)
+{
+  if (s->removed)
+    return;
+  s->removed = 1;
+  pending_removals = 1;
+  loop_fd_update(s->fd);
+}
+
+/* free removed sources and fds without sources, never while dispatching */
+static void sources_collect(void)
+{
+  loop_fd **lfdp = &fds;
+
+  pending_removals = 0;
+
+  while (*lfdp)
+  {
+    loop_fd *lfd = *lfdp;
+    source **sp = &lfd->sources;
+
+    while (*sp)
+    {
+      source *s = *sp;
+      if (s->removed)
+      {
+        *sp = s->next;
+        free(s);
+      }
+      else
+        sp = &s->next;
+    }
+
+    if (!lfd->sources)
+    {
+      *lfdp = lfd->next;
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, lfd->fd, NULL);
+      if (lfd->owned)
+        close(lfd->fd);
+      free(lfd);
+    }
+    else
+      lfdp = &lfd->next;
+  }
+}
+
+static source * source_find(unsigned int id)
+{
+  loop_fd *lfd;
+  source *s;
+
+  for (lfd = fds; lfd; lfd = lfd->next)
+    for (s = lfd->sources; s; s = s->next)
+      if (s->id == id && !s->removed)
+        return s;
+  return NULL;
+}
+
+static int timer_set(int fd, unsigned int interval_ms)
+{
+  struct itimerspec spec;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.it_interval.tv_sec = interval_ms/1000;
+  spec.it_interval.tv_nsec = (interval_ms%1000)*1000000;
+  spec.it_value = spec.it_interval;
+  /* a zero it_value disarms the timer, run as soon as possible instead */
+  if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+    spec.it_value.tv_nsec = 1;
+  return timerfd_settime(fd, 0, &spec, NULL);
+}
+
+static int timer_stop(int fd)
+{
+  struct itimerspec spec;
+
+  memset(&spec, 0, sizeof(spec));
+  return timerfd_settime(fd, 0, &spec, NULL);
+}
+
+static source * timer_new(unsigned int interval_ms, source_type type, void *data)
+{
+  source *s;
+  int fd;
+
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  if (timer_set(fd, interval_ms) < 0 ||
+      (s = source_new(fd, 1, type, BME_LOOP_IN, data)) == NULL)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  return s;
+}
+
+unsigned int bme_loop_timeout_add(unsigned int interval_ms, bme_loop_func func, void *data)
+{
+  source *s = timer_new(interval_ms, SOURCE_TIMEOUT, data);
+
+  if (!s)
+    return 0;
+  s->func.timeout = func;
+  return s->id;
+}
+
+unsigned int bme_loop_timeout_add_seconds(unsigned int interval, bme_loop_func func, void *data)
+{
+  return bme_loop_timeout_add(interval*1000, func, data);
+}
+
+unsigned int bme_loop_io_add(int fd, unsigned int events, bme_loop_io_func func, void *data)
+{
+  source *s = source_new(fd, 0, SOURCE_IO, events, data);
+
+  if (!s)
+    return 0;
+  s->func.io = func;
+  return s->id;
+}
+
+void bme_loop_source_remove(unsigned int id)
+{
+  source *s = source_find(id);
+
+  if (s)
+    source_remove(s);
+  if (!dispatching && pending_removals)
+    sources_collect();
+}
+
+static unsigned int dbus_watch_events(DBusWatch *watch)
+{
+  unsigned int flags = dbus_watch_get_flags(watch);
+  unsigned int events = 0;
+
+  if (!dbus_watch_get_enabled(watch))
+    return 0;
+  if (flags & DBUS_WATCH_READABLE)
+    events |= BME_LOOP_IN;
+  if (flags & DBUS_WATCH_WRITABLE)
+    events |= LOOP_OUT;
+  return events;
+}
+
+static dbus_bool_t dbus_watch_add(DBusWatch *watch, void *data)
+{
+  source *s;
+
+  (void)data;
+  s = source_new(dbus_watch_get_unix_fd(watch), 0, SOURCE_DBUS_WATCH, dbus_watch_events(watch), watch);
+  if (!s)
+    return FALSE;
+  dbus_watch_set_data(watch, s, NULL);
+  return TRUE;
+}
+
+static void dbus_watch_remove(DBusWatch *watch, void *data)
+{
+  source *s = dbus_watch_get_data(watch);
+
+  (void)data;
+  if (s)
+    source_remove(s);
+  dbus_watch_set_data(watch, NULL, NULL);
+}
+
+static void dbus_watch_toggled(DBusWatch *watch, void *data)
+{
+  source *s = dbus_watch_get_data(watch);
+
+  (void)data;
+  if (s)
+  {
+    s->events = dbus_watch_events(watch);
+    loop_fd_update(s->fd);
+  }
+}
+
+static dbus_bool_t dbus_timeout_add(DBusTimeout *timeout, void *data)
+{
+  source *s;
+
+  (void)data;
+  s = timer_new(dbus_timeout_get_interval(timeout), SOURCE_DBUS_TIMEOUT, timeout);
+  if (!s)
+    return FALSE;
+  if (!dbus_timeout_get_enabled(timeout))
+    timer_stop(s->fd->fd);
+  dbus_timeout_set_data(timeout, s, NULL);
+  return TRUE;
+}
+
+static void dbus_timeout_remove(DBusTimeout *timeout, void *data)
+{
+  source *s = dbus_timeout_get_data(timeout);
+
+  (void)data;
+  if (s)
+    source_remove(s);
+  dbus_timeout_set_data(timeout, NULL, NULL);
+}
+
+static void dbus_timeout_toggled(DBusTimeout *timeout, void *data)
+{
+  source *s = dbus_timeout_get_data(timeout);
+
+  (void)data;
+  if (!s)
+    return;
+  if (dbus_timeout_get_enabled(timeout))
+    timer_set(s->fd->fd, dbus_timeout_get_interval(timeout));
+  else
+    timer_stop(s->fd->fd);
+}
+
+int bme_loop_setup_connection(DBusConnection *dbus_connection)
+{
+  connection *c;
+
+  c = calloc(1, sizeof(*c));
+  if (!c)
+    return -1;
+
+  if (!dbus_connection_set_watch_functions(dbus_connection, dbus_watch_add, dbus_watch_remove,
+                                           dbus_watch_toggled, NULL, NULL) ||
+      !dbus_connection_set_timeout_functions(dbus_connection, dbus_timeout_add, dbus_timeout_remove,
+                                             dbus_timeout_toggled, NULL, NULL))
+  {
+    free(c);
+    return -1;
+  }
+
+  c->connection = dbus_connection_ref(dbus_connection);
+  c->next = connections;
+  connections = c;
+  return 0;
+}
+
+int bme_loop_setup_server(DBusServer *server)
+{
+  if (!dbus_server_set_watch_functions(server, dbus_watch_add, dbus_watch_remove,
+                                       dbus_watch_toggled, NULL, NULL) ||
+      !dbus_server_set_timeout_functions(server, dbus_timeout_add, dbus_timeout_remove,
+                                         dbus_timeout_toggled, NULL, NULL))
+    return -1;
+  return 0;
+}
+
+static void source_dispatch(source *s, unsigned int events)
+{
+  uint64_t expirations;
+
+  if (s->removed)
+    return;
+
+  switch (s->type)
+  {
+    case SOURCE_TIMEOUT:
+      if (read(s->fd->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+      if (!s->func.timeout(s->data))
+        source_remove(s);
+      break;
+    case SOURCE_IO:
+      if (!(events & (s->events | BME_LOOP_ERR | BME_LOOP_HUP)))
+        return;
+      if (!s->func.io(s->fd->fd, events & ~LOOP_OUT, s->data))
+        source_remove(s);
+      break;
+    case SOURCE_DBUS_WATCH:
+    {
+      unsigned int flags = 0;
+      if (!s->events)
+        return;
+      if (events & BME_LOOP_IN)
+        flags |= DBUS_WATCH_READABLE;
+      if (events & LOOP_OUT)
+        flags |= DBUS_WATCH_WRITABLE;
+      if (events & BME_LOOP_ERR)
+        flags |= DBUS_WATCH_ERROR;
+      if (events & BME_LOOP_HUP)
+        flags |= DBUS_WATCH_HANGUP;
+      if (flags)
+        dbus_watch_handle(s->data, flags);
+      break;
+    }
+    case SOURCE_DBUS_TIMEOUT:
+      if (read(s->fd->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+      dbus_timeout_handle(s->data);
+      break;
+  }
+}
+
+static void connections_dispatch(void)
+{
+  connection *c;
+
+  for (c = connections; c; c = c->next)
+    while (dbus_connection_dispatch(c->connection) == DBUS_DISPATCH_DATA_REMAINS)
+      ;
+}
+
+int bme_loop_init(void)
+{
+  if (epoll_fd < 0)
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  return epoll_fd < 0 ? -1 : 0;
+}
+
+void bme_loop_run(void)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int count;
+  int i;
+
+  running = 1;
+  while (running)
+  {
+    /* messages may have been queued outside of fd events, e.g. by a
+     * blocking call made from a callback */
+    connections_dispatch();
+
+    count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    dispatching = 1;
+    for (i = 0; i < count; i++)
+    {
+      loop_fd *lfd = events[i].data.ptr;
+      unsigned int ready = loop_events(events[i].events);
+      source *s;
+
+      for (s = lfd->sources; s; s = s->next)
+        source_dispatch(s, ready);
+    }
+    dispatching = 0;
+
+    /* loop_fd of this iteration may only be freed once all events are handled */
+    if (pending_removals)
+      sources_collect();
+  }
+}
+
+void bme_loop_quit(void)
+{
+  running = 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * bme-loop-glib.c: hald-addon-bme main loop on top of GLib
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <glib.h>
+
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include "bme-loop.h"
+
+static GMainLoop *mainloop = NULL;
+
+typedef struct {
+  bme_loop_io_func func;
+  void *data;
+} io_watch;
+
+int bme_loop_init(void)
+{
+  mainloop = g_main_loop_new(NULL, FALSE);
+  return mainloop ? 0 : -1;
+}
+
+void bme_loop_run(void)
+{
+  g_main_loop_run(mainloop);
+}
+
+void bme_loop_quit(void)
+{
+  g_main_loop_quit(mainloop);
+}
+
+unsigned int bme_loop_timeout_add(unsigned int interval_ms, bme_loop_func func, void *data)
+{
+  return g_timeout_add(interval_ms, (GSourceFunc)func, data);
+}
+
+unsigned int bme_loop_timeout_add_seconds(unsigned int interval, bme_loop_func func, void *data)
+{
+  return g_timeout_add_seconds(interval, (GSourceFunc)func, data);
+}
+
+static gboolean io_watch_cb(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+  io_watch *watch = data;
+  unsigned int events = 0;
+
+  if (condition & G_IO_IN)
+    events |= BME_LOOP_IN;
+  if (condition & G_IO_PRI)
+    events |= BME_LOOP_PRI;
+  if (condition & (G_IO_ERR | G_IO_NVAL))
+    events |= BME_LOOP_ERR;
+  if (condition & G_IO_HUP)
+    events |= BME_LOOP_HUP;
+
+  return watch->func(g_io_channel_unix_get_fd(source), events, watch->data);
+}
+
+unsigned int bme_loop_io_add(int fd, unsigned int events, bme_loop_io_func func, void *data)
+{
+  GIOChannel *channel;
+  GIOCondition condition = G_IO_ERR | G_IO_HUP | G_IO_NVAL;
+  io_watch *watch;
+  guint id;
+
+  if (events & BME_LOOP_IN)
+    condition |= G_IO_IN;
+  if (events & BME_LOOP_PRI)
+    condition |= G_IO_PRI;
+
+  watch = g_new(io_watch, 1);
+  watch->func = func;
+  watch->data = data;
+
+  channel = g_io_channel_unix_new(fd);
+  id = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, condition, io_watch_cb, watch, g_free);
+  g_io_channel_unref(channel);
+
+  return id;
+}
+
+void bme_loop_source_remove(unsigned int id)
+{
+  g_source_remove(id);
+}
+
+int bme_loop_setup_connection(DBusConnection *connection)
+{
+  dbus_connection_setup_with_g_main(connection, NULL);
+  return 0;
+}
+
+int bme_loop_setup_server(DBusServer *server)
+{
+  dbus_server_setup_with_g_main(server, NULL);
+  return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * bme-loop.h: main loop used by hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Two implementations exist: bme-loop-glib.c runs on the GLib main loop
+ * and dbus-glib, bme-loop-epoll.c is a small epoll + timerfd loop that
+ * only needs libdbus. Callbacks return nonzero to stay installed, zero to
+ * be removed, like GLib sources.
+ */
+
+#ifndef _BME_LOOP_H_
+#define _BME_LOOP_H_
+
+#include <dbus/dbus.h>
+
+/* events for bme_loop_io_add() */
+#define BME_LOOP_IN	(1 << 0)
+#define BME_LOOP_PRI	(1 << 1)
+#define BME_LOOP_ERR	(1 << 2)
+#define BME_LOOP_HUP	(1 << 3)
+
+typedef int (*bme_loop_func)(void *data);
+typedef int (*bme_loop_io_func)(int fd, unsigned int events, void *data);
+
+int bme_loop_init(void);
+void bme_loop_run(void);
+void bme_loop_quit(void);
+
+/* return a source id, 0 on failure */
+unsigned int bme_loop_timeout_add(unsigned int interval_ms, bme_loop_func func, void *data);
+unsigned int bme_loop_timeout_add_seconds(unsigned int interval, bme_loop_func func, void *data);
+unsigned int bme_loop_io_add(int fd, unsigned int events, bme_loop_io_func func, void *data);
+void bme_loop_source_remove(unsigned int id);
+
+/* dispatch the connection from the loop */
+int bme_loop_setup_connection(DBusConnection *connection);
+/* accept connections from the loop, they have to be set up separately */
+int bme_loop_setup_server(DBusServer *server);
+
+#endif /* _BME_LOOP_H_ */
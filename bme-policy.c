@@ -0,0 +1,560 @@
+/*
+ * bme-policy.c: battery state decisions of hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include "bme-policy.h"
+
+void bme_policy_params_init(bme_policy_params *params)
+{
+  params->capacity_threshold_full = POWER_SUPPLY_CAPACITY_THRESHOLD_FULL;
+  params->charge_threshold_low = POWER_SUPPLY_CHARGE_THRESHOLD_LOW;
+  params->charge_threshold_verylow = POWER_SUPPLY_CHARGE_THRESHOLD_VERYLOW;
+  params->charge_threshold_empty = POWER_SUPPLY_CHARGE_THRESHOLD_EMPTY;
+  params->voltage_threshold_full = POWER_SUPPLY_VOLTAGE_THRESHOLD_FULL;
+  params->voltage_threshold_low = POWER_SUPPLY_VOLTAGE_THRESHOLD_LOW;
+  params->voltage_threshold_verylow = POWER_SUPPLY_VOLTAGE_THRESHOLD_VERYLOW;
+  params->voltage_threshold_empty = POWER_SUPPLY_VOLTAGE_THRESHOLD_EMPTY;
+  params->charge_hysteresis_low = POWER_SUPPLY_CHARGE_HYSTERESIS_LOW;
+  params->voltage_hysteresis_low = POWER_SUPPLY_VOLTAGE_HYSTERESIS_LOW;
+  params->renotify_low = CAPACITY_STATE_RENOTIFY_LOW;
+  params->renotify_empty = CAPACITY_STATE_RENOTIFY_EMPTY;
+  params->voltage_filter_resistance = POWER_SUPPLY_VOLTAGE_FILTER_RESISTANCE;
+  params->voltage_filter_drift = POWER_SUPPLY_VOLTAGE_FILTER_DRIFT;
+  params->voltage_filter_noise = POWER_SUPPLY_VOLTAGE_FILTER_NOISE;
+  params->current_average_window = POWER_SUPPLY_CURRENT_AVERAGE_WINDOW;
+  params->current_hysteresis = POWER_SUPPLY_CURRENT_HYSTERESIS;
+  params->current_settle = POWER_SUPPLY_CURRENT_SETTLE;
+}
+
+void bme_policy_state_init(bme_policy_state *state)
+{
+  memset(state, 0, sizeof(*state));
+  state->capacity_state = BME_CAPACITY_OK;
+}
+
+/* charger kind from the bq24150a mode and what counts as connected */
+int bme_charger_is_connected(bme_charger charger)
+{
+  return charger == CHARGER_HOST_500 || charger == CHARGER_WALL;
+}
+
+static int is_charger_connected(const battery *battery_info)
+{
+  return bme_charger_is_connected(battery_info->charger);
+}
+
+bme_charger bme_charger_parse_mode(const char *mode, int *boost)
+{
+  *boost = strncmp(mode, "boost", 5) == 0;
+
+  if (!strncmp(mode, "none", 4))
+    return CHARGER_HOST_100;
+  if (!strncmp(mode, "host", 4))
+    return CHARGER_HOST_500;
+  if (!strncmp(mode, "dedicated", 9))
+    return CHARGER_WALL;
+  return CHARGER_NONE;
+}
+
+/* what the filter is fed, corrected by the IR drop while discharging */
+static double voltage_filter_input(const bme_policy_params *params, const battery *battery_info,
+                                   int charger_connected)
+{
+  double measured = battery_info->power_supply_voltage_now;
+
+  if (!charger_connected)
+    measured += (double)battery_info->power_supply_current_now*params->voltage_filter_resistance/1000;
+
+  return measured;
+}
+
+/* Track the battery voltage through load spikes (radio TX, camera flash).
+ * While discharging the reading is corrected by the IR drop of current_now
+ * so the estimate follows the open circuit voltage; with a charger the
+ * voltage tables are for the terminal voltage, so it is filtered as is.
+ * The estimate may drift by voltage_filter_drift per second between
+ * samples, every sample is trusted with voltage_filter_noise. */
+static void voltage_filter_update(const bme_policy_params *params, bme_voltage_filter *filter,
+                                  const battery *battery_info, int charger_connected, time_t now)
+{
+  double measured = voltage_filter_input(params, battery_info, charger_connected);
+  double gain;
+  time_t elapsed;
+
+  if (!filter->valid || filter->charger_connected != charger_connected)
+  {
+    filter->valid = 1;
+    filter->charger_connected = charger_connected;
+    filter->voltage = measured;
+    filter->variance = params->voltage_filter_noise;
+    filter->updated = now;
+    return;
+  }
+
+  elapsed = now - filter->updated;
+  if (elapsed > 0)
+    filter->variance += params->voltage_filter_drift*elapsed;
+  filter->updated = now;
+
+  gain = filter->variance/(filter->variance + params->voltage_filter_noise);
+  filter->voltage += gain*(measured - filter->voltage);
+  filter->variance *= 1 - gain;
+}
+
+/* A weak charger can leave the net current hovering around zero, the sign
+ * of single samples would flip positive_rate (and is_charging with it) all
+ * the time. The decision follows an exponential average over
+ * current_average_window instead and only flips once the average is more
+ * than current_hysteresis on the other side of zero. The gauge reports the
+ * old current for a while after the charger was connected or removed, so
+ * for current_settle the decision follows the charger and the average
+ * starts over afterwards. */
+static int current_average_decide(const bme_policy_params *params, int positive_rate, double current)
+{
+  if (current < -(double)params->current_hysteresis)
+    return 1;
+  if (current > (double)params->current_hysteresis)
+    return 0;
+  return positive_rate;
+}
+
+static void current_average_update(const bme_policy_params *params, bme_current_average *average,
+                                   const battery *battery_info, int charger_connected, time_t now)
+{
+  double current = battery_info->power_supply_current_now;
+  time_t elapsed;
+
+  if (!average->valid)
+  {
+    average->valid = 1;
+    average->charger_connected = charger_connected;
+    average->settling = 0;
+    average->current = current;
+    average->updated = now;
+    average->positive_rate = current < 0;
+    return;
+  }
+
+  if (average->charger_connected != charger_connected)
+  {
+    average->charger_connected = charger_connected;
+    average->settling = 1;
+    average->updated = now;
+    average->positive_rate = charger_connected;
+    return;
+  }
+
+  if (average->settling)
+  {
+    if (now - average->updated < params->current_settle)
+      return;
+    average->settling = 0;
+    average->current = current;
+    average->updated = now;
+  }
+  else
+  {
+    elapsed = now - average->updated;
+    if (elapsed <= 0)
+      return;
+    average->current += (current - average->current)*elapsed/(params->current_average_window + elapsed);
+    average->updated = now;
+  }
+
+  average->positive_rate = current_average_decide(params, average->positive_rate, average->current);
+}
+
+/* Decide whether capacity_state has to be (re)announced. State changes are
+ * always announced. FULL is announced once per charger connection, LOW again
+ * when capacity dropped further or after renotify_low, and in the very low
+ * band on every change of capacity, EMPTY every renotify_empty, everything
+ * else never. */
+static int capacity_state_needs_announce(const bme_policy_params *params, const bme_policy_state *state,
+                                         bme_capacity_state capacity_state, int32_t power_supply_capacity,
+                                         int very_low, int charger_connected, time_t now)
+{
+  time_t elapsed = now - state->announced;
+
+  if (state->capacity_state != capacity_state)
+    return 1;
+
+  switch (capacity_state)
+  {
+    case BME_CAPACITY_FULL:
+      return charger_connected && !state->full_charger_connected;
+    case BME_CAPACITY_LOW:
+      return elapsed >= params->renotify_low ||
+             (very_low && power_supply_capacity != state->announced_capacity) ||
+             (power_supply_capacity < state->announced_capacity &&
+              power_supply_capacity%2 == 0);
+    case BME_CAPACITY_EMPTY:
+      return elapsed >= params->renotify_empty;
+    default:
+      return 0;
+  }
+}
+
+/* LOW threshold decision shared by the charge_now and voltage_now paths,
+ * very low is decided on its own value, see the raw voltage below */
+#define LEVEL_STATE(verylow_value, verylow, value, low, state, very_low) do { \
+  if ((verylow_value) <= (verylow)) { \
+    (state) = BME_CAPACITY_LOW; \
+    (very_low) = 1; \
+  } else if ((value) <= (low)) \
+    (state) = BME_CAPACITY_LOW; \
+  else \
+    (state) = BME_CAPACITY_OK; \
+  } while (0)
+
+void bme_policy_evaluate(const bme_policy_params *params, const bme_policy_state *state,
+                         const battery *sample, time_t now, bme_policy_result *result)
+{
+  battery *battery_info = &result->battery;
+  bme_capacity_state capacity_state;
+  int calibrated;
+  int charger_connected;
+  int is_charging;
+  int positive_rate;
+  int capacity;
+  int no_voltage = 0;
+  int very_low = 0;
+  uint32_t voltage = 0;
+  uint32_t voltage_raw = 0;
+  uint32_t charge_threshold_low = params->charge_threshold_low;
+  uint32_t voltage_threshold_low = params->voltage_threshold_low;
+
+  *battery_info = *sample;
+  result->next = *state;
+
+  if(battery_info->power_supply_capacity < 0)
+    calibrated = 0;
+  else
+    calibrated = 1;
+
+  charger_connected = is_charger_connected(battery_info);
+
+  current_average_update(params, &result->next.current_average, battery_info, charger_connected, now);
+  positive_rate = result->next.current_average.positive_rate;
+
+  if (positive_rate && charger_connected)
+    is_charging = 1;
+  else
+    is_charging = 0;
+
+  if (battery_info->power_supply_voltage_now <= 0)
+    no_voltage = 1;
+  else
+  {
+    voltage_filter_update(params, &result->next.voltage_filter, battery_info, charger_connected, now);
+    voltage = result->next.voltage_filter.voltage + 0.5;
+    /* The filtered voltage adds back the IR drop, which lifts it above
+     * what the battery delivers under load. It smooths the capacity
+     * estimate and the LOW band, EMPTY and very low stay on the sample. */
+    voltage_raw = battery_info->power_supply_voltage_now;
+  }
+
+  /* do not flap between LOW and OK around the threshold */
+  if (state->capacity_state == BME_CAPACITY_LOW || state->capacity_state == BME_CAPACITY_EMPTY)
+  {
+    charge_threshold_low += params->charge_hysteresis_low;
+    voltage_threshold_low += params->voltage_hysteresis_low;
+  }
+
+  /* hal edge   real edge
+        0          8
+       13         19.96
+       25         31
+       38         42.96
+       50         54
+       63         65.96
+       75         77
+       88         88.96
+      100        100
+  */
+
+  /*
+     bars   status  hal capacity real capacity
+      0     empty      0%-0%        0%-EDV1
+      0     very low   0%-0%      EDV1-8%
+      0     low        0%-6%        9%-14%
+      1     ok         7%-19%      15%-25%
+      2     ok        20%-31%      26%-37%
+      3     ok        32%-44%      38%-48%
+      4     ok        45%-56%      49%-59%
+      5     ok        57%-69%      60%-70%
+      6     ok        70%-81%      71%-83%
+      7     ok        82%-94%      84%-94%
+      8     full      95%-100%     95%-100%
+   */
+
+  /* we should tell capacity is 0% when battery is very low */
+  /* very low is someting between empty and low */
+  /* EDV1 is set when capacity is about 6% (which turn off device), so very low could be 8% */
+  /* so recalculate capacity from 8%-100% to 0%-100% (to tell 0% when battery is very low which means battery has 8%) */
+
+  /* bq27200 report percentage capacity against last full capacity */
+  /* we will recalculate percentage capacity against design capacity reported by rx51_battery (if driver is available) */
+  if(calibrated && battery_info->power_supply_charge_now > 0 && battery_info->power_supply_charge_design > 0)
+  {
+    if (100*battery_info->power_supply_charge_now > 8*battery_info->power_supply_charge_design)
+      capacity = 100 * (100*battery_info->power_supply_charge_now - 8*battery_info->power_supply_charge_design) / (92*battery_info->power_supply_charge_design);
+    else
+      capacity = 0;
+  }
+  else if(calibrated && battery_info->power_supply_charge_now > 0 && battery_info->power_supply_charge_full > 0)
+  {
+    if (100*battery_info->power_supply_charge_now > 8*battery_info->power_supply_charge_full)
+      capacity = 100 * (100*battery_info->power_supply_charge_now - 8*battery_info->power_supply_charge_full) / (92*battery_info->power_supply_charge_full);
+    else
+      capacity = 0;
+  }
+  else if(!no_voltage) /* when battery is not calibrated or other data is missing, report some capacity from voltage (if we have it) */
+  {
+    if (!charger_connected)
+    {
+      if (voltage <= params->voltage_threshold_empty)
+        battery_info->power_supply_capacity = 0;
+      else if (voltage <= params->voltage_threshold_verylow)
+        battery_info->power_supply_capacity = 7;
+      else if (voltage <= params->voltage_threshold_low)
+        battery_info->power_supply_capacity = 12;
+      else if (voltage > params->voltage_threshold_full)
+        battery_info->power_supply_capacity = 100;
+      else
+        battery_info->power_supply_capacity = 54;
+      capacity = 100*(battery_info->power_supply_capacity-8)/92;
+    }
+    else
+    {
+      if (voltage <= 4050) /* 14% */
+        capacity = 0;
+      else if (voltage <= 4089) /* 25% */
+        capacity = 13;
+      else if (voltage <= 4102) /* 37% */
+        capacity = 25;
+      else if (voltage <= 4110) /* 48% */
+        capacity = 38;
+      else if (voltage <= 4120) /* 59% */
+        capacity = 50;
+      else if (voltage <= 4134) /* 70% */
+        capacity = 63;
+      else if (voltage <= 4152) /* 83% */
+        capacity = 75;
+      else if (voltage <= 4168) /* 94% */
+        capacity = 88;
+      else
+        capacity = 100;
+      battery_info->power_supply_capacity = capacity*92/100+8;
+    }
+  }
+  else
+  {
+    /* otherwise we have no data, capacity is unknown and volage is not accesable */
+    capacity = 0;
+  }
+
+
+  if (capacity < 0)
+    capacity = 0;
+  else if (capacity > 100)
+    capacity = 100;
+
+  /* capacity_level is in upstream kernel */
+  if(battery_info->power_supply_capacity_level[0])
+  {
+    if (!strcmp(battery_info->power_supply_capacity_level, "Full"))
+      capacity_state = BME_CAPACITY_FULL;
+    else if (!strcmp(battery_info->power_supply_capacity_level, "High"))
+    {
+      if (is_charging)
+        capacity_state = BME_CAPACITY_OK;
+      else
+        capacity_state = BME_CAPACITY_FULL;
+    }
+    else if (!strcmp(battery_info->power_supply_capacity_level, "Normal"))
+    {
+      if (calibrated)
+        LEVEL_STATE(battery_info->power_supply_charge_now, params->charge_threshold_verylow,
+                    battery_info->power_supply_charge_now, charge_threshold_low,
+                    capacity_state, very_low);
+      else if (!no_voltage)
+        LEVEL_STATE(voltage_raw, params->voltage_threshold_verylow,
+                    voltage, voltage_threshold_low, capacity_state, very_low);
+      else
+        capacity_state = BME_CAPACITY_OK;
+    }
+    else if (!strcmp(battery_info->power_supply_capacity_level, "Low"))
+      capacity_state = BME_CAPACITY_EMPTY;
+    else if (!strcmp(battery_info->power_supply_capacity_level, "Critical"))
+      capacity_state = BME_CAPACITY_EMPTY;
+    else
+      capacity_state = BME_CAPACITY_OK;
+  }
+  /* registers is in maemo kernel-power */
+  /* code taken from upstream kernel */
+  else if (battery_info->power_supply_flags_register >= 0)
+  {
+    if (battery_info->power_supply_flags_register & 0x20) /* FLAG_FC */
+      capacity_state = BME_CAPACITY_FULL;
+    else if (battery_info->power_supply_flags_register & 0x01) /* FLAG_EDVF */
+      capacity_state = BME_CAPACITY_EMPTY;
+    else if (battery_info->power_supply_flags_register & 0x02) /* FLAG_EDV1 */
+      capacity_state = BME_CAPACITY_EMPTY;
+    else if (calibrated)
+      LEVEL_STATE(battery_info->power_supply_charge_now, params->charge_threshold_verylow,
+                  battery_info->power_supply_charge_now, charge_threshold_low,
+                  capacity_state, very_low);
+    else if (!no_voltage)
+      LEVEL_STATE(voltage_raw, params->voltage_threshold_verylow,
+                  voltage, voltage_threshold_low, capacity_state, very_low);
+    else
+      capacity_state = BME_CAPACITY_OK;
+  }
+  /* no maemo kernel-power or upstream kernel, but battery is calibrated */
+  /* check charge_now threshold */
+  else if (calibrated)
+  {
+    if (battery_info->power_supply_charge_now <= params->charge_threshold_empty)
+      capacity_state = BME_CAPACITY_EMPTY;
+    else if (battery_info->power_supply_charge_now <= params->charge_threshold_verylow) {
+      very_low = 1;
+      capacity_state = BME_CAPACITY_LOW;
+    } else if (battery_info->power_supply_charge_now <= charge_threshold_low)
+      capacity_state = BME_CAPACITY_LOW;
+    else if (battery_info->power_supply_capacity > params->capacity_threshold_full)
+    {
+      if (is_charging)
+        capacity_state = BME_CAPACITY_OK;
+      else
+        capacity_state = BME_CAPACITY_FULL;
+    }
+    else
+      capacity_state = BME_CAPACITY_OK;
+  }
+  /* battery is not calibrated and no access to FC, EDV1 or EDVF flags */
+  /* use voltage threshold (if voltage is accessable) */
+  else if (!no_voltage)
+  {
+    if (voltage_raw <= params->voltage_threshold_empty)
+      capacity_state = BME_CAPACITY_EMPTY;
+    else if (voltage_raw <= params->voltage_threshold_verylow) {
+      very_low = 1;
+      capacity_state = BME_CAPACITY_LOW;
+    } else if (voltage <= voltage_threshold_low)
+      capacity_state = BME_CAPACITY_LOW;
+    else if (voltage > params->voltage_threshold_full)
+    {
+      if (is_charging)
+        capacity_state = BME_CAPACITY_OK;
+      else
+        capacity_state = BME_CAPACITY_FULL;
+    }
+    else
+      capacity_state = BME_CAPACITY_OK;
+  }
+  else /* we do not know anything, report OK which will prevent device shutdown */
+    capacity_state = BME_CAPACITY_OK;
+
+  if (battery_info->power_supply_status == STATUS_FULL)
+    capacity_state = BME_CAPACITY_FULL;
+
+  if ((capacity_state == BME_CAPACITY_LOW || capacity_state == BME_CAPACITY_EMPTY) && charger_connected)
+    capacity_state = BME_CAPACITY_OK;
+
+  if (capacity_state == BME_CAPACITY_FULL)
+    result->next.is_full = 1;
+  else if (!charger_connected)
+    result->next.is_full = 0;
+
+  if (result->next.is_full)
+    capacity_state = BME_CAPACITY_FULL;
+
+  if (capacity_state == BME_CAPACITY_FULL && !calibrated)
+  {
+    battery_info->power_supply_capacity = 100;
+    capacity = 100;
+  }
+
+  if (very_low)
+    capacity = 0;
+
+  if (!charger_connected)
+    result->next.full_charger_connected = 0;
+
+  result->announce = capacity_state_needs_announce(params, &result->next, capacity_state,
+                                                   battery_info->power_supply_capacity,
+                                                   very_low, charger_connected, now);
+  if (result->announce)
+  {
+    result->next.capacity_state = capacity_state;
+    result->next.announced = now;
+    result->next.announced_capacity = battery_info->power_supply_capacity;
+    if (capacity_state == BME_CAPACITY_FULL && charger_connected)
+      result->next.full_charger_connected = 1;
+  }
+
+  if (!calibrated && battery_info->power_supply_charge_design)
+    battery_info->power_supply_charge_now = capacity*battery_info->power_supply_charge_design/100;
+
+  if (!calibrated)
+    battery_info->power_supply_charge_full = 0;
+  else if (battery_info->power_supply_status == STATUS_DISCHARGING &&
+           battery_info->power_supply_time_to_empty_avg > battery_info->power_supply_time_to_empty_idle &&
+           battery_info->power_supply_time_to_empty_idle)
+    battery_info->power_supply_time_to_empty_avg = battery_info->power_supply_time_to_empty_idle;
+
+  result->calibrated = calibrated;
+  result->charger_connected = charger_connected;
+  result->is_charging = is_charging;
+  result->positive_rate = positive_rate;
+  result->very_low = very_low;
+  result->emergency = (very_low || capacity_state == BME_CAPACITY_EMPTY) && !charger_connected;
+  result->capacity = capacity;
+  result->voltage_filtered = voltage;
+  result->charge_level_current = 8*(6.25+capacity)/100;
+  result->capacity_state = capacity_state;
+}
+
+int bme_policy_settled(const bme_policy_params *params, const bme_policy_state *state,
+                       const battery *sample)
+{
+  const bme_voltage_filter *filter = &state->voltage_filter;
+  const bme_current_average *average = &state->current_average;
+  int charger_connected = is_charger_connected(sample);
+  double error;
+
+  /* LOW and EMPTY are announced again after a while */
+  if (state->capacity_state == BME_CAPACITY_LOW || state->capacity_state == BME_CAPACITY_EMPTY)
+    return 0;
+
+  /* the average moves towards the sample, it must not cross into a flip */
+  if (!average->valid || average->settling || average->charger_connected != charger_connected ||
+      current_average_decide(params, average->positive_rate, sample->power_supply_current_now) !=
+      average->positive_rate)
+    return 0;
+
+  if (sample->power_supply_voltage_now <= 0)
+    return 1;
+
+  if (!filter->valid || filter->charger_connected != charger_connected)
+    return 0;
+
+  error = filter->voltage - voltage_filter_input(params, sample, charger_connected);
+  return error > -0.5 && error < 0.5;
+}
@@ -0,0 +1,178 @@
+/*
+ * bme-policy.h: battery state decisions of hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _BME_POLICY_H_
+#define _BME_POLICY_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/* what is plugged in, parsed once where the charger state is read */
+typedef enum {
+  CHARGER_NONE,
+  CHARGER_HOST_100,       /* not enumerated yet, bq24150a mode "none" */
+  CHARGER_HOST_500,       /* USB host or charging downstream port */
+  CHARGER_WALL            /* dedicated charger */
+} bme_charger;
+
+typedef struct {
+  enum{STATUS_FULL=1,STATUS_CHARGING,STATUS_DISCHARGING}power_supply_status;
+  int32_t capacity;
+  uint32_t power_supply_present;
+  uint32_t power_supply_voltage_design;
+  uint32_t power_supply_voltage_now;
+  int32_t  power_supply_capacity;
+  uint32_t power_supply_time_to_empty_avg;
+  uint32_t power_supply_time_to_empty_idle;
+  uint32_t power_supply_time_to_full_now;
+  uint32_t power_supply_charge_design;
+  uint32_t power_supply_charge_full;
+  uint32_t power_supply_charge_now;
+  int32_t  power_supply_current_now;
+  int32_t  power_supply_flags_register;
+  int32_t  power_supply_temp;
+  char   power_supply_capacity_level[32];
+  bme_charger charger;
+  int    boost;           /* bq24150a supplies VBUS */
+} battery;
+
+typedef enum {BME_CAPACITY_EMPTY=1,BME_CAPACITY_LOW,BME_CAPACITY_OK,BME_CAPACITY_FULL} bme_capacity_state;
+
+#define POWER_SUPPLY_CAPACITY_THRESHOLD_FULL 94
+
+#define POWER_SUPPLY_CHARGE_THRESHOLD_LOW 170
+#define POWER_SUPPLY_CHARGE_THRESHOLD_VERYLOW 100
+#define POWER_SUPPLY_CHARGE_THRESHOLD_EMPTY 70
+
+#define POWER_SUPPLY_VOLTAGE_THRESHOLD_FULL 4050
+#define POWER_SUPPLY_VOLTAGE_THRESHOLD_LOW 3640
+#define POWER_SUPPLY_VOLTAGE_THRESHOLD_VERYLOW 3530
+#define POWER_SUPPLY_VOLTAGE_THRESHOLD_EMPTY 3248
+
+/* margin needed to leave LOW again once it has been announced */
+#define POWER_SUPPLY_CHARGE_HYSTERESIS_LOW 10
+#define POWER_SUPPLY_VOLTAGE_HYSTERESIS_LOW 40
+
+/* how often unchanged LOW/EMPTY states are announced again (seconds) */
+#define CAPACITY_STATE_RENOTIFY_LOW 600
+#define CAPACITY_STATE_RENOTIFY_EMPTY 60
+
+/* voltage filter for uncalibrated gauges: internal resistance used to
+ * compensate the IR drop (mOhm), voltage drift (mV^2/s) and read noise (mV^2) */
+#define POWER_SUPPLY_VOLTAGE_FILTER_RESISTANCE 150
+#define POWER_SUPPLY_VOLTAGE_FILTER_DRIFT 0.5
+#define POWER_SUPPLY_VOLTAGE_FILTER_NOISE 400.0
+
+/* positive_rate follows an average of current_now: its time constant
+ * (seconds, 0 for the plain sample), the band around zero (mA) the average
+ * has to leave before the decision flips, and how long after the charger
+ * was connected or removed the gauge's current is not trusted (seconds) */
+#define POWER_SUPPLY_CURRENT_AVERAGE_WINDOW 60
+#define POWER_SUPPLY_CURRENT_HYSTERESIS 20
+#define POWER_SUPPLY_CURRENT_SETTLE 10
+
+/* delay between EMPTY and asking dsme to shut down (seconds) */
+#define CAPACITY_STATE_EMPTY_SHUTDOWN_DELAY 10
+
+typedef struct {
+  int32_t capacity_threshold_full;
+  uint32_t charge_threshold_low;
+  uint32_t charge_threshold_verylow;
+  uint32_t charge_threshold_empty;
+  uint32_t voltage_threshold_full;
+  uint32_t voltage_threshold_low;
+  uint32_t voltage_threshold_verylow;
+  uint32_t voltage_threshold_empty;
+  uint32_t charge_hysteresis_low;
+  uint32_t voltage_hysteresis_low;
+  time_t renotify_low;
+  time_t renotify_empty;
+  uint32_t voltage_filter_resistance;
+  double voltage_filter_drift;
+  double voltage_filter_noise;
+  time_t current_average_window;
+  uint32_t current_hysteresis;
+  time_t current_settle;
+} bme_policy_params;
+
+/* one dimensional Kalman filter over the (IR compensated) voltage */
+typedef struct {
+  int valid;
+  int charger_connected;  /* filter restarts when this changes */
+  double voltage;         /* estimate, mV */
+  double variance;        /* of the estimate, mV^2 */
+  time_t updated;
+} bme_voltage_filter;
+
+/* exponential average of current_now, negative while charging */
+typedef struct {
+  int valid;
+  int charger_connected;  /* settling starts again when this changes */
+  int settling;
+  int positive_rate;      /* last decision */
+  double current;         /* mA */
+  time_t updated;         /* or when settling started */
+} bme_current_average;
+
+/* what the policy remembers between samples */
+typedef struct {
+  bme_capacity_state capacity_state; /* last announced */
+  int is_full;
+  time_t announced;
+  int32_t announced_capacity;
+  int full_charger_connected;        /* FULL announced on this connection */
+  bme_voltage_filter voltage_filter;
+  bme_current_average current_average;
+} bme_policy_state;
+
+typedef struct {
+  battery battery;        /* the sample with derived values filled in */
+  int calibrated;
+  int charger_connected;
+  int is_charging;
+  int positive_rate;
+  int very_low;
+  int emergency;          /* very low or empty without a charger */
+  int capacity;           /* percentage */
+  uint32_t charge_level_current; /* bars */
+  uint32_t voltage_filtered; /* mV, what uncalibrated decisions are based on */
+  bme_capacity_state capacity_state;
+  int announce;           /* capacity_state has to be (re)announced */
+  bme_policy_state next;
+} bme_policy_result;
+
+/* a host that did not enumerate us yet does not count as a charger */
+int bme_charger_is_connected(bme_charger charger);
+
+/* the bq24150a mode attribute: none, host, dedicated, boost or off */
+bme_charger bme_charger_parse_mode(const char *mode, int *boost);
+
+void bme_policy_params_init(bme_policy_params *params);
+void bme_policy_state_init(bme_policy_state *state);
+
+/* no side effects, everything the caller needs to publish is in result */
+void bme_policy_evaluate(const bme_policy_params *params, const bme_policy_state *state,
+                         const battery *sample, time_t now, bme_policy_result *result);
+
+/* nonzero when evaluating the same sample again later can not change the
+ * result: no re-announcement can become due and the voltage filter has
+ * converged on the sample */
+int bme_policy_settled(const bme_policy_params *params, const bme_policy_state *state,
+                       const battery *sample);
+
+#endif /* _BME_POLICY_H_ */
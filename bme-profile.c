@@ -0,0 +1,271 @@
+/*
+ * bme-profile.c: high rate current and voltage sampling of hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbus-names.h"
+#include "bme-loop.h"
+#include "bme-profile.h"
+
+/* layout documented with BME_PROFILE_START_REQ, fits PIPE_BUF so a write
+ * is either complete or fails with EAGAIN */
+typedef struct {
+  uint32_t sequence;
+  uint32_t time_ms;
+  int32_t current_ua;
+  int32_t voltage_uv;
+} profile_sample;
+
+#define PROFILE_INVALID INT32_MIN
+
+typedef struct {
+  int fd;                       /* write end of the pipe, -1 when idle */
+  char *owner;                  /* unique name of the caller */
+  unsigned int timer;
+  struct timespec start;
+  uint32_t duration_ms;
+  uint32_t sequence;
+} profile_session;
+
+/* unix fd passing came with libdbus 1.3.1, built against an older one
+ * every request is answered with NotSupported */
+#ifdef DBUS_TYPE_UNIX_FD
+static int profile_can_pass_fd(DBusConnection *connection)
+{
+  return dbus_connection_can_send_type(connection, DBUS_TYPE_UNIX_FD);
+}
+
+static dbus_bool_t profile_append_fd(DBusMessage *reply, int *fd)
+{
+  return dbus_message_append_args(reply, DBUS_TYPE_UNIX_FD, fd, DBUS_TYPE_INVALID);
+}
+#else
+static int profile_can_pass_fd(DBusConnection *connection)
+{
+  (void)connection;
+  return 0;
+}
+
+static dbus_bool_t profile_append_fd(DBusMessage *reply, int *fd)
+{
+  (void)reply;
+  (void)fd;
+  return FALSE;
+}
+#endif
+
+static DBusConnection *profile_connection = NULL;
+static const char *profile_current_path = NULL;
+static const char *profile_voltage_path = NULL;
+static int current_fd = -1;
+static int voltage_fd = -1;
+
+static profile_session session = { -1, NULL, 0, { 0, 0 }, 0, 0 };
+
+static uint32_t elapsed_ms(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec)*1000 + (now.tv_nsec - start->tv_nsec)/1000000;
+}
+
+static void owner_match(const char *owner, int add)
+{
+  char match[256];
+
+  snprintf(match, sizeof(match),
+           "type='signal',sender='%s',path='%s',interface='%s',member='NameOwnerChanged',arg0='%s'",
+           DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, owner);
+
+  if (add)
+    dbus_bus_add_match(profile_connection, match, NULL);
+  else
+    dbus_bus_remove_match(profile_connection, match, NULL);
+}
+
+/* an attribute file stays open, reading it again from offset 0 makes the
+ * driver query the gauge again */
+static int32_t read_attribute(int *fd, const char *path)
+{
+  char line[32];
+  ssize_t len;
+
+  if (*fd < 0 && (*fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return PROFILE_INVALID;
+
+  len = pread(*fd, line, sizeof(line) - 1, 0);
+  if (len <= 0)
+    return PROFILE_INVALID;
+  line[len] = 0;
+
+  return atoi(line);
+}
+
+static void session_end(void)
+{
+  if (session.fd < 0)
+    return;
+
+  if (session.timer)
+    bme_loop_source_remove(session.timer);
+  close(session.fd);
+  if (session.owner)
+    owner_match(session.owner, 0);
+  free(session.owner);
+
+  session.fd = -1;
+  session.owner = NULL;
+  session.timer = 0;
+
+  /* the files are only needed while profiling */
+  if (current_fd >= 0)
+    close(current_fd);
+  if (voltage_fd >= 0)
+    close(voltage_fd);
+  current_fd = voltage_fd = -1;
+}
+
+static int session_sample(void *data)
+{
+  profile_sample sample;
+  ssize_t len;
+
+  (void)data;
+
+  sample.time_ms = elapsed_ms(&session.start);
+  if (sample.time_ms >= session.duration_ms)
+  {
+    session.timer = 0;
+    session_end();
+    return 0;
+  }
+
+  sample.sequence = session.sequence++;
+  sample.current_ua = read_attribute(&current_fd, profile_current_path);
+  sample.voltage_uv = read_attribute(&voltage_fd, profile_voltage_path);
+
+  /* a full pipe drops the sample, the gap shows in the sequence */
+  len = write(session.fd, &sample, sizeof(sample));
+  if (len < 0 && errno != EAGAIN && errno != EINTR)
+  {
+    /* EPIPE, the caller closed its end */
+    session.timer = 0;
+    session_end();
+    return 0;
+  }
+
+  return 1;
+}
+
+int bme_profile_init(DBusConnection *connection, const char *current_path, const char *voltage_path)
+{
+  profile_connection = connection;
+  profile_current_path = current_path;
+  profile_voltage_path = voltage_path;
+
+  /* libdbus does the same for its sockets, a pipe needs it as well */
+  signal(SIGPIPE, SIG_IGN);
+
+  return 0;
+}
+
+DBusHandlerResult bme_profile_start(DBusConnection *connection, DBusMessage *message)
+{
+  DBusError error;
+  DBusMessage *reply = NULL;
+  const char *sender = dbus_message_get_sender(message);
+  uint32_t rate, duration;
+  int fds[2] = { -1, -1 };
+
+  dbus_error_init(&error);
+
+  if (!dbus_message_get_args(message, &error,
+                             DBUS_TYPE_UINT32, &rate,
+                             DBUS_TYPE_UINT32, &duration,
+                             DBUS_TYPE_INVALID))
+    reply = dbus_message_new_error(message, BME_ERROR_INVALID_ARGS, error.message);
+  else if (!rate || rate > BME_PROFILE_RATE_MAX || !duration || duration > BME_PROFILE_DURATION_MAX)
+    reply = dbus_message_new_error(message, BME_ERROR_INVALID_ARGS, "rate or duration out of range");
+  else if (!sender || !profile_can_pass_fd(connection))
+    reply = dbus_message_new_error(message, DBUS_ERROR_NOT_SUPPORTED, "no unix fd passing");
+  else if (session.fd >= 0 && strcmp(session.owner, sender))
+    reply = dbus_message_new_error(message, DBUS_ERROR_LIMITS_EXCEEDED, "another session is running");
+  else if (pipe2(fds, O_CLOEXEC) < 0 || fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0)
+    reply = dbus_message_new_error(message, BME_ERROR_FATAL, strerror(errno));
+  else if ((reply = dbus_message_new_method_return(message)) &&
+           !profile_append_fd(reply, &fds[0]))
+  {
+    dbus_message_unref(reply);
+    reply = NULL;
+  }
+  else if (reply)
+  {
+    /* a new request of the same caller replaces its session */
+    session_end();
+
+    session.fd = fds[1];
+    session.owner = strdup(sender);
+    session.duration_ms = duration*1000;
+    session.sequence = 0;
+    clock_gettime(CLOCK_MONOTONIC, &session.start);
+    session.timer = bme_loop_timeout_add(1000/rate, session_sample, NULL);
+    if (session.owner)
+      owner_match(session.owner, 1);
+    fds[1] = -1;
+
+    if (!session.owner || !session.timer)
+    {
+      session_end();
+      dbus_message_unref(reply);
+      reply = dbus_message_new_error(message, BME_ERROR_FATAL, "out of memory");
+    }
+  }
+  dbus_error_free(&error);
+
+  /* the message holds a duplicate of the read end */
+  if (fds[0] >= 0)
+    close(fds[0]);
+  if (fds[1] >= 0)
+    close(fds[1]);
+
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  if (!dbus_message_get_no_reply(message))
+    dbus_connection_send(connection, reply, 0);
+  dbus_message_unref(reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+void bme_profile_name_lost(const char *name)
+{
+  if (session.fd >= 0 && !strcmp(session.owner, name))
+    session_end();
+}
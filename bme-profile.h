@@ -0,0 +1,45 @@
+/*
+ * bme-profile.h: high rate current and voltage sampling of hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _BME_PROFILE_H_
+#define _BME_PROFILE_H_
+
+#include <dbus/dbus.h>
+
+/*
+ * A profiling session samples current_now and voltage_now of the gauge at
+ * up to BME_PROFILE_RATE_MAX Hz and writes every sample as a fixed size
+ * record, see BME_PROFILE_START_REQ, into a pipe whose read end is passed
+ * to the caller. Nothing else is sent per sample: no D-Bus messages and no
+ * HAL writes. There is one session at a time. It ends after the requested
+ * duration, when the caller closes the pipe or when the caller leaves the
+ * bus.
+ */
+
+#define BME_PROFILE_RATE_MAX 20		/* Hz */
+#define BME_PROFILE_DURATION_MAX 600	/* seconds */
+
+/* paths are the gauge's current_now and voltage_now attributes */
+int bme_profile_init(DBusConnection *connection, const char *current_path, const char *voltage_path);
+
+DBusHandlerResult bme_profile_start(DBusConnection *connection, DBusMessage *message);
+
+/* name left the bus, ends its session */
+void bme_profile_name_lost(const char *name);
+
+#endif /* _BME_PROFILE_H_ */
@@ -0,0 +1,541 @@
+/*
+ * bme-replay.c: replay recorded battery traces through the hald-addon-bme policy
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A trace is a sequence of samples, each started by a line "@<seconds>"
+ * followed by the raw KEY=VALUE lines of the bq27200 uevent and registers
+ * files, the rx51-battery uevent and "MODE=<bq24150a mode>". Such a trace
+ * can be recorded on the device with
+ *
+ *   while sleep 30; do
+ *     echo @$(cut -d' ' -f1 /proc/uptime)
+ *     cat /sys/class/power_supply/bq27200-0/uevent \
+ *         /sys/class/power_supply/bq27200-0/registers \
+ *         /sys/class/power_supply/rx51-battery/uevent
+ *     echo MODE=$(cat /sys/class/power_supply/bq24150a-0/mode)
+ *   done
+ *
+ * The trace is parsed once, then every combination of the given parameter
+ * ranges is replayed through bme_policy_evaluate() on all cores. For each
+ * combination the signals hald-addon-bme would have sent, the time spent in
+ * LOW and how long before the end of the trace dsme would have been asked
+ * to shut down are printed as tab separated values.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "bme-policy.h"
+
+typedef struct {
+  double time;
+  battery battery;
+} replay_sample;
+
+typedef struct {
+  replay_sample *samples;
+  size_t count;
+  size_t allocated;
+} replay_trace;
+
+enum {
+  PARAM_CHARGE_LOW,
+  PARAM_CHARGE_VERYLOW,
+  PARAM_CHARGE_EMPTY,
+  PARAM_VOLTAGE_LOW,
+  PARAM_VOLTAGE_VERYLOW,
+  PARAM_VOLTAGE_EMPTY,
+  PARAM_CHARGE_HYSTERESIS,
+  PARAM_VOLTAGE_HYSTERESIS,
+  PARAM_RENOTIFY_LOW,
+  PARAM_RENOTIFY_EMPTY,
+  PARAM_SHUTDOWN_DELAY,
+  PARAM_BATTERY_RESISTANCE,
+  PARAM_CURRENT_AVERAGE,
+  PARAM_CURRENT_HYSTERESIS,
+  PARAM_COUNT
+};
+
+/* value range of one parameter, start == end when not varied */
+typedef struct {
+  const char *name;
+  long start;
+  long end;
+  long step;
+} replay_range;
+
+static replay_range ranges[PARAM_COUNT] = {
+  { "charge-low", POWER_SUPPLY_CHARGE_THRESHOLD_LOW, POWER_SUPPLY_CHARGE_THRESHOLD_LOW, 1 },
+  { "charge-verylow", POWER_SUPPLY_CHARGE_THRESHOLD_VERYLOW, POWER_SUPPLY_CHARGE_THRESHOLD_VERYLOW, 1 },
+  { "charge-empty", POWER_SUPPLY_CHARGE_THRESHOLD_EMPTY, POWER_SUPPLY_CHARGE_THRESHOLD_EMPTY, 1 },
+  { "voltage-low", POWER_SUPPLY_VOLTAGE_THRESHOLD_LOW, POWER_SUPPLY_VOLTAGE_THRESHOLD_LOW, 1 },
+  { "voltage-verylow", POWER_SUPPLY_VOLTAGE_THRESHOLD_VERYLOW, POWER_SUPPLY_VOLTAGE_THRESHOLD_VERYLOW, 1 },
+  { "voltage-empty", POWER_SUPPLY_VOLTAGE_THRESHOLD_EMPTY, POWER_SUPPLY_VOLTAGE_THRESHOLD_EMPTY, 1 },
+  { "charge-hysteresis", POWER_SUPPLY_CHARGE_HYSTERESIS_LOW, POWER_SUPPLY_CHARGE_HYSTERESIS_LOW, 1 },
+  { "voltage-hysteresis", POWER_SUPPLY_VOLTAGE_HYSTERESIS_LOW, POWER_SUPPLY_VOLTAGE_HYSTERESIS_LOW, 1 },
+  { "renotify-low", CAPACITY_STATE_RENOTIFY_LOW, CAPACITY_STATE_RENOTIFY_LOW, 1 },
+  { "renotify-empty", CAPACITY_STATE_RENOTIFY_EMPTY, CAPACITY_STATE_RENOTIFY_EMPTY, 1 },
+  { "shutdown-delay", CAPACITY_STATE_EMPTY_SHUTDOWN_DELAY, CAPACITY_STATE_EMPTY_SHUTDOWN_DELAY, 1 },
+  { "battery-resistance", POWER_SUPPLY_VOLTAGE_FILTER_RESISTANCE, POWER_SUPPLY_VOLTAGE_FILTER_RESISTANCE, 1 },
+  { "current-average", POWER_SUPPLY_CURRENT_AVERAGE_WINDOW, POWER_SUPPLY_CURRENT_AVERAGE_WINDOW, 1 },
+  { "current-hysteresis", POWER_SUPPLY_CURRENT_HYSTERESIS, POWER_SUPPLY_CURRENT_HYSTERESIS, 1 },
+};
+
+typedef struct {
+  long values[PARAM_COUNT];
+  /* results */
+  unsigned int battery_low;
+  unsigned int battery_empty;
+  unsigned int battery_full;
+  unsigned int battery_state_changed;
+  unsigned int charger;
+  unsigned int charging;
+  double time_low;
+  int shutdown;
+  double shutdown_lead;
+  size_t samples;  /* evaluated, the replay ends early at a shutdown */
+} replay_config;
+
+typedef struct {
+  const replay_trace *trace;
+  replay_config *configs;
+  size_t count;
+  size_t next;
+} replay_job;
+
+static void usage(const char *name)
+{
+  int i;
+
+  fprintf(stderr, "usage: %s [options] TRACE\n\n", name);
+  fprintf(stderr, "  -j, --jobs=N             worker threads (default: online cpus)\n");
+  for (i = 0; i < PARAM_COUNT; i++)
+    fprintf(stderr, "      --%s=FROM[:TO[:STEP]] (default: %ld)\n", ranges[i].name, ranges[i].start);
+}
+
+static int parse_range(replay_range *range, const char *arg)
+{
+  char *end;
+
+  range->start = strtol(arg, &end, 10);
+  range->end = range->start;
+  range->step = 1;
+  if (*end == ':')
+    range->end = strtol(end + 1, &end, 10);
+  if (*end == ':')
+    range->step = strtol(end + 1, &end, 10);
+  if (*end || range->step <= 0 || range->end < range->start)
+    return -1;
+  return 0;
+}
+
+static replay_sample * trace_add_sample(replay_trace *trace, double time)
+{
+  replay_sample *sample;
+
+  if (trace->count == trace->allocated)
+  {
+    size_t allocated = trace->allocated ? 2*trace->allocated : 4096;
+    replay_sample *samples = realloc(trace->samples, allocated*sizeof(*samples));
+    if (!samples)
+      return NULL;
+    trace->samples = samples;
+    trace->allocated = allocated;
+  }
+
+  sample = &trace->samples[trace->count++];
+  memset(sample, 0, sizeof(*sample));
+  sample->time = time;
+  sample->battery.power_supply_capacity = -1;
+  sample->battery.power_supply_flags_register = -1;
+  /* the charger mode is only reported on change, keep the last one */
+  if (trace->count > 1)
+  {
+    sample->battery.charger = sample[-1].battery.charger;
+    sample->battery.boost = sample[-1].battery.boost;
+  }
+  return sample;
+}
+
+/* same conversions as the sysfs readers of hald-addon-bme */
+static void trace_parse_line(battery *battery_info, char *line)
+{
+  char *tmp;
+  int num;
+
+  tmp = strchr(line, '=');
+  if (!tmp)
+    return;
+  *tmp = 0;
+  tmp++;
+
+  if (!strcmp(line, "POWER_SUPPLY_CAPACITY"))
+    battery_info->power_supply_capacity = atoi(tmp);
+  else if (!strcmp(line, "POWER_SUPPLY_STATUS"))
+  {
+    if (!strcmp(tmp, "Full")) battery_info->power_supply_status = STATUS_FULL;
+    else if (!strcmp(tmp, "Charging")) battery_info->power_supply_status = STATUS_CHARGING;
+    else battery_info->power_supply_status = STATUS_DISCHARGING;
+  }
+  else if (!strcmp(line, "POWER_SUPPLY_CURRENT_NOW"))
+    battery_info->power_supply_current_now = atoi(tmp)/1000;
+  else if (!strcmp(line, "POWER_SUPPLY_VOLTAGE_NOW"))
+    battery_info->power_supply_voltage_now = atoi(tmp)/1000;
+  else if (!strcmp(line, "POWER_SUPPLY_VOLTAGE_MAX_DESIGN"))
+    battery_info->power_supply_voltage_design = atoi(tmp)/1000;
+  else if (!strcmp(line, "POWER_SUPPLY_TIME_TO_FULL_NOW"))
+    battery_info->power_supply_time_to_full_now = atoi(tmp);
+  else if (!strcmp(line, "POWER_SUPPLY_TIME_TO_EMPTY_AVG"))
+    battery_info->power_supply_time_to_empty_avg = atoi(tmp);
+  else if (!strcmp(line, "POWER_SUPPLY_CHARGE_FULL"))
+    battery_info->power_supply_charge_full = atoi(tmp)/1000;
+  else if (!strcmp(line, "POWER_SUPPLY_CHARGE_FULL_DESIGN"))
+    battery_info->power_supply_charge_design = atoi(tmp)/1000;
+  else if (!strcmp(line, "POWER_SUPPLY_CHARGE_NOW"))
+    battery_info->power_supply_charge_now = atoi(tmp)/1000;
+  else if (!strcmp(line, "POWER_SUPPLY_TEMP"))
+    battery_info->power_supply_temp = atoi(tmp);
+  else if (!strcmp(line, "POWER_SUPPLY_CAPACITY_LEVEL"))
+    strncpy(battery_info->power_supply_capacity_level, tmp,
+            sizeof(battery_info->power_supply_capacity_level)-1);
+  else if (!strcmp(line, "0x0a"))
+    battery_info->power_supply_flags_register = strtol(tmp, NULL, 16);
+  else if (!strcmp(line, "0x1c"))
+  {
+    num = strtol(tmp, NULL, 16);
+    if (num != 65535)
+      battery_info->power_supply_time_to_empty_idle = num * 60;
+  }
+  else if (!strcmp(line, "MODE"))
+    battery_info->charger = bme_charger_parse_mode(tmp, &battery_info->boost);
+}
+
+static int trace_load(replay_trace *trace, const char *path)
+{
+  FILE *fp;
+  char line[256];
+  replay_sample *sample = NULL;
+
+  if (!strcmp(path, "-"))
+    fp = stdin;
+  else if ((fp = fopen(path, "r")) == NULL)
+  {
+    fprintf(stderr, "unable to open %s(%s)\n", path, strerror(errno));
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp))
+  {
+    line[strcspn(line, "\r\n")] = 0;
+    if (line[0] == '@')
+    {
+      if ((sample = trace_add_sample(trace, atof(line + 1))) == NULL)
+      {
+        fprintf(stderr, "out of memory\n");
+        break;
+      }
+    }
+    else if (sample)
+      trace_parse_line(&sample->battery, line);
+  }
+
+  if (fp != stdin)
+    fclose(fp);
+  return sample ? 0 : -1;
+}
+
+static void config_params(const replay_config *config, bme_policy_params *params)
+{
+  bme_policy_params_init(params);
+  params->charge_threshold_low = config->values[PARAM_CHARGE_LOW];
+  params->charge_threshold_verylow = config->values[PARAM_CHARGE_VERYLOW];
+  params->charge_threshold_empty = config->values[PARAM_CHARGE_EMPTY];
+  params->voltage_threshold_low = config->values[PARAM_VOLTAGE_LOW];
+  params->voltage_threshold_verylow = config->values[PARAM_VOLTAGE_VERYLOW];
+  params->voltage_threshold_empty = config->values[PARAM_VOLTAGE_EMPTY];
+  params->charge_hysteresis_low = config->values[PARAM_CHARGE_HYSTERESIS];
+  params->voltage_hysteresis_low = config->values[PARAM_VOLTAGE_HYSTERESIS];
+  params->renotify_low = config->values[PARAM_RENOTIFY_LOW];
+  params->renotify_empty = config->values[PARAM_RENOTIFY_EMPTY];
+  params->voltage_filter_resistance = config->values[PARAM_BATTERY_RESISTANCE];
+  params->current_average_window = config->values[PARAM_CURRENT_AVERAGE];
+  params->current_hysteresis = config->values[PARAM_CURRENT_HYSTERESIS];
+}
+
+/* mirrors what hald_addon_bme_update_hal() publishes for each poll */
+static void replay(const replay_trace *trace, replay_config *config)
+{
+  bme_policy_params params;
+  bme_policy_state state;
+  bme_policy_result result;
+  bme_capacity_state published = BME_CAPACITY_OK;
+  uint32_t bars = 0;
+  int charger_connected = -1;
+  int is_charging = -1;
+  int shutdown_pending = 0;
+  double shutdown_at = 0;
+  double end = trace->samples[trace->count-1].time;
+  size_t i;
+
+  config_params(config, &params);
+  bme_policy_state_init(&state);
+
+  for (i = 0; i < trace->count; i++)
+  {
+    const replay_sample *sample = &trace->samples[i];
+
+    if (shutdown_pending && sample->time >= shutdown_at)
+    {
+      shutdown_pending = 0;
+      if (!is_charging)
+      {
+        config->shutdown = 1;
+        config->shutdown_lead = end - shutdown_at;
+        return;
+      }
+    }
+
+    if (i > 0 && published == BME_CAPACITY_LOW)
+      config->time_low += sample->time - sample[-1].time;
+
+    bme_policy_evaluate(&params, &state, &sample->battery, (time_t)sample->time, &result);
+    state = result.next;
+    config->samples++;
+
+    /* as the addon, plugging in a charger cancels the shutdown */
+    if (shutdown_pending && result.charger_connected)
+      shutdown_pending = 0;
+
+    if (result.announce)
+    {
+      published = result.capacity_state;
+      if (published == BME_CAPACITY_LOW)
+        config->battery_low++;
+      else if (published == BME_CAPACITY_EMPTY)
+      {
+        config->battery_empty++;
+        if (!shutdown_pending)
+        {
+          shutdown_pending = 1;
+          shutdown_at = sample->time + config->values[PARAM_SHUTDOWN_DELAY];
+        }
+      }
+      else if (published == BME_CAPACITY_FULL && charger_connected == 1)
+        config->battery_full++;
+    }
+
+    if (bars != result.charge_level_current)
+    {
+      bars = result.charge_level_current;
+      if (result.capacity_state != BME_CAPACITY_EMPTY)
+        config->battery_state_changed++;
+    }
+
+    if (charger_connected != result.charger_connected)
+    {
+      charger_connected = result.charger_connected;
+      config->charger++;
+    }
+
+    if (is_charging != result.is_charging)
+    {
+      is_charging = result.is_charging;
+      if (result.capacity_state != BME_CAPACITY_FULL || !is_charging)
+        config->charging++;
+    }
+  }
+
+  if (shutdown_pending && !is_charging && shutdown_at <= end)
+  {
+    config->shutdown = 1;
+    config->shutdown_lead = end - shutdown_at;
+  }
+}
+
+static void * replay_worker(void *data)
+{
+  replay_job *job = data;
+  size_t i;
+
+  while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count)
+    replay(job->trace, &job->configs[i]);
+
+  return NULL;
+}
+
+static size_t range_count(const replay_range *range)
+{
+  return (range->end - range->start)/range->step + 1;
+}
+
+static replay_config * build_configs(size_t *count)
+{
+  replay_config *configs;
+  size_t total = 1;
+  size_t i;
+  int p;
+
+  for (p = 0; p < PARAM_COUNT; p++)
+    total *= range_count(&ranges[p]);
+
+  configs = calloc(total, sizeof(*configs));
+  if (!configs)
+    return NULL;
+
+  for (i = 0; i < total; i++)
+  {
+    size_t rest = i;
+    for (p = PARAM_COUNT-1; p >= 0; p--)
+    {
+      size_t n = range_count(&ranges[p]);
+      configs[i].values[p] = ranges[p].start + (long)(rest % n)*ranges[p].step;
+      rest /= n;
+    }
+  }
+
+  *count = total;
+  return configs;
+}
+
+static void print_results(const replay_config *configs, size_t count)
+{
+  size_t i;
+  int p;
+
+  for (p = 0; p < PARAM_COUNT; p++)
+    printf("%s\t", ranges[p].name);
+  printf("battery_low\tbattery_empty\tbattery_full\tbattery_state_changed\tcharger\tcharging\ttime_low\tshutdown_lead\n");
+
+  for (i = 0; i < count; i++)
+  {
+    for (p = 0; p < PARAM_COUNT; p++)
+      printf("%ld\t", configs[i].values[p]);
+    printf("%u\t%u\t%u\t%u\t%u\t%u\t%.0f\t",
+           configs[i].battery_low, configs[i].battery_empty, configs[i].battery_full,
+           configs[i].battery_state_changed, configs[i].charger, configs[i].charging,
+           configs[i].time_low);
+    if (configs[i].shutdown)
+      printf("%.0f\n", configs[i].shutdown_lead);
+    else
+      printf("-\n");
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct option options[PARAM_COUNT + 3];
+  replay_trace trace = { NULL, 0, 0 };
+  replay_job job;
+  pthread_t *threads;
+  struct timeval start, stop;
+  double elapsed;
+  size_t samples = 0;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  long started;
+  int opt;
+  int i;
+
+  memset(options, 0, sizeof(options));
+  options[0].name = "jobs";
+  options[0].has_arg = required_argument;
+  options[0].val = 'j';
+  options[1].name = "help";
+  options[1].val = 'h';
+  for (i = 0; i < PARAM_COUNT; i++)
+  {
+    options[i+2].name = ranges[i].name;
+    options[i+2].has_arg = required_argument;
+    options[i+2].val = 256 + i;
+  }
+
+  while ((opt = getopt_long(argc, argv, "j:h", options, NULL)) != -1)
+  {
+    if (opt == 'j')
+      jobs = atol(optarg);
+    else if (opt >= 256 && opt < 256 + PARAM_COUNT)
+    {
+      if (parse_range(&ranges[opt-256], optarg) < 0)
+      {
+        fprintf(stderr, "invalid range for --%s: %s\n", ranges[opt-256].name, optarg);
+        return 1;
+      }
+    }
+    else
+    {
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (optind != argc - 1)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (trace_load(&trace, argv[optind]) < 0)
+  {
+    fprintf(stderr, "no samples in %s\n", argv[optind]);
+    return 1;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.trace = &trace;
+  if ((job.configs = build_configs(&job.count)) == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  if (jobs < 1)
+    jobs = 1;
+  if ((size_t)jobs > job.count)
+    jobs = job.count;
+  threads = calloc(jobs, sizeof(*threads));
+
+  gettimeofday(&start, NULL);
+  for (started = 0; threads && started < jobs; started++)
+    if (pthread_create(&threads[started], NULL, replay_worker, &job))
+      break;
+  /* whatever could not be handed to a thread runs here */
+  replay_worker(&job);
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  gettimeofday(&stop, NULL);
+
+  print_results(job.configs, job.count);
+
+  for (i = 0; (size_t)i < job.count; i++)
+    samples += job.configs[i].samples;
+
+  elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec)/1e6;
+  fprintf(stderr, "%lu samples x %lu configurations in %.3f s (%.0f samples/s, %ld threads)\n",
+          (unsigned long)trace.count, (unsigned long)job.count, elapsed,
+          elapsed > 0 ? samples/elapsed : 0, started);
+
+  free(threads);
+  free(job.configs);
+  free(trace.samples);
+  return 0;
+}
@@ -0,0 +1,438 @@
+/*
+ * bme-upower.c: org.freedesktop.UPower.Device export of hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dbus-names.h"
+#include "bme-upower.h"
+
+/* values of the UPower Type, State, Technology, WarningLevel and
+ * BatteryLevel properties */
+#define UPOWER_TYPE_BATTERY 2
+
+#define UPOWER_STATE_CHARGING 1
+#define UPOWER_STATE_DISCHARGING 2
+#define UPOWER_STATE_FULLY_CHARGED 4
+#define UPOWER_STATE_PENDING_CHARGE 5
+
+#define UPOWER_TECHNOLOGY_LITHIUM_ION 1
+
+#define UPOWER_WARNING_NONE 1
+#define UPOWER_WARNING_LOW 3
+#define UPOWER_WARNING_CRITICAL 4
+#define UPOWER_WARNING_ACTION 5
+
+#define UPOWER_BATTERY_LEVEL_NONE 1
+
+/* nominal voltage in mV, turns the gauge charge (mAh) into Wh */
+#define UPOWER_NOMINAL_VOLTAGE 3700
+
+typedef struct {
+  const char *native_path;
+  const char *vendor;
+  const char *model;
+  dbus_uint64_t update_time;
+  uint32_t type;
+  dbus_bool_t power_supply;
+  dbus_bool_t has_history;
+  dbus_bool_t has_statistics;
+  double energy;              /* Wh */
+  double energy_empty;
+  double energy_full;
+  double energy_full_design;
+  double energy_rate;         /* W */
+  double voltage;             /* V */
+  dbus_int64_t time_to_empty; /* seconds */
+  dbus_int64_t time_to_full;
+  double percentage;
+  dbus_bool_t is_present;
+  uint32_t state;
+  dbus_bool_t is_rechargeable;
+  double capacity;            /* percent of the design capacity */
+  uint32_t technology;
+  uint32_t warning_level;
+  uint32_t battery_level;
+  const char *icon_name;
+} upower_device;
+
+typedef struct {
+  const char *name;
+  int type;
+  size_t offset;
+} upower_property;
+
+#define PROPERTY(name, type, field) { name, type, offsetof(upower_device, field) }
+
+static const upower_property properties[] = {
+  PROPERTY("NativePath", DBUS_TYPE_STRING, native_path),
+  PROPERTY("Vendor", DBUS_TYPE_STRING, vendor),
+  PROPERTY("Model", DBUS_TYPE_STRING, model),
+  PROPERTY("UpdateTime", DBUS_TYPE_UINT64, update_time),
+  PROPERTY("Type", DBUS_TYPE_UINT32, type),
+  PROPERTY("PowerSupply", DBUS_TYPE_BOOLEAN, power_supply),
+  PROPERTY("HasHistory", DBUS_TYPE_BOOLEAN, has_history),
+  PROPERTY("HasStatistics", DBUS_TYPE_BOOLEAN, has_statistics),
+  PROPERTY("Energy", DBUS_TYPE_DOUBLE, energy),
+  PROPERTY("EnergyEmpty", DBUS_TYPE_DOUBLE, energy_empty),
+  PROPERTY("EnergyFull", DBUS_TYPE_DOUBLE, energy_full),
+  PROPERTY("EnergyFullDesign", DBUS_TYPE_DOUBLE, energy_full_design),
+  PROPERTY("EnergyRate", DBUS_TYPE_DOUBLE, energy_rate),
+  PROPERTY("Voltage", DBUS_TYPE_DOUBLE, voltage),
+  PROPERTY("TimeToEmpty", DBUS_TYPE_INT64, time_to_empty),
+  PROPERTY("TimeToFull", DBUS_TYPE_INT64, time_to_full),
+  PROPERTY("Percentage", DBUS_TYPE_DOUBLE, percentage),
+  PROPERTY("IsPresent", DBUS_TYPE_BOOLEAN, is_present),
+  PROPERTY("State", DBUS_TYPE_UINT32, state),
+  PROPERTY("IsRechargeable", DBUS_TYPE_BOOLEAN, is_rechargeable),
+  PROPERTY("Capacity", DBUS_TYPE_DOUBLE, capacity),
+  PROPERTY("Technology", DBUS_TYPE_UINT32, technology),
+  PROPERTY("WarningLevel", DBUS_TYPE_UINT32, warning_level),
+  PROPERTY("BatteryLevel", DBUS_TYPE_UINT32, battery_level),
+  PROPERTY("IconName", DBUS_TYPE_STRING, icon_name),
+};
+
+#define N_PROPERTIES (sizeof(properties)/sizeof(properties[0]))
+
+/* sent along with every change */
+#define UPDATE_TIME_PROPERTY (&properties[3])
+
+/* [level][charging], level from empty to full */
+static const char *icon_names[][2] = {
+  { "battery-empty-symbolic", "battery-empty-charging-symbolic" },
+  { "battery-caution-symbolic", "battery-caution-charging-symbolic" },
+  { "battery-low-symbolic", "battery-low-charging-symbolic" },
+  { "battery-good-symbolic", "battery-good-charging-symbolic" },
+  { "battery-full-symbolic", "battery-full-charging-symbolic" },
+};
+
+static DBusConnection *upower_connection = NULL;
+static upower_device published;
+
+static const void * property_value(const upower_device *device, const upower_property *property)
+{
+  return (const char *)device + property->offset;
+}
+
+static int property_equal(const upower_device *a, const upower_device *b, const upower_property *property)
+{
+  const void *x = property_value(a, property);
+  const void *y = property_value(b, property);
+
+  switch (property->type)
+  {
+    case DBUS_TYPE_STRING:
+      return !strcmp(*(const char * const *)x, *(const char * const *)y);
+    case DBUS_TYPE_DOUBLE:
+      return *(const double *)x == *(const double *)y;
+    case DBUS_TYPE_INT64:
+    case DBUS_TYPE_UINT64:
+      return !memcmp(x, y, sizeof(dbus_uint64_t));
+    default:
+      return !memcmp(x, y, sizeof(dbus_uint32_t));
+  }
+}
+
+static void append_property(DBusMessageIter *dict, const upower_device *device, const upower_property *property)
+{
+  DBusMessageIter entry, variant;
+  char signature[2] = { property->type, 0 };
+
+  dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+  dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &property->name);
+  dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, signature, &variant);
+  dbus_message_iter_append_basic(&variant, property->type, property_value(device, property));
+  dbus_message_iter_close_container(&entry, &variant);
+  dbus_message_iter_close_container(dict, &entry);
+}
+
+static double mah_to_wh(uint32_t charge)
+{
+  return (double)charge * UPOWER_NOMINAL_VOLTAGE / 1000000;
+}
+
+static void upower_device_update(upower_device *device, const bme_policy_result *result,
+                                 bme_capacity_state announced)
+{
+  const battery *battery_info = &result->battery;
+  int32_t current = abs(battery_info->power_supply_current_now);
+  int level;
+
+  if (result->capacity_state == BME_CAPACITY_FULL && result->charger_connected)
+    device->state = UPOWER_STATE_FULLY_CHARGED;
+  else if (result->is_charging)
+    device->state = UPOWER_STATE_CHARGING;
+  else if (result->charger_connected)
+    device->state = UPOWER_STATE_PENDING_CHARGE;
+  else
+    device->state = UPOWER_STATE_DISCHARGING;
+
+  device->percentage = result->capacity;
+  device->voltage = battery_info->power_supply_voltage_now / 1000.0;
+  /* in steps of 10 mW, so the rate does not flap with every sample */
+  device->energy_rate = ((int64_t)current * battery_info->power_supply_voltage_now + 5000) / 10000 / 100.0;
+
+  device->energy_full_design = mah_to_wh(battery_info->power_supply_charge_design);
+  if (result->calibrated)
+  {
+    device->energy_full = mah_to_wh(battery_info->power_supply_charge_full);
+    device->energy = mah_to_wh(battery_info->power_supply_charge_now);
+  }
+  else
+  {
+    device->energy_full = device->energy_full_design;
+    device->energy = device->energy_full * result->capacity / 100;
+  }
+
+  device->capacity = 100;
+  if (result->calibrated && battery_info->power_supply_charge_design > 0 &&
+      battery_info->power_supply_charge_full < battery_info->power_supply_charge_design)
+    device->capacity = 100.0 * battery_info->power_supply_charge_full / battery_info->power_supply_charge_design;
+
+  /* same as battery.remaining_time */
+  device->time_to_empty = 0;
+  device->time_to_full = 0;
+  if (result->calibrated && battery_info->power_supply_status == STATUS_DISCHARGING)
+    device->time_to_empty = battery_info->power_supply_time_to_empty_avg;
+  else if (result->calibrated && battery_info->power_supply_status == STATUS_CHARGING)
+    device->time_to_full = battery_info->power_supply_time_to_full_now;
+
+  device->warning_level = UPOWER_WARNING_NONE;
+  if (device->state == UPOWER_STATE_DISCHARGING)
+  {
+    if (announced == BME_CAPACITY_EMPTY)
+      device->warning_level = UPOWER_WARNING_ACTION;
+    else if (result->very_low)
+      device->warning_level = UPOWER_WARNING_CRITICAL;
+    else if (announced == BME_CAPACITY_LOW)
+      device->warning_level = UPOWER_WARNING_LOW;
+  }
+
+  if (device->state == UPOWER_STATE_FULLY_CHARGED)
+    device->icon_name = "battery-full-charged-symbolic";
+  else
+  {
+    if (announced == BME_CAPACITY_EMPTY)
+      level = 0;
+    else if (result->capacity < 10)
+      level = 1;
+    else if (result->capacity < 30)
+      level = 2;
+    else if (result->capacity < 60)
+      level = 3;
+    else
+      level = 4;
+    device->icon_name = icon_names[level][device->state == UPOWER_STATE_CHARGING];
+  }
+}
+
+int bme_upower_init(DBusConnection *connection)
+{
+  memset(&published, 0, sizeof(published));
+  published.native_path = "bq27200-0";
+  published.vendor = "";
+  published.model = "";
+  published.update_time = time(NULL);
+  published.type = UPOWER_TYPE_BATTERY;
+  published.power_supply = TRUE;
+  published.has_history = FALSE;
+  published.has_statistics = FALSE;
+  published.is_present = TRUE;
+  published.state = UPOWER_STATE_DISCHARGING;
+  published.is_rechargeable = TRUE;
+  published.capacity = 100;
+  published.technology = UPOWER_TECHNOLOGY_LITHIUM_ION;
+  published.warning_level = UPOWER_WARNING_NONE;
+  published.battery_level = UPOWER_BATTERY_LEVEL_NONE;
+  published.icon_name = icon_names[4][0];
+
+  upower_connection = connection;
+  return 0;
+}
+
+void bme_upower_update(const bme_policy_result *result, bme_capacity_state announced)
+{
+  upower_device device;
+  const upower_property *changed[N_PROPERTIES];
+  unsigned int i, n = 0;
+  const char *interface = BME_UPOWER_DEVICE_IF;
+  DBusMessage *msg;
+  DBusMessageIter iter, dict, invalidated;
+
+  if (!upower_connection)
+    return;
+
+  device = published;
+  upower_device_update(&device, result, announced);
+
+  for (i = 0; i < N_PROPERTIES; i++)
+    if (!property_equal(&device, &published, &properties[i]))
+      changed[n++] = &properties[i];
+
+  if (!n)
+    return;
+
+  device.update_time = time(NULL);
+  published = device;
+
+  msg = dbus_message_new_signal(BME_UPOWER_DEVICE_PATH, DBUS_INTERFACE_PROPERTIES, "PropertiesChanged");
+  if (!msg)
+    return;
+
+  dbus_message_iter_init_append(msg, &iter);
+  dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+  for (i = 0; i < n; i++)
+    append_property(&dict, &published, changed[i]);
+  append_property(&dict, &published, UPDATE_TIME_PROPERTY);
+  dbus_message_iter_close_container(&iter, &dict);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &invalidated);
+  dbus_message_iter_close_container(&iter, &invalidated);
+
+  dbus_connection_send(upower_connection, msg, NULL);
+  dbus_message_unref(msg);
+}
+
+static DBusHandlerResult upower_reply(DBusConnection *connection, DBusMessage *reply)
+{
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  dbus_connection_send(connection, reply, 0);
+  dbus_message_unref(reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+DBusHandlerResult bme_upower_get(DBusConnection *connection, DBusMessage *message)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter, variant;
+  const char *interface, *name;
+  char signature[2] = { 0, 0 };
+  unsigned int i;
+
+  if (!upower_connection)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (!dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID))
+    return upower_reply(connection, dbus_message_new_error(message, BME_ERROR_INVALID_ARGS, "expected (ss)"));
+
+  for (i = 0; i < N_PROPERTIES; i++)
+    if (!strcmp(properties[i].name, name))
+      break;
+
+  if (i == N_PROPERTIES || (*interface && strcmp(interface, BME_UPOWER_DEVICE_IF)))
+    return upower_reply(connection, dbus_message_new_error(message, BME_ERROR_INVALID_ARGS, "no such property"));
+
+  if (dbus_message_get_no_reply(message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  reply = dbus_message_new_method_return(message);
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  signature[0] = properties[i].type;
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, signature, &variant);
+  dbus_message_iter_append_basic(&variant, properties[i].type, property_value(&published, &properties[i]));
+  dbus_message_iter_close_container(&iter, &variant);
+
+  return upower_reply(connection, reply);
+}
+
+DBusHandlerResult bme_upower_get_all(DBusConnection *connection, DBusMessage *message)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter, dict;
+  const char *interface;
+  unsigned int i;
+
+  if (!upower_connection)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (!dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID))
+    return upower_reply(connection, dbus_message_new_error(message, BME_ERROR_INVALID_ARGS, "expected (s)"));
+
+  if (dbus_message_get_no_reply(message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  reply = dbus_message_new_method_return(message);
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+  if (!*interface || !strcmp(interface, BME_UPOWER_DEVICE_IF))
+    for (i = 0; i < N_PROPERTIES; i++)
+      append_property(&dict, &published, &properties[i]);
+  dbus_message_iter_close_container(&iter, &dict);
+
+  return upower_reply(connection, reply);
+}
+
+DBusHandlerResult bme_upower_introspect(DBusConnection *connection, DBusMessage *message)
+{
+  static char xml[4096];
+  DBusMessage *reply;
+  const char *data = xml;
+  size_t len;
+  unsigned int i;
+
+  if (!upower_connection)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_get_no_reply(message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  if (!*xml)
+  {
+    len = snprintf(xml, sizeof(xml),
+                   "<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS Object Introspection 1.0//EN\"\n"
+                   " \"http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd\">\n"
+                   "<node>\n"
+                   "  <interface name=\"" DBUS_INTERFACE_INTROSPECTABLE "\">\n"
+                   "    <method name=\"Introspect\"><arg name=\"data\" type=\"s\" direction=\"out\"/></method>\n"
+                   "  </interface>\n"
+                   "  <interface name=\"" DBUS_INTERFACE_PROPERTIES "\">\n"
+                   "    <method name=\"Get\"><arg type=\"s\" direction=\"in\"/><arg type=\"s\" direction=\"in\"/>"
+                   "<arg type=\"v\" direction=\"out\"/></method>\n"
+                   "    <method name=\"GetAll\"><arg type=\"s\" direction=\"in\"/>"
+                   "<arg type=\"a{sv}\" direction=\"out\"/></method>\n"
+                   "    <signal name=\"PropertiesChanged\"><arg type=\"s\"/><arg type=\"a{sv}\"/><arg type=\"as\"/></signal>\n"
+                   "  </interface>\n"
+                   "  <interface name=\"" BME_UPOWER_DEVICE_IF "\">\n");
+    for (i = 0; i < N_PROPERTIES && len < sizeof(xml); i++)
+      len += snprintf(xml + len, sizeof(xml) - len, "    <property name=\"%s\" type=\"%c\" access=\"read\"/>\n",
+                      properties[i].name, properties[i].type);
+    if (len < sizeof(xml))
+      snprintf(xml + len, sizeof(xml) - len, "  </interface>\n</node>\n");
+  }
+
+  reply = dbus_message_new_method_return(message);
+  if (reply && !dbus_message_append_args(reply, DBUS_TYPE_STRING, &data, DBUS_TYPE_INVALID))
+  {
+    dbus_message_unref(reply);
+    reply = NULL;
+  }
+
+  return upower_reply(connection, reply);
+}
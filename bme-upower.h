@@ -0,0 +1,46 @@
+/*
+ * bme-upower.h: org.freedesktop.UPower.Device export of hald-addon-bme
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _BME_UPOWER_H_
+#define _BME_UPOWER_H_
+
+#include <dbus/dbus.h>
+
+#include "bme-policy.h"
+
+/*
+ * The battery is exported at BME_UPOWER_DEVICE_PATH on the com.nokia.bme
+ * name, so UPower clients can read it without hald and a HAL to UPower
+ * bridge in between. The properties are derived from the same policy
+ * result that feeds the HAL properties. bme_upower_update() compares them
+ * with what was published last and sends all changes of one update in a
+ * single PropertiesChanged signal.
+ */
+
+/* start exporting on connection, nothing is exported before */
+int bme_upower_init(DBusConnection *connection);
+
+/* announced is the capacity state last announced over HAL */
+void bme_upower_update(const bme_policy_result *result, bme_capacity_state announced);
+
+/* org.freedesktop.DBus.Properties and Introspectable on the device path */
+DBusHandlerResult bme_upower_get(DBusConnection *connection, DBusMessage *message);
+DBusHandlerResult bme_upower_get_all(DBusConnection *connection, DBusMessage *message);
+DBusHandlerResult bme_upower_introspect(DBusConnection *connection, DBusMessage *message);
+
+#endif /* _BME_UPOWER_H_ */
@@ -30,7 +30,89 @@
 #define BME_CHARGER_CHARGING_OFF	"charger_charging_off"
 #define BME_CHARGER_CHARGING_FAILED	"charger_charging_failed"
 
+/* signal, a{sv} with the BME_PROPERTY_* keys that changed in one update.
+ * Sent at most once per update, next to the signals above. capacity_state
+ * is also included when it was announced again without changing. */
+#define BME_STATE_CHANGED		"state_changed"
+/* signal sent to a single subscriber only, a{sv} with those of its
+ * BME_PROPERTY_* fields that moved by at least their threshold */
+#define BME_SUBSCRIPTION_UPDATE		"subscription_update"
+
 #define BME_STATUS_INFO_REQ		"status_info_req"
 #define BME_TIMELEFT_INFO_REQ		"timeleft_info_req"
+/* method, replies a{sv} with the BME_PROPERTY_* keys below */
+#define BME_STATUS_SNAPSHOT_REQ		"status_snapshot_req"
+/* method, replies a(bbbddd): display on, charger connected, boost,
+ * seconds, discharged mWh, charged mWh */
+#define BME_ENERGY_INFO_REQ		"energy_info_req"
+/* method taking (from, to, step) in seconds since epoch, replies
+ * a(uuuuii): time, charge_full, charge_now, voltage, temp, flags */
+#define BME_HISTORY_QUERY_REQ		"history_query_req"
+/* method, replies a{sv} with the BME_STAT_* counters below */
+#define BME_STATS_INFO_REQ		"stats_info_req"
+/* method, replies a(suuu) for the senders of BME_STATUS_INFO_REQ and
+ * BME_TIMELEFT_INFO_REQ with the highest rate: unique name, requests,
+ * requests in the last minute, requests over the limit */
+#define BME_REQUEST_STATS_REQ		"request_stats_req"
+/* method, replies a{sv} with the BME_DIAGNOSTIC_* keys below. These are
+ * read from the gauge on request only, entries it does not provide are
+ * left out */
+#define BME_DIAGNOSTICS_INFO_REQ	"diagnostics_info_req"
+/* method taking (rate, duration) in Hz and seconds, replies (h): the read
+ * end of a pipe. The gauge is sampled at rate until duration is over, the
+ * pipe is closed or the caller leaves the bus. Each sample is 16 bytes in
+ * host byte order: uint32 sequence, uint32 ms since start, int32
+ * current_now in uA, int32 voltage_now in uV. Values that could not be
+ * read are INT32_MIN, samples the caller did not read in time are dropped
+ * and show as gaps in sequence. One session at a time. */
+#define BME_PROFILE_START_REQ		"profile_start_req"
+/* method taking a{su}: BME_PROPERTY_* keys and the change needed before
+ * an update is sent (0 or 1: any change, booleans and strings always on
+ * change). Replies a{sv} with their current values, the starting point.
+ * Calling it again replaces the subscription, it ends with
+ * BME_UNSUBSCRIBE_REQ or when the caller leaves the bus */
+#define BME_SUBSCRIBE_REQ		"subscribe_req"
+#define BME_UNSUBSCRIBE_REQ		"unsubscribe_req"
+
+#define BME_PROPERTY_CHARGER_CONNECTED	"charger_connected"	/* b */
+#define BME_PROPERTY_CHARGING		"charging"		/* b */
+#define BME_PROPERTY_BARS		"bars"			/* u */
+#define BME_PROPERTY_BARS_MAX		"bars_max"		/* u */
+#define BME_PROPERTY_PERCENTAGE		"percentage"		/* u */
+#define BME_PROPERTY_CAPACITY_STATE	"capacity_state"	/* s: ok, low, empty, full */
+#define BME_PROPERTY_TIMELEFT_IDLE	"timeleft_idle"		/* u, minutes */
+#define BME_PROPERTY_TIMELEFT_ACTIVE	"timeleft_active"	/* u, minutes */
+
+#define BME_DIAGNOSTIC_TEMP		"temp"			/* i, 0.1 degrees Celsius */
+#define BME_DIAGNOSTIC_CYCLE_COUNT	"cycle_count"		/* u */
+#define BME_DIAGNOSTIC_ENERGY_NOW	"energy_now"		/* u, mWh */
+#define BME_DIAGNOSTIC_TECHNOLOGY	"technology"		/* s */
+#define BME_DIAGNOSTIC_REGISTERS	"registers"		/* s, register=value pairs */
+
+/* org.freedesktop.UPower.Device export on BME_SERVICE, see
+ * HAL_PROP_BME_UPOWER */
+#define BME_UPOWER_DEVICE_PATH		"/org/freedesktop/UPower/devices/battery_bme"
+#define BME_UPOWER_DEVICE_IF		"org.freedesktop.UPower.Device"
+
+#define BME_STAT_SIGNALS_SENT		"signals_sent"		/* u */
+#define BME_STAT_SIGNAL_MESSAGES_BUILT	"signal_messages_built"	/* u, allocations for signals */
+#define BME_STAT_SIGNALS_DEFERRED	"signals_deferred"	/* u, battery_state_changed held back, display off */
+#define BME_STAT_GAUGE_PROPERTIES_READ	"gauge_properties_read"	/* u, power_supply properties read from sysfs */
+#define BME_STAT_REQUEST_SENDERS	"request_senders"	/* u, senders tracked for BME_REQUEST_STATS_REQ */
+#define BME_STAT_REQUESTS_LIMITED	"requests_limited"	/* u, answered without broadcasts */
+#define BME_STAT_SUBSCRIBERS		"subscribers"		/* u */
+#define BME_STAT_SUBSCRIPTION_UPDATES	"subscription_updates"	/* u, unicast updates sent */
+#define BME_STAT_POLLS_SKIPPED		"polls_skipped"		/* u, polls with byte for byte the same input */
+#define BME_STAT_LOOP_LAG_MS		"loop_lag_ms"		/* u, how late the last regular poll ran */
+#define BME_STAT_LOOP_LAG_MAX_MS	"loop_lag_max_ms"	/* u */
+#define BME_STAT_POLL_MAX_MS		"poll_max_ms"		/* u, longest regular poll */
+#define BME_STAT_HAL_CALLS		"hal_calls"		/* u, property writes sent to hald */
+#define BME_STAT_HAL_CALLS_FAILED	"hal_calls_failed"	/* u, no answer within the deadline */
+#define BME_STAT_HAL_CALL_MAX_MS	"hal_call_max_ms"	/* u */
+#define BME_STAT_HAL_WRITES_SHED	"hal_writes_shed"	/* u, held back while hald was unhealthy */
+#define BME_STAT_HAL_WRITES_FLUSHED	"hal_writes_flushed"	/* u, held back writes sent later */
+#define BME_STAT_HAL_WRITES_UNCHANGED	"hal_writes_unchanged"	/* u, not sent, hald had the value */
+#define BME_STAT_HAL_WRITES_DEFERRED	"hal_writes_deferred"	/* u, held back while the display was off */
+#define BME_STAT_HAL_BREAKER_OPEN	"hal_breaker_open"	/* b, hald considered unhealthy */
 
 #endif /* _BME_DBUS_NAMES_H_ */
@@ -23,67 +23,50 @@
 #include <errno.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
-#include <glib/gmain.h>
-
-#include <gio/gio.h>
-
-#include <dbus/dbus-glib-lowlevel.h>
+#include <time.h>
 
 #include <hal/libhal.h>
 
 #include <dsme/protocol.h>
 #include <dsme/state.h>
 
+#include "dbus-names.h"
+#include "bme-archive.h"
+#include "bme-policy.h"
+#include "bme-loop.h"
+#include "bme-upower.h"
+#include "bme-hal.h"
+#include "bme-profile.h"
+#include "bme-charger.h"
+
 typedef uint8_t uint8;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
 typedef int32_t int32;
+typedef int64_t int64;
 
-typedef struct {
-  enum{STATUS_FULL=1,STATUS_CHARGING,STATUS_DISCHARGING}power_supply_status;
-  int32 capacity;
-  uint32 power_supply_present;
-  uint32 power_supply_voltage_design;
-  uint32 power_supply_voltage_now;
-  int32  power_supply_capacity;
-  uint32 power_supply_time_to_empty_avg;
-  uint32 power_supply_time_to_empty_idle;
-  uint32 power_supply_time_to_full_now;
-  uint32 power_supply_charge_design;
-  uint32 power_supply_charge_full;
-  uint32 power_supply_charge_now;
-  int32  power_supply_current_now;
-  int32  power_supply_flags_register;
-  char   power_supply_capacity_level[32];
-  char   power_supply_mode[32];
-} battery;
+#define UNUSED __attribute__((unused))
+#define N_ELEMENTS(a) (sizeof(a)/sizeof((a)[0]))
 
 battery global_battery;
 
-#define POWER_SUPPLY_CAPACITY_THRESHOLD_FULL 94
-
-#define POWER_SUPPLY_CHARGE_THRESHOLD_LOW 170
-#define POWER_SUPPLY_CHARGE_THRESHOLD_VERYLOW 100
-#define POWER_SUPPLY_CHARGE_THRESHOLD_EMPTY 70
-
-#define POWER_SUPPLY_VOLTAGE_THRESHOLD_FULL 4050
-#define POWER_SUPPLY_VOLTAGE_THRESHOLD_LOW 3640
-#define POWER_SUPPLY_VOLTAGE_THRESHOLD_VERYLOW 3530
-#define POWER_SUPPLY_VOLTAGE_THRESHOLD_EMPTY 3248
-
 typedef struct {
   struct {
-    enum {EMPTY=1,LOW,OK,FULL}capacity_state;
+    bme_capacity_state capacity_state;
     uint32 current;
     uint32 percentage;
   }charge_level;
@@ -91,14 +74,42 @@ typedef struct {
 
 bme global_bme;
 
+bme_policy_params policy_params;
+bme_policy_state policy_state;
+
+unsigned int empty_shutdown_timer = 0;
+unsigned int emergency_timer = 0;
+int emergency_mode = 0;
+
 int global_charger_connected = 0;
 int global_is_charging = 0;
-int global_is_full = 0;
-time_t force_charging = 0;
 
 dsmesock_connection_t * dsme_conn;
 
-gboolean global_boost = FALSE;
+int global_boost = FALSE;
+
+int global_display_on = 1;
+
+/* energy drawn from (discharged) and put into (charged) the battery,
+ * indexed by [display on][charger connected][boost] */
+typedef struct {
+  double seconds;
+  double discharged_mwh;
+  double charged_mwh;
+} energy_counter;
+
+energy_counter energy_counters[2][2][2];
+
+/* last power sample, integration runs from here to the next one. The
+ * interval is booked under the charger and boost state of this sample,
+ * not under whatever changed since. */
+struct {
+  int64 time_ms;
+  int32 power_mw;
+  int charger_connected;
+  int boost;
+  int valid;
+} energy_sample;
 
 /*#define DEBUG*/
 
@@ -110,6 +121,45 @@ gboolean global_boost = FALSE;
 #define BQ24150A_STAT_PIN_FILE_PATH "/sys/class/power_supply/bq24150a-0/stat_pin_enable"
 #define RX51_UEVENT_FILE_PATH "/sys/class/power_supply/rx51-battery/uevent"
 
+/* sysfs files, moved below HAL_PROP_BME_SYSFS_ROOT when that is set */
+const char *sysfs_root = NULL;
+const char *bq27200_uevent_path = BQ27200_UEVENT_FILE_PATH;
+const char *bq27200_registers_path = BQ27200_REGISTERS_FILE_PATH;
+const char *bq24150a_mode_path = BQ24150A_MODE_FILE_PATH;
+const char *bq24150a_stat_pin_path = BQ24150A_STAT_PIN_FILE_PATH;
+const char *rx51_uevent_path = RX51_UEVENT_FILE_PATH;
+
+/* read single power_supply attributes instead of the uevent files */
+int sysfs_attributes = 0;
+
+struct {
+  uint32 properties_read;
+  uint32 polls_skipped;
+} sysfs_stats;
+
+/* input of the last poll that went all the way through */
+struct {
+  int valid;
+  uint64_t hash;
+  time_t time;
+  int settled;                  /* policy would not change with time alone */
+} poll_snapshot;
+
+#define BME_ARCHIVE_FILE_PATH "/var/lib/hald-addon-bme/history"
+#define BME_ARCHIVE_MAX_BLOCKS 512
+#define BME_ARCHIVE_FLUSH_PERIOD 600
+#define BME_ARCHIVE_QUERY_MAX_RECORDS 8192
+
+/* sampling period once the battery is very low or empty (ms) */
+#define EMERGENCY_POLL_PERIOD 2000
+
+#define MCE_SERVICE "com.nokia.mce"
+#define MCE_REQUEST_IF "com.nokia.mce.request"
+#define MCE_REQUEST_PATH "/com/nokia/mce/request"
+#define MCE_SIGNAL_IF "com.nokia.mce.signal"
+#define MCE_SIGNAL_PATH "/com/nokia/mce/signal"
+#define MCE_DISPLAY_SIG "display_status_ind"
+
 /*
 Standard entries:
   capacity            device              technology          type
@@ -163,11 +213,13 @@ BME hal properties:
 */
 DBusConnection *hal_dbus = 0;
 DBusConnection *system_dbus = 0;
-DBusConnection *server_dbus = 0;
 LibHalContext *hal_ctx = 0;
 const char *udi = 0;
-GMainLoop *mainloop = 0;
-guint poll_period = 30;
+unsigned int poll_period = 30;
+
+bme_archive *archive = 0;
+unsigned int archive_period = 300;
+time_t archive_last = 0;
 
 static void cleanup_system_dbus()
 {
@@ -212,10 +264,35 @@ static void print_dbus_error(const char *text,DBusError *error)
   }
 }
 
-static gboolean hald_addon_bme_setup_hal(void)
+static int64 monotonic_time_ms(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return (int64)time(NULL)*1000;
+
+  return (int64)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static time_t monotonic_time(void)
+{
+  return monotonic_time_ms()/1000;
+}
+
+static const char * sysfs_path(const char *path)
+{
+  char *result;
+
+  if (!sysfs_root || !(result = malloc(strlen(sysfs_root) + strlen(path) + 1)))
+    return path;
+  sprintf(result, "%s%s", sysfs_root, path);
+  return result;
+}
+
+static int hald_addon_bme_setup_hal(void)
 {
   DBusError error;
-  gboolean result = FALSE;
+  int result = FALSE;
 
   dbus_error_init(&error);
 
@@ -240,7 +317,7 @@ static gboolean hald_addon_bme_setup_hal(void)
     log_print ("hal UDI not set in the environment\n");
     goto out;
   }
-  udi=g_strdup(udi);  /* device id */
+  udi=strdup(udi);  /* device id */
   log_print("UDI: %s",udi);
 
   if( !libhal_device_addon_is_ready(hal_ctx,udi,&error) )
@@ -252,7 +329,7 @@ static gboolean hald_addon_bme_setup_hal(void)
     goto out;
   }
 
-  dbus_connection_setup_with_g_main(hal_dbus, FALSE);
+  bme_loop_setup_connection(hal_dbus);
   dbus_connection_set_exit_on_disconnect(hal_dbus ,FALSE);
   result = TRUE;
 
@@ -261,698 +338,1716 @@ out:
   return result;
 }
 
-static gboolean send_dbus_signal(const char *name, int first_arg_type, ...)
+/* The broadcasts of the com.nokia.bme.signal interface. libdbus cannot
+ * send a message twice: a sent message is locked and keeps its serial, so
+ * every signal is a new message. */
+typedef enum {
+  SIGNAL_BATTERY_STATE_UPDATE,
+  SIGNAL_BATTERY_TIMELEFT,
+  SIGNAL_BATTERY_FULL,
+  SIGNAL_BATTERY_LOW,
+  SIGNAL_BATTERY_EMPTY,
+  SIGNAL_CHARGER_CONNECTED,
+  SIGNAL_CHARGER_DISCONNECTED,
+  SIGNAL_CHARGER_CHARGING_ON,
+  SIGNAL_CHARGER_CHARGING_OFF,
+} bme_signal;
+
+static const struct {
+  const char *name;
+  int argc;                     /* uint32 arguments */
+} signals[] = {
+  [SIGNAL_BATTERY_STATE_UPDATE] = { BME_BATTERY_STATE_UPDATE, 2 },
+  [SIGNAL_BATTERY_TIMELEFT] = { BME_BATTERY_TIMELEFT, 2 },
+  [SIGNAL_BATTERY_FULL] = { BME_BATTERY_FULL, 0 },
+  [SIGNAL_BATTERY_LOW] = { BME_BATTERY_LOW, 0 },
+  [SIGNAL_BATTERY_EMPTY] = { BME_BATTERY_EMPTY, 0 },
+  [SIGNAL_CHARGER_CONNECTED] = { BME_CHARGER_CONNECTED, 0 },
+  [SIGNAL_CHARGER_DISCONNECTED] = { BME_CHARGER_DISCONNECTED, 0 },
+  [SIGNAL_CHARGER_CHARGING_ON] = { BME_CHARGER_CHARGING_ON, 0 },
+  [SIGNAL_CHARGER_CHARGING_OFF] = { BME_CHARGER_CHARGING_OFF, 0 },
+};
+
+struct {
+  uint32 signals_sent;
+  uint32 signal_messages_built;
+  uint32 signals_deferred;
+} signal_stats;
+
+/* With the display off nobody looks at bars, percentage, voltage or time
+ * left: their HAL writes and signals are held back and go out as one
+ * batch when the display is turned on again. Capacity state and charger
+ * changes are never held back. */
+static int display_off_defer = 1;
+static int display_off = 0;
+static int battery_state_deferred = 0;
+
+static int display_off_deferring(void)
+{
+  return display_off_defer && display_off;
+}
+
+/* how late the periodic poll runs, and how long a poll takes including
+ * the hald round trips */
+struct {
+  int64 next_poll_ms;
+  uint32 lag_ms;
+  uint32 lag_max_ms;
+  uint32 poll_max_ms;
+} loop_stats;
+
+/* log polls that run later than this (ms) */
+#define LOOP_LAG_WARNING 5000
+
+/* args are argc uint32 values, as declared in signals */
+static int send_dbus_signal(bme_signal id, const uint32 *args)
 {
   DBusMessage * msg;
-  gboolean result = FALSE;
-  va_list va;
+  int i;
 
-  va_start(va, first_arg_type);
+  msg = dbus_message_new_signal(BME_SIGNAL_PATH, BME_SIGNAL_IF, signals[id].name);
+  if (!msg)
+    return FALSE;
+  signal_stats.signal_messages_built++;
 
-  msg = dbus_message_new_signal("/com/nokia/bme/signal", "com.nokia.bme.signal", name);
-  if (msg &&
-      dbus_message_append_args_valist(msg, first_arg_type, va) &&
-      dbus_connection_send(system_dbus, msg, 0))
+  for (i = 0; i < signals[id].argc; i++)
   {
-    dbus_connection_flush(system_dbus);
-    result = TRUE;
+    if (!dbus_message_append_args(msg, DBUS_TYPE_UINT32, &args[i], DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref(msg);
+      return FALSE;
+    }
   }
 
-  if (msg)
+  if (!dbus_connection_send(system_dbus, msg, 0))
+  {
     dbus_message_unref(msg);
+    return FALSE;
+  }
 
-  return result;
+  dbus_message_unref(msg);
+  signal_stats.signals_sent++;
+  dbus_connection_flush(system_dbus);
+  return TRUE;
 }
 
-static gboolean send_dbus_signal_(const char *name)
+static int send_dbus_signal_(bme_signal id)
 {
-  log_print("send dbus signal: %s\n", name);
-  return send_dbus_signal(name, DBUS_TYPE_INVALID);
+  log_print("send dbus signal: %s\n", signals[id].name);
+  return send_dbus_signal(id, NULL);
 }
 
-static gboolean send_dsme_empty(gpointer data G_GNUC_UNUSED)
+static int send_dsme_empty(void *data UNUSED)
 {
   DSM_MSGTYPE_SET_BATTERY_STATE msg =
     DSME_MSG_INIT(DSM_MSGTYPE_SET_BATTERY_STATE);
+  empty_shutdown_timer = 0;
   msg.empty = 1;
   if (!global_is_charging)
     dsmesock_send(dsme_conn, &msg);
   return FALSE;
 }
 
-static gboolean send_capacity_state_change()
+static int send_capacity_state_change()
 {
-  const char * name ;
+  bme_signal id;
   switch(global_bme.charge_level.capacity_state)
   {
-    case LOW:name = "battery_low";break;
-    case FULL:name = "battery_full";break;
-    case EMPTY:name = "battery_empty";break;
+    case BME_CAPACITY_LOW:id = SIGNAL_BATTERY_LOW;break;
+    case BME_CAPACITY_FULL:id = SIGNAL_BATTERY_FULL;break;
+    case BME_CAPACITY_EMPTY:id = SIGNAL_BATTERY_EMPTY;break;
     default:return TRUE;
   }
-  if (global_bme.charge_level.capacity_state == FULL && !global_charger_connected)
+  if (global_bme.charge_level.capacity_state == BME_CAPACITY_FULL && !global_charger_connected)
   {
     return TRUE;
   }
-  if (global_bme.charge_level.capacity_state == EMPTY)
+  /* one deadline from the first EMPTY on, re-announcements do not move it */
+  if (global_bme.charge_level.capacity_state == BME_CAPACITY_EMPTY && !empty_shutdown_timer)
   {
-    g_timeout_add_seconds(10,send_dsme_empty,NULL);
+    log_print("shutdown in %d s\n", CAPACITY_STATE_EMPTY_SHUTDOWN_DELAY);
+    empty_shutdown_timer =
+        bme_loop_timeout_add(CAPACITY_STATE_EMPTY_SHUTDOWN_DELAY*1000,send_dsme_empty,NULL);
   }
-  return send_dbus_signal_(name);
+  return send_dbus_signal_(id);
 }
 
-static gboolean send_battery_state_changed(uint32 now)
+static int send_battery_state_changed(uint32 now)
 {
-  uint32 max = 8;
-  log_print("send dbus signal: %s (bars=%d/%d)\n", "battery_state_changed",now,max);
-  return send_dbus_signal("battery_state_changed",DBUS_TYPE_UINT32, &now, DBUS_TYPE_UINT32, &max, DBUS_TYPE_INVALID);
+  uint32 args[2] = { now, 8 };
+  log_print("send dbus signal: %s (bars=%d/%d)\n", "battery_state_changed",args[0],args[1]);
+  return send_dbus_signal(SIGNAL_BATTERY_STATE_UPDATE, args);
 }
 
-static gboolean hald_addon_bme_get_rx51_data(battery * battery_info)
+/* Whole sysfs files as read by one poll. Idle on a charger or at FULL
+ * they often read back byte for byte the same as in the previous poll,
+ * then there is nothing to parse or publish. */
+#define SYSFS_SOURCE_SIZE 2048
+
+typedef struct {
+  char data[SYSFS_SOURCE_SIZE];
+  int len;                      /* -1 when it could not be read */
+} sysfs_source;
+
+static void hald_addon_bme_read_source(const char *path, sysfs_source *source)
 {
   FILE * fp;
 
-  char line[256];
-  if((fp = fopen(RX51_UEVENT_FILE_PATH,"r")) == NULL)
+  if((fp = fopen(path,"r")) == NULL)
   {
-    log_print("unable to open %s(%s)\n",RX51_UEVENT_FILE_PATH,strerror(errno));
-    return FALSE;
+    log_print("unable to open %s(%s)\n",path,strerror(errno));
+    source->len = -1;
+    source->data[0] = 0;
+    return;
+  }
+  source->len = fread(source->data,1,sizeof(source->data)-1,fp);
+  source->data[source->len] = 0;
+  fclose(fp);
+}
+
+/* FNV-1a, chained over all sources of a poll */
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+
+  while (len--)
+  {
+    hash ^= *p++;
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+static uint64_t hash_source(uint64_t hash, const sysfs_source *source)
+{
+  hash = hash_bytes(hash, &source->len, sizeof(source->len));
+  if (source->len > 0)
+    hash = hash_bytes(hash, source->data, source->len);
+  return hash;
+}
+
+/* next KEY=VALUE line of a source, splits it in place */
+static char * next_source_line(char **pos, char **value)
+{
+  char *line = *pos, *end;
+
+  while (line && *line)
+  {
+    end = strchr(line,'\n');
+    if (end)
+      *end++ = 0;
+    *pos = end;
+    if ((*value = strchr(line,'=')))
+    {
+      *(*value)++ = 0;
+      return line;
+    }
+    line = end;
   }
-  while(fgets(line,sizeof(line),fp))
+
+  return NULL;
+}
+
+static int hald_addon_bme_get_rx51_data(battery * battery_info, sysfs_source *source)
+{
+  char *pos = source->data;
+  char *line, *tmp;
+
+  if (source->len < 0)
+    return FALSE;
+
+  while((line = next_source_line(&pos,&tmp)))
   {
-    char*tmp;
-    tmp = strchr(line,'=');
-    if(tmp)
+    sysfs_stats.properties_read++;
+    if(!strcmp(line,"POWER_SUPPLY_VOLTAGE_MAX_DESIGN"))
+      battery_info->power_supply_voltage_design = atoi(tmp)/1000;
+    else if(!strcmp(line,"POWER_SUPPLY_VOLTAGE_NOW"))
+      battery_info->power_supply_voltage_now = atoi(tmp)/1000;
+    else if(!strcmp(line,"POWER_SUPPLY_CHARGE_FULL_DESIGN"))
     {
-      *tmp=0;
-      tmp++;
-      tmp[strlen(tmp)-1] = 0;
-      if(!strcmp(line,"POWER_SUPPLY_VOLTAGE_MAX_DESIGN"))
-        battery_info->power_supply_voltage_design = atoi(tmp)/1000;
-      else if(!strcmp(line,"POWER_SUPPLY_VOLTAGE_NOW"))
-        battery_info->power_supply_voltage_now = atoi(tmp)/1000;
-      else if(!strcmp(line,"POWER_SUPPLY_CHARGE_FULL_DESIGN"))
-      {
-        battery_info->power_supply_charge_design = atoi(tmp)/1000;
-        if(battery_info->power_supply_charge_design > 0 && global_battery.power_supply_charge_design > 0 && abs(global_battery.power_supply_charge_design - battery_info->power_supply_charge_design) < 100)
-          battery_info->power_supply_charge_design = global_battery.power_supply_charge_design;
-      }
+      battery_info->power_supply_charge_design = atoi(tmp)/1000;
+      if(battery_info->power_supply_charge_design > 0 && global_battery.power_supply_charge_design > 0 && abs(global_battery.power_supply_charge_design - battery_info->power_supply_charge_design) < 100)
+        battery_info->power_supply_charge_design = global_battery.power_supply_charge_design;
     }
   }
-  fclose(fp);
 
   return TRUE;
 }
 
-static gboolean hald_addon_bme_get_bq27200_data(battery * battery_info)
+static int hald_addon_bme_get_bq27200_data(battery * battery_info, sysfs_source *source)
 {
-  FILE * fp;
+  char *pos = source->data;
+  char *line, *tmp;
 
-  char line[256];
-  if((fp = fopen(BQ27200_UEVENT_FILE_PATH,"r")) == NULL)
-  {
-    log_print("unable to open %s(%s)\n",BQ27200_UEVENT_FILE_PATH,strerror(errno));
+  if (source->len < 0)
     return FALSE;
+
+  while((line = next_source_line(&pos,&tmp)))
+  {
+    sysfs_stats.properties_read++;
+    if(!strcmp(line,"POWER_SUPPLY_CAPACITY"))
+      battery_info->power_supply_capacity = atoi(tmp);
+    else if(!strcmp(line,"POWER_SUPPLY_STATUS"))
+    {
+      if (!strcmp(tmp,"Full")) battery_info->power_supply_status = STATUS_FULL;
+      else if (!strcmp(tmp,"Charging")) battery_info->power_supply_status = STATUS_CHARGING;
+      else battery_info->power_supply_status = STATUS_DISCHARGING;
+    }
+    else if(!strcmp(line,"POWER_SUPPLY_CURRENT_NOW"))
+      battery_info->power_supply_current_now = atoi(tmp)/1000;
+    else if(!strcmp(line,"POWER_SUPPLY_VOLTAGE_NOW"))
+      battery_info->power_supply_voltage_now = atoi(tmp)/1000;
+    else if(!strcmp(line,"POWER_SUPPLY_TIME_TO_FULL_NOW"))
+      battery_info->power_supply_time_to_full_now = atoi(tmp);
+    else if(!strcmp(line,"POWER_SUPPLY_TIME_TO_EMPTY_AVG"))
+      battery_info->power_supply_time_to_empty_avg = atoi(tmp);
+    else if(!strcmp(line,"POWER_SUPPLY_CHARGE_FULL"))
+      battery_info->power_supply_charge_full = atoi(tmp)/1000;
+    else if(!strcmp(line,"POWER_SUPPLY_TEMP"))
+      battery_info->power_supply_temp = atoi(tmp);
+    else if(!strcmp(line,"POWER_SUPPLY_CHARGE_NOW"))
+      battery_info->power_supply_charge_now = atoi(tmp)/1000;
+    else if(!strcmp(line,"POWER_SUPPLY_CAPACITY_LEVEL"))
+      strncpy(battery_info->power_supply_capacity_level,
+              tmp,
+              sizeof(battery_info->power_supply_capacity_level)-1);
   }
-  while(fgets(line,sizeof(line),fp))
+
+  return TRUE;
+}
+
+/* Reading the uevent file makes the driver query every property of the
+ * gauge, a single attribute file only that one. refresh is how long a
+ * value is used before it is read again (0: every poll), ttl how long it
+ * is still used while reading it fails. */
+#define ATTRIBUTE_FOREVER ((time_t)0x7fffffff)
+
+typedef enum {ATTRIBUTE_INT, ATTRIBUTE_STATUS, ATTRIBUTE_STRING} attribute_type;
+
+typedef struct {
+  const char *path;
+  attribute_type type;
+  size_t offset;
+  size_t size;
+  int scale;
+  time_t refresh;
+  time_t ttl;
+  time_t read;
+  int valid;
+} power_supply_attribute;
+
+#define BQ27200_ATTRIBUTE(name) "/sys/class/power_supply/bq27200-0/" name
+#define RX51_ATTRIBUTE(name) "/sys/class/power_supply/rx51-battery/" name
+
+#define ATTRIBUTE(path, type, field, scale, refresh, ttl) \
+  { path, type, offsetof(battery, field), sizeof(((battery *)0)->field), scale, refresh, ttl, 0, 0 }
+
+static power_supply_attribute power_supply_attributes[] = {
+  ATTRIBUTE(BQ27200_ATTRIBUTE("status"), ATTRIBUTE_STATUS, power_supply_status, 1, 0, 0),
+  ATTRIBUTE(BQ27200_ATTRIBUTE("capacity_level"), ATTRIBUTE_STRING, power_supply_capacity_level, 1, 0, 0),
+  ATTRIBUTE(BQ27200_ATTRIBUTE("capacity"), ATTRIBUTE_INT, power_supply_capacity, 1, 0, 0),
+  ATTRIBUTE(BQ27200_ATTRIBUTE("current_now"), ATTRIBUTE_INT, power_supply_current_now, 1000, 0, 0),
+  ATTRIBUTE(BQ27200_ATTRIBUTE("voltage_now"), ATTRIBUTE_INT, power_supply_voltage_now, 1000, 0, 0),
+  ATTRIBUTE(BQ27200_ATTRIBUTE("charge_now"), ATTRIBUTE_INT, power_supply_charge_now, 1000, 0, 0),
+  ATTRIBUTE(BQ27200_ATTRIBUTE("temp"), ATTRIBUTE_INT, power_supply_temp, 1, 60, 300),
+  ATTRIBUTE(BQ27200_ATTRIBUTE("time_to_empty_avg"), ATTRIBUTE_INT, power_supply_time_to_empty_avg, 1, 60, 120),
+  ATTRIBUTE(BQ27200_ATTRIBUTE("time_to_full_now"), ATTRIBUTE_INT, power_supply_time_to_full_now, 1, 60, 120),
+  ATTRIBUTE(BQ27200_ATTRIBUTE("charge_full"), ATTRIBUTE_INT, power_supply_charge_full, 1000, 600, 3600),
+  /* after the gauge, like the uevent files the rx51 voltage wins */
+  ATTRIBUTE(RX51_ATTRIBUTE("voltage_now"), ATTRIBUTE_INT, power_supply_voltage_now, 1000, 0, 0),
+  ATTRIBUTE(RX51_ATTRIBUTE("voltage_max_design"), ATTRIBUTE_INT, power_supply_voltage_design, 1000,
+            ATTRIBUTE_FOREVER, ATTRIBUTE_FOREVER),
+  ATTRIBUTE(RX51_ATTRIBUTE("charge_full_design"), ATTRIBUTE_INT, power_supply_charge_design, 1000,
+            ATTRIBUTE_FOREVER, ATTRIBUTE_FOREVER),
+};
+
+/* last values read, fields of attributes only */
+static battery attribute_cache;
+
+static void hald_addon_bme_read_attribute(power_supply_attribute *attribute, time_t now)
+{
+  char *field = (char *)&attribute_cache + attribute->offset;
+  char line[64];
+  int32 value;
+  FILE * fp;
+
+  if (attribute->valid && now - attribute->read < attribute->refresh)
+    return;
+
+  if ((fp = fopen(attribute->path,"r")) == NULL || !fgets(line,sizeof(line),fp))
   {
-    char*tmp;
-    tmp = strchr(line,'=');
-    if(tmp)
+    if (fp)
+      fclose(fp);
+    if (attribute->valid && now - attribute->read > attribute->ttl)
     {
-      *tmp=0;
-      tmp++;
-      tmp[strlen(tmp)-1] = 0;
-      if(!strcmp(line,"POWER_SUPPLY_CAPACITY"))
-        battery_info->power_supply_capacity = atoi(tmp);
-      else if(!strcmp(line,"POWER_SUPPLY_STATUS"))
-      {
-        if (!strcmp(tmp,"Full")) battery_info->power_supply_status = STATUS_FULL;
-        else if (!strcmp(tmp,"Charging")) battery_info->power_supply_status = STATUS_CHARGING;
-        else battery_info->power_supply_status = STATUS_DISCHARGING;
-      }
-      else if(!strcmp(line,"POWER_SUPPLY_CURRENT_NOW"))
-        battery_info->power_supply_current_now = atoi(tmp)/1000;
-      else if(!strcmp(line,"POWER_SUPPLY_VOLTAGE_NOW"))
-        battery_info->power_supply_voltage_now = atoi(tmp)/1000;
-      else if(!strcmp(line,"POWER_SUPPLY_TIME_TO_FULL_NOW"))
-        battery_info->power_supply_time_to_full_now = atoi(tmp);
-      else if(!strcmp(line,"POWER_SUPPLY_TIME_TO_EMPTY_AVG"))
-        battery_info->power_supply_time_to_empty_avg = atoi(tmp);
-      else if(!strcmp(line,"POWER_SUPPLY_CHARGE_FULL"))
-        battery_info->power_supply_charge_full = atoi(tmp)/1000;
-      else if(!strcmp(line,"POWER_SUPPLY_CHARGE_NOW"))
-        battery_info->power_supply_charge_now = atoi(tmp)/1000;
-      else if(!strcmp(line,"POWER_SUPPLY_CAPACITY_LEVEL"))
-        strncpy(battery_info->power_supply_capacity_level,
-                tmp,
-                sizeof(battery_info->power_supply_capacity_level)-1);
+      log_print("%s is stale\n",attribute->path);
+      attribute->valid = 0;
     }
+    return;
   }
   fclose(fp);
+  sysfs_stats.properties_read++;
+  line[strcspn(line,"\n")] = 0;
+
+  switch (attribute->type)
+  {
+    case ATTRIBUTE_INT:
+      value = atoi(line)/attribute->scale;
+      memcpy(field, &value, sizeof(value));
+      break;
+    case ATTRIBUTE_STATUS:
+      if (!strcmp(line,"Full")) value = STATUS_FULL;
+      else if (!strcmp(line,"Charging")) value = STATUS_CHARGING;
+      else value = STATUS_DISCHARGING;
+      memcpy(field, &value, sizeof(value));
+      break;
+    case ATTRIBUTE_STRING:
+      memset(field, 0, attribute->size);
+      strncpy(field, line, attribute->size-1);
+      break;
+  }
+
+  attribute->read = now;
+  attribute->valid = 1;
+}
+
+static int hald_addon_bme_get_attributes(battery * battery_info)
+{
+  time_t now = monotonic_time();
+  int result = FALSE;
+  unsigned int i;
+
+  for (i = 0; i < N_ELEMENTS(power_supply_attributes); i++)
+  {
+    power_supply_attribute *attribute = &power_supply_attributes[i];
+
+    hald_addon_bme_read_attribute(attribute, now);
+    if (!attribute->valid)
+      continue;
+
+    memcpy((char *)battery_info + attribute->offset, (char *)&attribute_cache + attribute->offset, attribute->size);
+    result = TRUE;
+  }
+
+  return result;
+}
+
+static int hald_addon_bme_get_bq27200_registers(battery * battery_info, sysfs_source *source)
+{
+  char *pos = source->data;
+  char *line, *tmp;
+  int num;
+
+  if (source->len < 0)
+    return FALSE;
+
+  while((line = next_source_line(&pos,&tmp)))
+  {
+    if(!strcmp(line,"0x0a"))
+      battery_info->power_supply_flags_register = strtol(tmp, NULL, 16);
+    else if(!strcmp(line,"0x1c")) {
+      num = strtol(tmp, NULL, 16);
+      if(num != 65535)
+        battery_info->power_supply_time_to_empty_idle = num * 60;
+    }
+  }
 
   return TRUE;
 }
 
-static gboolean hald_addon_bme_get_bq27200_registers(battery * battery_info)
+/* what the bq24150a mode says, for when there is no USB charger detection */
+static bme_charger bq24150a_charger = CHARGER_NONE;
+
+static bme_charger hald_addon_bme_charger(void)
+{
+  bme_charger charger;
+
+  if (bme_charger_get(&charger))
+    return charger;
+  return bq24150a_charger;
+}
+
+/* only used with a fake sysfs tree, which can not raise POLLPRI */
+static int hald_addon_bme_get_bq24150a_mode(battery * battery_info)
 {
   FILE * fp;
 
-  char line[256];
-  if((fp = fopen(BQ27200_REGISTERS_FILE_PATH,"r")) == NULL)
+  char line[32];
+  if((fp = fopen(bq24150a_mode_path,"r")) == NULL)
   {
-    log_print("unable to open %s(%s)\n",BQ27200_REGISTERS_FILE_PATH,strerror(errno));
+    log_print("unable to open %s(%s)\n",bq24150a_mode_path,strerror(errno));
     return FALSE;
   }
-  while(fgets(line,sizeof(line),fp))
+  if(fgets(line,sizeof(line),fp))
+    bq24150a_charger = bme_charger_parse_mode(line, &battery_info->boost);
+  fclose(fp);
+
+  bme_charger_refresh();
+  battery_info->charger = hald_addon_bme_charger();
+
+  return TRUE;
+}
+
+/* Gauge entries nothing in the addon needs. They are read only when a
+ * client sends BME_DIAGNOSTICS_INFO_REQ, never by the regular poll, and a
+ * read is answered from the cache for DIAGNOSTIC_CACHE_TIME seconds so a
+ * tool asking in a loop does not turn into gauge traffic. */
+#define DIAGNOSTIC_CACHE_TIME 10
+
+typedef struct {
+  const char *key;
+  const char *path;
+  int type;                     /* DBUS_TYPE_INT32, _UINT32 or _STRING */
+  int scale;
+  time_t read;
+  int valid;
+  int32 value;
+  char string[512];
+} diagnostic_property;
+
+#define DIAGNOSTIC(key, name, type, scale) \
+  { key, BQ27200_ATTRIBUTE(name), type, scale, 0, 0, 0, "" }
+
+static diagnostic_property diagnostic_properties[] = {
+  DIAGNOSTIC(BME_DIAGNOSTIC_TEMP, "temp", DBUS_TYPE_INT32, 1),
+  DIAGNOSTIC(BME_DIAGNOSTIC_CYCLE_COUNT, "cycle_count", DBUS_TYPE_UINT32, 1),
+  DIAGNOSTIC(BME_DIAGNOSTIC_ENERGY_NOW, "energy_now", DBUS_TYPE_UINT32, 1000),
+  DIAGNOSTIC(BME_DIAGNOSTIC_TECHNOLOGY, "technology", DBUS_TYPE_STRING, 1),
+  DIAGNOSTIC(BME_DIAGNOSTIC_REGISTERS, "registers", DBUS_TYPE_STRING, 1),
+};
+
+/* failed reads are cached as well, a missing entry stays missing */
+static void hald_addon_bme_read_diagnostic(diagnostic_property *property, time_t now)
+{
+  char *line = property->string;
+  size_t len = 0;
+  FILE * fp;
+
+  if (property->read && now - property->read < DIAGNOSTIC_CACHE_TIME)
+    return;
+
+  property->read = now;
+  property->valid = 0;
+
+  if ((fp = fopen(property->path,"r")) == NULL)
+  {
+    log_print("unable to open %s(%s)\n",property->path,strerror(errno));
+    return;
+  }
+
+  /* multi-line files like registers end up as one line */
+  while (len < sizeof(property->string) - 1 && fgets(line + len, sizeof(property->string) - len, fp))
   {
-    char*tmp;
-    int num;
-    tmp = strchr(line,'=');
-    if(tmp)
-    {
-      *tmp=0;
-      tmp++;
-      tmp[strlen(tmp)-1] = 0;
-      if(!strcmp(line,"0x0a"))
-        battery_info->power_supply_flags_register = strtol(tmp, NULL, 16);
-      else if(!strcmp(line,"0x1c")) {
-        num = strtol(tmp, NULL, 16);
-        if(num != 65535)
-          battery_info->power_supply_time_to_empty_idle = num * 60;
-      }
-    }
+    len += strlen(line + len);
+    if (line[len-1] == '\n')
+      line[len-1] = ' ';
   }
   fclose(fp);
 
-  return TRUE;
+  while (len && isspace((unsigned char)line[len-1]))
+    line[--len] = 0;
+  if (!len)
+    return;
+
+  sysfs_stats.properties_read++;
+  if (property->type != DBUS_TYPE_STRING)
+    property->value = atoi(line)/property->scale;
+  property->valid = 1;
 }
 
 static void hald_addon_bme_status_info()
 {
   log_print("%s\n",__func__);
-  send_dbus_signal_(global_charger_connected ? "charger_connected" : "charger_disconnected");
-  if (global_bme.charge_level.capacity_state != FULL)
-    send_dbus_signal_(global_charger_connected ? "charger_charging_on" : "charger_charging_off");
+  send_dbus_signal_(global_charger_connected ? SIGNAL_CHARGER_CONNECTED : SIGNAL_CHARGER_DISCONNECTED);
+  if (global_bme.charge_level.capacity_state != BME_CAPACITY_FULL)
+    send_dbus_signal_(global_charger_connected ? SIGNAL_CHARGER_CHARGING_ON : SIGNAL_CHARGER_CHARGING_OFF);
   send_battery_state_changed(global_bme.charge_level.current);
 }
 
-static void hald_addon_bme_timeleft_info()
+/* idle and active time left in minutes */
+static void get_timeleft(uint32 *idle, uint32 *active)
 {
-  uint32 idle = 0;
-  uint32 active = 0;
-  log_print("%s\n",__func__);
+  *idle = *active = 0;
   if (global_battery.power_supply_time_to_empty_avg && !global_charger_connected) {
-    idle = active = global_battery.power_supply_time_to_empty_avg/60;
-    if (global_battery.power_supply_time_to_empty_idle > idle)
-      idle = global_battery.power_supply_time_to_empty_idle/60;
+    *idle = *active = global_battery.power_supply_time_to_empty_avg/60;
+    if (global_battery.power_supply_time_to_empty_idle > *idle)
+      *idle = global_battery.power_supply_time_to_empty_idle/60;
   } else if (global_battery.power_supply_time_to_full_now)
-    idle = active = global_battery.power_supply_time_to_full_now/60;
-  send_dbus_signal("battery_timeleft",
-      DBUS_TYPE_UINT32, &idle,
-      DBUS_TYPE_UINT32, &active,
-      DBUS_TYPE_INVALID);
+    *idle = *active = global_battery.power_supply_time_to_full_now/60;
 }
 
-static DBusHandlerResult hald_addon_bme_dbus_proxy(DBusConnection *connection, DBusMessage *message, void *user_data G_GNUC_UNUSED)
+static void hald_addon_bme_timeleft_info()
 {
-  const char *interface, *member, *path;
-  int type;
+  uint32 args[2];
+  log_print("%s\n",__func__);
+  get_timeleft(&args[0], &args[1]);
+  send_dbus_signal(SIGNAL_BATTERY_TIMELEFT, args);
+}
 
-  interface = dbus_message_get_interface(message);
-  member = dbus_message_get_member(message);
-  path = dbus_message_get_path(message);
+/* the counter of the open interval */
+static energy_counter * energy_current_counter(energy_counter counters[2][2][2])
+{
+  return &counters[!!global_display_on][!!energy_sample.charger_connected]
+                  [!!energy_sample.boost];
+}
 
-  type = dbus_message_get_type(message);
+/* add the energy of the open interval up to now to counter, using the
+ * trapezoid of the last sample and power_mw */
+static void energy_integrate(energy_counter *counter, int64 now_ms, int32 power_mw)
+{
+  double hours, mwh;
 
-  if(!interface ||
-     !member ||
-     !path ||
-     (type != DBUS_MESSAGE_TYPE_SIGNAL && type != DBUS_MESSAGE_TYPE_METHOD_CALL) ||
-     strcmp(interface, "com.nokia.bme.request") ||
-     strcmp(path, "/com/nokia/bme/request"))
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  if (!energy_sample.valid || now_ms <= energy_sample.time_ms)
+    return;
 
-  log_print("DBUS RECV: %s %s.%s\n\n", path,interface,dbus_message_type_to_string(type));
+  hours = (now_ms - energy_sample.time_ms) / 3600000.0;
+  mwh = (energy_sample.power_mw + power_mw) / 2.0 * hours;
 
-  if (!strcmp(member, "status_info_req") )
-  {
-    log_print("got: BME_STATUS_INFO_REQ\n");
-    hald_addon_bme_status_info();
-  }
+  counter->seconds += hours * 3600;
+  if (mwh >= 0)
+    counter->discharged_mwh += mwh;
   else
-  {
-    if(strcmp(member, "timeleft_info_req"))
-      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    counter->charged_mwh -= mwh;
+}
 
-    log_print("got: BME_TIMELEFT_INFO_REQ\n");
-    hald_addon_bme_timeleft_info();
-  }
+/* battery current is positive while discharging */
+static void energy_account_sample(const battery * battery_info)
+{
+  int64 now_ms = monotonic_time_ms();
+  int32 power_mw;
 
-  if(type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+  if (battery_info->power_supply_voltage_now <= 0)
   {
-    if ( !dbus_message_get_no_reply(message) )
-    {
-      DBusMessage * msg = dbus_message_new_method_return(message);
-      if ( msg )
-      {
-        dbus_connection_send(connection, msg, 0);
-        dbus_message_unref(msg);
-      }
-    }
+    energy_sample.valid = 0;
+    return;
   }
 
-  return DBUS_HANDLER_RESULT_HANDLED;
+  power_mw = (int64)battery_info->power_supply_voltage_now * battery_info->power_supply_current_now / 1000;
+  energy_integrate(energy_current_counter(energy_counters), now_ms, power_mw);
+
+  energy_sample.time_ms = now_ms;
+  energy_sample.power_mw = power_mw;
+  energy_sample.charger_connected = bme_charger_is_connected(battery_info->charger);
+  energy_sample.boost = battery_info->boost;
+  energy_sample.valid = 1;
 }
 
-static gint hald_addon_bme_setup_dbus_proxy()
+/* close the interval with the last known power when the display state
+ * flips, so it is accounted to the right counter without touching the gauge */
+static void energy_account_display(int display_on)
 {
-  DBusError error;
-  gint result = -1;
+  int64 now_ms = monotonic_time_ms();
 
-  dbus_error_init(&error);
+  if (!!display_on == !!global_display_on)
+    return;
 
-  system_dbus = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
-  if(!system_dbus)
-    goto error;
-  else
-  {
-    dbus_connection_setup_with_g_main(system_dbus, 0);
-    dbus_connection_set_exit_on_disconnect(system_dbus, FALSE);
-    if(dbus_connection_add_filter(system_dbus, hald_addon_bme_dbus_proxy, NULL, NULL))
-    {
-      dbus_bus_add_match(system_dbus,
-                         "type='signal',interface='com.nokia.bme.request'",
-                         &error);
-      if ( dbus_error_is_set(&error) )
-        goto dbus_error;
-      else
+  energy_integrate(energy_current_counter(energy_counters), now_ms, energy_sample.power_mw);
+  energy_sample.time_ms = now_ms;
+  global_display_on = display_on;
+}
+
+static DBusHandlerResult hald_addon_bme_energy_info(DBusConnection *connection, DBusMessage *message)
+{
+  energy_counter snapshot[2][2][2];
+  DBusMessage *reply;
+  DBusMessageIter iter, array, entry;
+  int display, charger, boost;
+
+  log_print("got: BME_ENERGY_INFO_REQ\n");
+
+  if (dbus_message_get_no_reply(message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  /* counters are only updated at samples, add the open interval to a copy */
+  memcpy(snapshot, energy_counters, sizeof(snapshot));
+  energy_integrate(energy_current_counter(snapshot), monotonic_time_ms(), energy_sample.power_mw);
+
+  reply = dbus_message_new_method_return(message);
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(bbbddd)", &array);
+  for (display = 0; display < 2; display++)
+    for (charger = 0; charger < 2; charger++)
+      for (boost = 0; boost < 2; boost++)
       {
-        if ( !dbus_bus_request_name(system_dbus,
-                                   "com.nokia.bme",
-                                   DBUS_REQUEST_NAME_REPLY_ALREADY_OWNER,
-                                   &error))
-        {
-          if ( dbus_error_is_set(&error) )
-            goto dbus_error;
-        }
+        energy_counter *counter = &snapshot[display][charger][boost];
+        dbus_bool_t b;
+
+        dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+        b = display;
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_BOOLEAN, &b);
+        b = charger;
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_BOOLEAN, &b);
+        b = boost;
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_BOOLEAN, &b);
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_DOUBLE, &counter->seconds);
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_DOUBLE, &counter->discharged_mwh);
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_DOUBLE, &counter->charged_mwh);
+        dbus_message_iter_close_container(&array, &entry);
       }
-    }
-    else
-      goto error;
-  }
-  result = 0;
-  goto out;
-error:
-  log_print("proxy_init");
-  goto out;
-dbus_error:
-    log_print("proxy_init %s: %s\n",error.name,error.message);
-out:
-  dbus_error_free(&error);
-  return result;
+  dbus_message_iter_close_container(&iter, &array);
+
+  dbus_connection_send(connection, reply, 0);
+  dbus_message_unref(reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
 }
 
-static const char * get_capacity_state_string()
+static int archive_due(time_t now)
 {
-  switch(global_bme.charge_level.capacity_state)
-  {
-    case LOW:return "low";
-    case FULL:return "full";
-    case EMPTY:return "empty";
-    default:return "ok";
-  }
+  return archive && (!archive_last || now < archive_last || now - archive_last >= (time_t)archive_period);
 }
 
-static gboolean hald_addon_bme_update_hal(battery * battery_info,gboolean check_for_changes)
+static void archive_sample(const battery * battery_info)
 {
-#define CHECK_INT(f,fun) do { \
-  if( !check_for_changes || (global_battery.f != battery_info->f)) \
-    log_print(#f " changed,updating to %d",battery_info->f);fun; \
-  } while ( 0 )
+  bme_archive_record record;
+  time_t now = time(NULL);
+
+  if (!archive_due(now) || battery_info->power_supply_voltage_now <= 0)
+    return;
+
+  archive_last = now;
+  record.time = now;
+  record.charge_full = battery_info->power_supply_charge_full;
+  record.charge_now = battery_info->power_supply_charge_now;
+  record.voltage = battery_info->power_supply_voltage_now;
+  record.temp = battery_info->power_supply_temp;
+  record.flags = battery_info->power_supply_flags_register;
+
+  if (bme_archive_append(archive, &record))
+    log_print("archive append: %s\n", strerror(errno));
+}
 
-  uint32 charge_level_current;
-  uint32 capacity_state;
-  int calibrated;
-  int charger_connected;
-  int is_charging;
-  int positive_rate;
-  int capacity;
-  int no_voltage = 0;
-  int very_low = 0;
+static int archive_flush(void *data UNUSED)
+{
+  if (archive && bme_archive_flush(archive))
+    log_print("archive flush: %s\n", strerror(errno));
 
-  if(battery_info->power_supply_capacity < 0)
-    calibrated = 0;
-  else
-    calibrated = 1;
+  return TRUE;
+}
 
-  if (strstr(battery_info->power_supply_mode, "host") || strstr(battery_info->power_supply_mode, "dedicated"))
-    charger_connected = 1;
-  else
-    charger_connected = 0;
+typedef struct {
+  DBusMessageIter *array;
+  unsigned int count;
+} archive_query_reply;
 
-  if (battery_info->power_supply_current_now < 0)
-    positive_rate = 1;
-  else
-    positive_rate = 0;
+static int archive_query_append(const bme_archive_record *record, void *data)
+{
+  archive_query_reply *reply = data;
+  DBusMessageIter entry;
+
+  dbus_message_iter_open_container(reply->array, DBUS_TYPE_STRUCT, NULL, &entry);
+  dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &record->time);
+  dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &record->charge_full);
+  dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &record->charge_now);
+  dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &record->voltage);
+  dbus_message_iter_append_basic(&entry, DBUS_TYPE_INT32, &record->temp);
+  dbus_message_iter_append_basic(&entry, DBUS_TYPE_INT32, &record->flags);
+  dbus_message_iter_close_container(reply->array, &entry);
+
+  return ++reply->count >= BME_ARCHIVE_QUERY_MAX_RECORDS;
+}
 
-  if (positive_rate && charger_connected)
-    is_charging = 1;
-  else
-    is_charging = 0;
+static DBusHandlerResult hald_addon_bme_history_query(DBusConnection *connection, DBusMessage *message)
+{
+  DBusError error;
+  DBusMessage *reply;
+  DBusMessageIter iter, array;
+  archive_query_reply query = { &array, 0 };
+  uint32 from, to, step;
 
-  if (battery_info->power_supply_voltage_now <= 0)
-    no_voltage = 1;
+  log_print("got: BME_HISTORY_QUERY_REQ\n");
 
-  if(!check_for_changes)
+  dbus_error_init(&error);
+  if (!dbus_message_get_args(message, &error,
+                             DBUS_TYPE_UINT32, &from,
+                             DBUS_TYPE_UINT32, &to,
+                             DBUS_TYPE_UINT32, &step,
+                             DBUS_TYPE_INVALID))
+    reply = dbus_message_new_error(message, BME_ERROR_INVALID_ARGS, error.message);
+  else if (!archive)
+    reply = dbus_message_new_error(message, BME_ERROR_FATAL, "history is not available");
+  else if ((reply = dbus_message_new_method_return(message)))
   {
-    libhal_device_set_property_string(hal_ctx, udi, "battery.charge_level.capacity_state", "ok", NULL);
-    libhal_device_set_property_int(hal_ctx, udi, "battery.charge_level.current", 0, NULL);
-    libhal_device_set_property_int(hal_ctx, udi, "battery.charge_level.design", 8, NULL); /* STATIC */
-    libhal_device_set_property_int(hal_ctx, udi, "battery.charge_level.last_full", 0, NULL);
-    libhal_device_set_property_int(hal_ctx, udi, "battery.charge_level.percentage", 0, NULL);
-    libhal_device_set_property_string(hal_ctx, udi, "battery.charge_level.unit", "bars", NULL); /* STATIC */
-    libhal_device_set_property_bool(hal_ctx, udi, "battery.is_rechargeable", TRUE, NULL); /* STATIC */
-    libhal_device_set_property_bool(hal_ctx, udi, "battery.present", TRUE, NULL); /* STATIC */
-    libhal_device_set_property_bool(hal_ctx, udi, "battery.rechargeable.is_charging", FALSE, NULL);
-    libhal_device_set_property_bool(hal_ctx, udi, "battery.rechargeable.is_discharging", TRUE, NULL);
-    libhal_device_set_property_int(hal_ctx, udi, "battery.remaining_time", 0, NULL);
-    libhal_device_set_property_bool(hal_ctx, udi, "battery.remaining_time.calculate_per_time", FALSE, NULL); /* STATIC */
-    libhal_device_set_property_int(hal_ctx, udi, "battery.reporting.current", 0, NULL);
-    libhal_device_set_property_int(hal_ctx, udi, "battery.reporting.design", 0, NULL);
-    libhal_device_set_property_int(hal_ctx, udi, "battery.reporting.last_full", 0, NULL);
-    libhal_device_set_property_string(hal_ctx, udi, "battery.reporting.unit", "mAh", NULL); /* STATIC */
-    libhal_device_set_property_string(hal_ctx, udi, "battery.type","pda", NULL); /* STATIC */
-    libhal_device_set_property_int(hal_ctx, udi, "battery.voltage.current", 0, NULL);
-    libhal_device_set_property_int(hal_ctx, udi, "battery.voltage.design", 4200, NULL);
-    libhal_device_set_property_string(hal_ctx, udi, "battery.voltage.unit", "mV", NULL); /* STATIC */
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.charger.connection_status", "disconnected", NULL);
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.charger.type", "none", NULL);
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.rechargeable.charging_status", "off", NULL);
-    libhal_device_set_property_bool(hal_ctx, udi, "maemo.rechargeable.positive_rate", FALSE, NULL);
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.bme.version", "1.0", NULL); /* STATIC */
+    dbus_message_iter_init_append(reply, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(uuuuii)", &array);
+    bme_archive_query(archive, from, to, step, archive_query_append, &query);
+    dbus_message_iter_close_container(&iter, &array);
   }
+  dbus_error_free(&error);
 
-  CHECK_INT(power_supply_voltage_now,
-        libhal_device_set_property_int (hal_ctx, udi, "battery.voltage.current", battery_info->power_supply_voltage_now, NULL));
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
 
-  CHECK_INT(power_supply_voltage_design,
-        libhal_device_set_property_int (hal_ctx, udi, "battery.voltage.design", battery_info->power_supply_voltage_design, NULL));
+  if (!dbus_message_get_no_reply(message))
+    dbus_connection_send(connection, reply, 0);
+  dbus_message_unref(reply);
 
-  CHECK_INT(power_supply_charge_design,
-        libhal_device_set_property_int (hal_ctx, udi, "battery.reporting.design", battery_info->power_supply_charge_design, NULL));
-
-  /* hal edge   real edge
-        0          8
-       13         19.96
-       25         31
-       38         42.96
-       50         54
-       63         65.96
-       75         77
-       88         88.96
-      100        100
-  */
-
-  /*
-     bars   status  hal capacity real capacity
-      0     empty      0%-0%        0%-EDV1
-      0     very low   0%-0%      EDV1-8%
-      0     low        0%-6%        9%-14%
-      1     ok         7%-19%      15%-25%
-      2     ok        20%-31%      26%-37%
-      3     ok        32%-44%      38%-48%
-      4     ok        45%-56%      49%-59%
-      5     ok        57%-69%      60%-70%
-      6     ok        70%-81%      71%-83%
-      7     ok        82%-94%      84%-94%
-      8     full      95%-100%     95%-100%
-   */
-
-  /* we should tell capacity is 0% when battery is very low */
-  /* very low is someting between empty and low */
-  /* EDV1 is set when capacity is about 6% (which turn off device), so very low could be 8% */
-  /* so recalculate capacity from 8%-100% to 0%-100% (to tell 0% when battery is very low which means battery has 8%) */
-
-  /* bq27200 report percentage capacity against last full capacity */
-  /* we will recalculate percentage capacity against design capacity reported by rx51_battery (if driver is available) */
-  if(calibrated && battery_info->power_supply_charge_now > 0 && battery_info->power_supply_charge_design > 0)
-  {
-    if (100*battery_info->power_supply_charge_now > 8*battery_info->power_supply_charge_design)
-      capacity = 100 * (100*battery_info->power_supply_charge_now - 8*battery_info->power_supply_charge_design) / (92*battery_info->power_supply_charge_design);
-    else
-      capacity = 0;
-  }
-  else if(calibrated && battery_info->power_supply_charge_now > 0 && battery_info->power_supply_charge_full > 0)
-  {
-    if (100*battery_info->power_supply_charge_now > 8*battery_info->power_supply_charge_full)
-      capacity = 100 * (100*battery_info->power_supply_charge_now - 8*battery_info->power_supply_charge_full) / (92*battery_info->power_supply_charge_full);
-    else
-      capacity = 0;
-  }
-  else if(!no_voltage) /* when battery is not calibrated or other data is missing, report some capacity from voltage (if we have it) */
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const char * get_capacity_state_string();
+
+static void append_dict_entry(DBusMessageIter *dict, const char *key, int type, const void *value)
+{
+  DBusMessageIter entry, variant;
+  char signature[2] = { type, 0 };
+
+  dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+  dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+  dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, signature, &variant);
+  dbus_message_iter_append_basic(&variant, type, value);
+  dbus_message_iter_close_container(&entry, &variant);
+  dbus_message_iter_close_container(dict, &entry);
+}
+
+/* the values behind the BME_PROPERTY_* keys */
+typedef struct {
+  dbus_bool_t charger_connected;
+  dbus_bool_t charging;
+  uint32 bars;
+  uint32 bars_max;
+  uint32 percentage;
+  const char *capacity_state;
+  uint32 timeleft_idle;
+  uint32 timeleft_active;
+} bme_properties;
+
+/* last BME_STATE_CHANGED payload */
+static bme_properties published_properties;
+static int published_properties_valid = 0;
+/* capacity state (re)announced since, sent even when unchanged */
+static int capacity_state_announced = 0;
+
+static void get_properties(bme_properties *properties)
+{
+  properties->charger_connected = global_charger_connected;
+  properties->charging = global_is_charging;
+  properties->bars = global_bme.charge_level.current;
+  properties->bars_max = 8;
+  properties->percentage = global_bme.charge_level.percentage;
+  properties->capacity_state = get_capacity_state_string();
+  get_timeleft(&properties->timeleft_idle, &properties->timeleft_active);
+}
+
+/* all properties, or with last only those that differ from it */
+static int append_properties(DBusMessageIter *dict, const bme_properties *properties, const bme_properties *last)
+{
+  int n = 0;
+
+#define APPEND(key, type, field, changed) do { \
+  if (!last || (changed)) \
+  { \
+    append_dict_entry(dict, key, type, &properties->field); \
+    n++; \
+  } \
+} while (0)
+
+  APPEND(BME_PROPERTY_CHARGER_CONNECTED, DBUS_TYPE_BOOLEAN, charger_connected,
+         properties->charger_connected != last->charger_connected);
+  APPEND(BME_PROPERTY_CHARGING, DBUS_TYPE_BOOLEAN, charging, properties->charging != last->charging);
+  APPEND(BME_PROPERTY_BARS, DBUS_TYPE_UINT32, bars, properties->bars != last->bars);
+  APPEND(BME_PROPERTY_BARS_MAX, DBUS_TYPE_UINT32, bars_max, properties->bars_max != last->bars_max);
+  APPEND(BME_PROPERTY_PERCENTAGE, DBUS_TYPE_UINT32, percentage, properties->percentage != last->percentage);
+  APPEND(BME_PROPERTY_CAPACITY_STATE, DBUS_TYPE_STRING, capacity_state,
+         strcmp(properties->capacity_state, last->capacity_state) || capacity_state_announced);
+  APPEND(BME_PROPERTY_TIMELEFT_IDLE, DBUS_TYPE_UINT32, timeleft_idle,
+         properties->timeleft_idle != last->timeleft_idle);
+  APPEND(BME_PROPERTY_TIMELEFT_ACTIVE, DBUS_TYPE_UINT32, timeleft_active,
+         properties->timeleft_active != last->timeleft_active);
+
+#undef APPEND
+
+  return n;
+}
+
+/* the bme_properties fields by BME_PROPERTY_* key, for subscriptions */
+#define PROPERTY_FIELD(key, type, field) \
+  { key, type, offsetof(bme_properties, field), sizeof(((bme_properties *)0)->field) }
+
+static const struct {
+  const char *key;
+  int type;
+  size_t offset;
+  size_t size;
+} property_fields[] = {
+  PROPERTY_FIELD(BME_PROPERTY_CHARGER_CONNECTED, DBUS_TYPE_BOOLEAN, charger_connected),
+  PROPERTY_FIELD(BME_PROPERTY_CHARGING, DBUS_TYPE_BOOLEAN, charging),
+  PROPERTY_FIELD(BME_PROPERTY_BARS, DBUS_TYPE_UINT32, bars),
+  PROPERTY_FIELD(BME_PROPERTY_BARS_MAX, DBUS_TYPE_UINT32, bars_max),
+  PROPERTY_FIELD(BME_PROPERTY_PERCENTAGE, DBUS_TYPE_UINT32, percentage),
+  PROPERTY_FIELD(BME_PROPERTY_CAPACITY_STATE, DBUS_TYPE_STRING, capacity_state),
+  PROPERTY_FIELD(BME_PROPERTY_TIMELEFT_IDLE, DBUS_TYPE_UINT32, timeleft_idle),
+  PROPERTY_FIELD(BME_PROPERTY_TIMELEFT_ACTIVE, DBUS_TYPE_UINT32, timeleft_active),
+};
+
+#define PROPERTY_FIELD_CAPACITY_STATE 5
+
+/* Clients that registered with BME_SUBSCRIBE_REQ. Each one gets a unicast
+ * BME_SUBSCRIPTION_UPDATE with the fields it asked for, and only once a
+ * field moved by at least its threshold since it was last delivered to
+ * that client. */
+#define SUBSCRIBERS_MAX 32
+
+typedef struct {
+  char *name;                   /* unique bus name */
+  unsigned int fields;          /* bit per property_fields entry */
+  uint32 thresholds[N_ELEMENTS(property_fields)];
+  bme_properties delivered;
+} subscriber;
+
+static subscriber subscribers[SUBSCRIBERS_MAX];
+static unsigned int n_subscribers = 0;
+
+struct {
+  uint32 updates_sent;
+} subscription_stats;
+
+static const void * property_field(const bme_properties *properties, unsigned int i)
+{
+  return (const char *)properties + property_fields[i].offset;
+}
+
+static int property_field_moved(const bme_properties *properties, const bme_properties *last,
+                                unsigned int i, uint32 threshold)
+{
+  uint32 value, last_value;
+
+  if (property_fields[i].type == DBUS_TYPE_STRING)
+    return strcmp(*(const char * const *)property_field(properties, i),
+                  *(const char * const *)property_field(last, i)) != 0;
+
+  /* dbus_bool_t is a uint32 as well */
+  memcpy(&value, property_field(properties, i), sizeof(value));
+  memcpy(&last_value, property_field(last, i), sizeof(last_value));
+
+  if (property_fields[i].type == DBUS_TYPE_BOOLEAN || threshold <= 1)
+    return value != last_value;
+
+  return (value > last_value ? value - last_value : last_value - value) >= threshold;
+}
+
+static void append_property_fields(DBusMessageIter *dict, const bme_properties *properties, unsigned int fields)
+{
+  unsigned int i;
+
+  for (i = 0; i < N_ELEMENTS(property_fields); i++)
+    if (fields & (1 << i))
+      append_dict_entry(dict, property_fields[i].key, property_fields[i].type, property_field(properties, i));
+}
+
+static subscriber * subscriber_find(const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < n_subscribers; i++)
+    if (!strcmp(subscribers[i].name, name))
+      return &subscribers[i];
+
+  return NULL;
+}
+
+/* only NameOwnerChanged of names we keep state for is routed to us */
+static void name_watch(const char *name, int add)
+{
+  char match[256];
+
+  snprintf(match, sizeof(match),
+           "type='signal',sender='%s',path='%s',interface='%s',member='NameOwnerChanged',arg0='%s'",
+           DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, name);
+
+  if (add)
+    dbus_bus_add_match(system_dbus, match, NULL);
+  else
+    dbus_bus_remove_match(system_dbus, match, NULL);
+}
+
+static void subscriber_remove(const char *name)
+{
+  subscriber *sub = subscriber_find(name);
+
+  if (!sub)
+    return;
+
+  log_print("unsubscribe: %s\n", name);
+  name_watch(sub->name, 0);
+  free(sub->name);
+  *sub = subscribers[--n_subscribers];
+}
+
+static void send_subscription_updates(const bme_properties *properties)
+{
+  DBusMessage *msg;
+  DBusMessageIter iter, dict;
+  unsigned int i, j, fields;
+
+  for (i = 0; i < n_subscribers; i++)
   {
-    if (!charger_connected)
-    {
-      if (battery_info->power_supply_voltage_now <= POWER_SUPPLY_VOLTAGE_THRESHOLD_EMPTY)
-        battery_info->power_supply_capacity = 0;
-      else if (battery_info->power_supply_voltage_now <= POWER_SUPPLY_VOLTAGE_THRESHOLD_VERYLOW)
-        battery_info->power_supply_capacity = 7;
-      else if (battery_info->power_supply_voltage_now <= POWER_SUPPLY_VOLTAGE_THRESHOLD_LOW)
-        battery_info->power_supply_capacity = 12;
-      else if (battery_info->power_supply_voltage_now > POWER_SUPPLY_VOLTAGE_THRESHOLD_FULL)
-        battery_info->power_supply_capacity = 100;
-      else
-        battery_info->power_supply_capacity = 54;
-      capacity = 100*(battery_info->power_supply_capacity-8)/92;
-    }
-    else
+    subscriber *sub = &subscribers[i];
+
+    fields = 0;
+    for (j = 0; j < N_ELEMENTS(property_fields); j++)
+      if ((sub->fields & (1 << j)) &&
+          (property_field_moved(properties, &sub->delivered, j, sub->thresholds[j]) ||
+           (j == PROPERTY_FIELD_CAPACITY_STATE && capacity_state_announced)))
+        fields |= 1 << j;
+
+    if (!fields)
+      continue;
+
+    msg = dbus_message_new_signal(BME_SIGNAL_PATH, BME_SIGNAL_IF, BME_SUBSCRIPTION_UPDATE);
+    if (!msg)
+      return;
+
+    dbus_message_set_destination(msg, sub->name);
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    append_property_fields(&dict, properties, fields);
+    dbus_message_iter_close_container(&iter, &dict);
+
+    if (dbus_connection_send(system_dbus, msg, 0))
     {
-      if (battery_info->power_supply_voltage_now <= 4050) /* 14% */
-        capacity = 0;
-      else if (battery_info->power_supply_voltage_now <= 4089) /* 25% */
-        capacity = 13;
-      else if (battery_info->power_supply_voltage_now <= 4102) /* 37% */
-        capacity = 25;
-      else if (battery_info->power_supply_voltage_now <= 4110) /* 48% */
-        capacity = 38;
-      else if (battery_info->power_supply_voltage_now <= 4120) /* 59% */
-        capacity = 50;
-      else if (battery_info->power_supply_voltage_now <= 4134) /* 70% */
-        capacity = 63;
-      else if (battery_info->power_supply_voltage_now <= 4152) /* 83% */
-        capacity = 75;
-      else if (battery_info->power_supply_voltage_now <= 4168) /* 94% */
-        capacity = 88;
-      else
-        capacity = 100;
-      battery_info->power_supply_capacity = capacity*92/100+8;
+      subscription_stats.updates_sent++;
+      /* the baseline only moves for what was delivered */
+      for (j = 0; j < N_ELEMENTS(property_fields); j++)
+        if (fields & (1 << j))
+          memcpy((char *)&sub->delivered + property_fields[j].offset, property_field(properties, j),
+                 property_fields[j].size);
     }
+    dbus_message_unref(msg);
   }
+}
+
+static DBusHandlerResult hald_addon_bme_subscribe(DBusConnection *connection, DBusMessage *message)
+{
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, array, entry, dict;
+  const char *sender = dbus_message_get_sender(message);
+  uint32 thresholds[N_ELEMENTS(property_fields)];
+  unsigned int fields = 0;
+  bme_properties properties;
+  subscriber *sub;
+  unsigned int i;
+
+  log_print("got: BME_SUBSCRIBE_REQ\n");
+
+  memset(thresholds, 0, sizeof(thresholds));
+
+  if (!sender || !dbus_message_has_signature(message, "a{su}"))
+    reply = dbus_message_new_error(message, BME_ERROR_INVALID_ARGS, "expected a{su}");
   else
   {
-    /* otherwise we have no data, capacity is unknown and volage is not accesable */
-    capacity = 0;
+    dbus_message_iter_init(message, &iter);
+    dbus_message_iter_recurse(&iter, &array);
   }
 
+  for (; !reply && dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_DICT_ENTRY;
+       dbus_message_iter_next(&array))
+  {
+    const char *key;
+    uint32 threshold;
+
+    dbus_message_iter_recurse(&array, &entry);
+    dbus_message_iter_get_basic(&entry, &key);
+    dbus_message_iter_next(&entry);
+    dbus_message_iter_get_basic(&entry, &threshold);
 
-  if (capacity < 0)
-    capacity = 0;
-  else if (capacity > 100)
-    capacity = 100;
+    for (i = 0; i < N_ELEMENTS(property_fields); i++)
+      if (!strcmp(property_fields[i].key, key))
+        break;
 
-  /* capacity_level is in upstream kernel */
-  if(battery_info->power_supply_capacity_level[0])
-  {
-    if (!strcmp(battery_info->power_supply_capacity_level, "Full"))
-      capacity_state = FULL;
-    else if (!strcmp(battery_info->power_supply_capacity_level, "High"))
+    if (i == N_ELEMENTS(property_fields))
+      reply = dbus_message_new_error(message, BME_ERROR_INVALID_ARGS, "unknown property");
+    else
     {
-      if (is_charging)
-        capacity_state = OK;
-      else
-        capacity_state = FULL;
+      fields |= 1 << i;
+      thresholds[i] = threshold;
     }
-    else if (!strcmp(battery_info->power_supply_capacity_level, "Normal"))
+  }
+
+  if (!reply && !fields)
+    reply = dbus_message_new_error(message, BME_ERROR_INVALID_ARGS, "no properties");
+
+  if (!reply)
+  {
+    /* subscribing again replaces the subscription */
+    if (!(sub = subscriber_find(sender)) && n_subscribers < SUBSCRIBERS_MAX)
     {
-      if (calibrated)
+      sub = &subscribers[n_subscribers];
+      if ((sub->name = strdup(sender)) != NULL)
       {
-        if (battery_info->power_supply_charge_now <= POWER_SUPPLY_CHARGE_THRESHOLD_VERYLOW) {
-          capacity_state = LOW;
-          very_low = 1;
-        } else if (battery_info->power_supply_charge_now <= POWER_SUPPLY_CHARGE_THRESHOLD_LOW)
-          capacity_state = LOW;
-        else
-          capacity_state = OK;
-      }
-      else if (!no_voltage)
-      {
-        if (battery_info->power_supply_voltage_now <= POWER_SUPPLY_VOLTAGE_THRESHOLD_VERYLOW) {
-          capacity_state = LOW;
-          very_low = 1;
-        } if (battery_info->power_supply_voltage_now <= POWER_SUPPLY_VOLTAGE_THRESHOLD_LOW)
-          capacity_state = LOW;
-        else
-          capacity_state = OK;
+        n_subscribers++;
+        name_watch(sender, 1);
+        log_print("subscribe: %s\n", sender);
       }
       else
-        capacity_state = OK;
+        sub = NULL;
     }
-    else if (!strcmp(battery_info->power_supply_capacity_level, "Low"))
-      capacity_state = EMPTY;
-    else if (!strcmp(battery_info->power_supply_capacity_level, "Critical"))
-      capacity_state = EMPTY;
-    else
-      capacity_state = OK;
-  }
-  /* registers is in maemo kernel-power */
-  /* code taken from upstream kernel */
-  else if (battery_info->power_supply_flags_register >= 0)
-  {
-    if (battery_info->power_supply_flags_register & 0x20) /* FLAG_FC */
-      capacity_state = FULL;
-    else if (battery_info->power_supply_flags_register & 0x01) /* FLAG_EDVF */
-      capacity_state = EMPTY;
-    else if (battery_info->power_supply_flags_register & 0x02) /* FLAG_EDV1 */
-      capacity_state = EMPTY;
-    else if (calibrated)
+
+    if (!sub)
+      reply = dbus_message_new_error(message, DBUS_ERROR_LIMITS_EXCEEDED, "too many subscribers");
+    else if ((reply = dbus_message_new_method_return(message)))
     {
-      if (battery_info->power_supply_charge_now <= POWER_SUPPLY_CHARGE_THRESHOLD_VERYLOW) {
-        capacity_state = LOW;
-        very_low = 1;
-      } else if (battery_info->power_supply_charge_now <= POWER_SUPPLY_CHARGE_THRESHOLD_LOW)
-        capacity_state = LOW;
-      else
-        capacity_state = OK;
+      get_properties(&properties);
+      sub->fields = fields;
+      memcpy(sub->thresholds, thresholds, sizeof(thresholds));
+      sub->delivered = properties;
+
+      /* the starting point the thresholds count from */
+      dbus_message_iter_init_append(reply, &iter);
+      dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+      append_property_fields(&dict, &properties, fields);
+      dbus_message_iter_close_container(&iter, &dict);
     }
-    else if (!no_voltage)
+  }
+
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  if (!dbus_message_get_no_reply(message))
+    dbus_connection_send(connection, reply, 0);
+  dbus_message_unref(reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult hald_addon_bme_unsubscribe(DBusConnection *connection, DBusMessage *message)
+{
+  DBusMessage *reply;
+  const char *sender = dbus_message_get_sender(message);
+
+  log_print("got: BME_UNSUBSCRIBE_REQ\n");
+
+  if (sender)
+    subscriber_remove(sender);
+
+  if (dbus_message_get_no_reply(message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  reply = dbus_message_new_method_return(message);
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  dbus_connection_send(connection, reply, 0);
+  dbus_message_unref(reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* one signal per update with whatever changed in it, for subscribers that
+ * do not want to wake up for every single legacy signal */
+static int send_state_changed()
+{
+  bme_properties properties;
+  DBusMessage *msg;
+  DBusMessageIter iter, dict;
+  int n;
+
+  get_properties(&properties);
+
+  send_subscription_updates(&properties);
+
+  /* the difference to what was published keeps growing until the display
+   * is turned on or something urgent changes */
+  if (display_off_deferring() && published_properties_valid && !capacity_state_announced &&
+      properties.charger_connected == published_properties.charger_connected &&
+      properties.charging == published_properties.charging &&
+      !strcmp(properties.capacity_state, published_properties.capacity_state))
+    return TRUE;
+
+  msg = dbus_message_new_signal(BME_SIGNAL_PATH, BME_SIGNAL_IF, BME_STATE_CHANGED);
+  if (!msg)
+    return FALSE;
+
+  dbus_message_iter_init_append(msg, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+  n = append_properties(&dict, &properties, published_properties_valid ? &published_properties : NULL);
+  dbus_message_iter_close_container(&iter, &dict);
+
+  if (n)
+  {
+    log_print("send dbus signal: %s (%d changed)\n", BME_STATE_CHANGED, n);
+    signal_stats.signal_messages_built++;
+    if (dbus_connection_send(system_dbus, msg, 0))
+      signal_stats.signals_sent++;
+    published_properties = properties;
+    published_properties_valid = 1;
+    capacity_state_announced = 0;
+  }
+  dbus_message_unref(msg);
+
+  return TRUE;
+}
+
+static DBusHandlerResult hald_addon_bme_status_snapshot(DBusConnection *connection, DBusMessage *message)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter, dict;
+  bme_properties properties;
+
+  log_print("got: BME_STATUS_SNAPSHOT_REQ\n");
+
+  if (dbus_message_get_no_reply(message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  reply = dbus_message_new_method_return(message);
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  get_properties(&properties);
+
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+  append_properties(&dict, &properties, NULL);
+  dbus_message_iter_close_container(&iter, &dict);
+
+  dbus_connection_send(connection, reply, 0);
+  dbus_message_unref(reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Every status_info_req and timeleft_info_req is answered with broadcasts
+ * all listeners wake up for, so they are counted per sender. Senders above
+ * request_limit per minute still get their method reply, but no
+ * broadcasts. The table is bounded, the sender seen least recently makes
+ * room, and a sender is dropped when it leaves the bus. */
+#define REQUEST_SENDERS_MAX 32
+#define REQUEST_WINDOW_MS 60000
+#define REQUEST_TOP 10
+
+typedef struct {
+  char *name;                   /* unique bus name */
+  uint32 requests;
+  uint32 limited;
+  uint32 current;               /* requests in the window from window_start */
+  uint32 previous;              /* and in the one before */
+  int64 window_start;
+  int64 last_ms;
+} request_sender;
+
+static request_sender request_senders[REQUEST_SENDERS_MAX];
+static unsigned int n_request_senders = 0;
+
+/* per sender and minute, 0 disables the limit */
+static uint32 request_limit = 60;
+
+struct {
+  uint32 requests_limited;
+} request_stats;
+
+static void request_sender_remove(const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < n_request_senders; i++)
+    if (!strcmp(request_senders[i].name, name))
     {
-      if (battery_info->power_supply_voltage_now <= POWER_SUPPLY_VOLTAGE_THRESHOLD_VERYLOW) {
-        capacity_state = LOW;
-        very_low = 1;
-      } else if (battery_info->power_supply_voltage_now <= POWER_SUPPLY_VOLTAGE_THRESHOLD_LOW)
-        capacity_state = LOW;
-      else
-        capacity_state = OK;
+      name_watch(name, 0);
+      free(request_senders[i].name);
+      request_senders[i] = request_senders[--n_request_senders];
+      return;
     }
-    else
-      capacity_state = OK;
-  }
-  /* no maemo kernel-power or upstream kernel, but battery is calibrated */
-  /* check charge_now threshold */
-  else if (calibrated)
-  {
-    if (battery_info->power_supply_charge_now <= POWER_SUPPLY_CHARGE_THRESHOLD_EMPTY)
-      capacity_state = EMPTY;
-    else if (battery_info->power_supply_charge_now <= POWER_SUPPLY_CHARGE_THRESHOLD_VERYLOW) {
-      very_low = 1;
-      capacity_state = LOW;
-    } else if (battery_info->power_supply_charge_now <= POWER_SUPPLY_CHARGE_THRESHOLD_LOW)
-      capacity_state = LOW;
-    else if (battery_info->power_supply_capacity > POWER_SUPPLY_CAPACITY_THRESHOLD_FULL)
+}
+
+static request_sender * request_sender_get(const char *name, int64 now_ms)
+{
+  request_sender *sender, *oldest = NULL;
+  unsigned int i;
+
+  for (i = 0; i < n_request_senders; i++)
+  {
+    if (!strcmp(request_senders[i].name, name))
+      return &request_senders[i];
+    if (!oldest || request_senders[i].last_ms < oldest->last_ms)
+      oldest = &request_senders[i];
+  }
+
+  if (n_request_senders == REQUEST_SENDERS_MAX)
+    request_sender_remove(oldest->name);
+
+  sender = &request_senders[n_request_senders];
+  memset(sender, 0, sizeof(*sender));
+  if (!(sender->name = strdup(name)))
+    return NULL;
+  sender->window_start = now_ms;
+  n_request_senders++;
+  name_watch(name, 1);
+
+  return sender;
+}
+
+static void request_window_advance(request_sender *sender, int64 now_ms)
+{
+  int64 windows = (now_ms - sender->window_start)/REQUEST_WINDOW_MS;
+
+  if (windows <= 0)
+    return;
+
+  sender->previous = windows == 1 ? sender->current : 0;
+  sender->current = 0;
+  sender->window_start += windows*REQUEST_WINDOW_MS;
+}
+
+/* requests in the last minute, the previous window counts with the part
+ * of it that still overlaps */
+static uint32 request_rate(request_sender *sender, int64 now_ms)
+{
+  request_window_advance(sender, now_ms);
+  return sender->current +
+         sender->previous*(REQUEST_WINDOW_MS - (now_ms - sender->window_start))/REQUEST_WINDOW_MS;
+}
+
+/* counts the request, returns FALSE when the sender is over its limit */
+static int request_account(DBusMessage *message)
+{
+  const char *name = dbus_message_get_sender(message);
+  int64 now_ms = monotonic_time_ms();
+  request_sender *sender;
+  int allowed;
+
+  if (!name || !(sender = request_sender_get(name, now_ms)))
+    return TRUE;
+
+  allowed = !request_limit || request_rate(sender, now_ms) < request_limit;
+
+  sender->requests++;
+  sender->current++;
+  sender->last_ms = now_ms;
+
+  if (!allowed)
+  {
+    if (!sender->limited++)
+      log_print("%s exceeds %u requests per minute\n", name, request_limit);
+    request_stats.requests_limited++;
+  }
+
+  return allowed;
+}
+
+static DBusHandlerResult hald_addon_bme_request_stats(DBusConnection *connection, DBusMessage *message)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter, array, entry;
+  request_sender *top[REQUEST_SENDERS_MAX];
+  uint32 rates[REQUEST_SENDERS_MAX];
+  int64 now_ms = monotonic_time_ms();
+  unsigned int i, j;
+
+  log_print("got: BME_REQUEST_STATS_REQ\n");
+
+  if (dbus_message_get_no_reply(message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  reply = dbus_message_new_method_return(message);
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  /* by rate, then by total */
+  for (i = 0; i < n_request_senders; i++)
+  {
+    request_sender *sender = &request_senders[i];
+    uint32 rate = request_rate(sender, now_ms);
+
+    for (j = i; j > 0 && (rates[j-1] < rate ||
+                          (rates[j-1] == rate && top[j-1]->requests < sender->requests)); j--)
     {
-      if (is_charging)
-        capacity_state = OK;
-      else
-        capacity_state = FULL;
+      rates[j] = rates[j-1];
+      top[j] = top[j-1];
     }
+    rates[j] = rate;
+    top[j] = sender;
+  }
+
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(suuu)", &array);
+  for (i = 0; i < n_request_senders && i < REQUEST_TOP; i++)
+  {
+    const char *name = top[i]->name;
+
+    dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &name);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &top[i]->requests);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &rates[i]);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &top[i]->limited);
+    dbus_message_iter_close_container(&array, &entry);
+  }
+  dbus_message_iter_close_container(&iter, &array);
+
+  dbus_connection_send(connection, reply, 0);
+  dbus_message_unref(reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult hald_addon_bme_stats_info(DBusConnection *connection, DBusMessage *message)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter, dict;
+  const bme_hal_stats *hal_stats = bme_hal_get_stats();
+  dbus_bool_t breaker_open = hal_stats->breaker_open;
+  uint32 request_senders_count = n_request_senders;
+  uint32 subscribers_count = n_subscribers;
+
+  log_print("got: BME_STATS_INFO_REQ\n");
+
+  if (dbus_message_get_no_reply(message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  reply = dbus_message_new_method_return(message);
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+  append_dict_entry(&dict, BME_STAT_SIGNALS_SENT, DBUS_TYPE_UINT32, &signal_stats.signals_sent);
+  append_dict_entry(&dict, BME_STAT_SIGNAL_MESSAGES_BUILT, DBUS_TYPE_UINT32, &signal_stats.signal_messages_built);
+  append_dict_entry(&dict, BME_STAT_SIGNALS_DEFERRED, DBUS_TYPE_UINT32, &signal_stats.signals_deferred);
+  append_dict_entry(&dict, BME_STAT_GAUGE_PROPERTIES_READ, DBUS_TYPE_UINT32, &sysfs_stats.properties_read);
+  append_dict_entry(&dict, BME_STAT_POLLS_SKIPPED, DBUS_TYPE_UINT32, &sysfs_stats.polls_skipped);
+  append_dict_entry(&dict, BME_STAT_REQUEST_SENDERS, DBUS_TYPE_UINT32, &request_senders_count);
+  append_dict_entry(&dict, BME_STAT_REQUESTS_LIMITED, DBUS_TYPE_UINT32, &request_stats.requests_limited);
+  append_dict_entry(&dict, BME_STAT_SUBSCRIBERS, DBUS_TYPE_UINT32, &subscribers_count);
+  append_dict_entry(&dict, BME_STAT_SUBSCRIPTION_UPDATES, DBUS_TYPE_UINT32, &subscription_stats.updates_sent);
+  append_dict_entry(&dict, BME_STAT_LOOP_LAG_MS, DBUS_TYPE_UINT32, &loop_stats.lag_ms);
+  append_dict_entry(&dict, BME_STAT_LOOP_LAG_MAX_MS, DBUS_TYPE_UINT32, &loop_stats.lag_max_ms);
+  append_dict_entry(&dict, BME_STAT_POLL_MAX_MS, DBUS_TYPE_UINT32, &loop_stats.poll_max_ms);
+  append_dict_entry(&dict, BME_STAT_HAL_CALLS, DBUS_TYPE_UINT32, &hal_stats->calls);
+  append_dict_entry(&dict, BME_STAT_HAL_CALLS_FAILED, DBUS_TYPE_UINT32, &hal_stats->calls_failed);
+  append_dict_entry(&dict, BME_STAT_HAL_CALL_MAX_MS, DBUS_TYPE_UINT32, &hal_stats->call_max_ms);
+  append_dict_entry(&dict, BME_STAT_HAL_WRITES_SHED, DBUS_TYPE_UINT32, &hal_stats->writes_shed);
+  append_dict_entry(&dict, BME_STAT_HAL_WRITES_FLUSHED, DBUS_TYPE_UINT32, &hal_stats->writes_flushed);
+  append_dict_entry(&dict, BME_STAT_HAL_WRITES_UNCHANGED, DBUS_TYPE_UINT32, &hal_stats->writes_unchanged);
+  append_dict_entry(&dict, BME_STAT_HAL_WRITES_DEFERRED, DBUS_TYPE_UINT32, &hal_stats->writes_deferred);
+  append_dict_entry(&dict, BME_STAT_HAL_BREAKER_OPEN, DBUS_TYPE_BOOLEAN, &breaker_open);
+  dbus_message_iter_close_container(&iter, &dict);
+
+  dbus_connection_send(connection, reply, 0);
+  dbus_message_unref(reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult hald_addon_bme_diagnostics_info(DBusConnection *connection, DBusMessage *message)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter, dict;
+  time_t now = monotonic_time();
+  unsigned int i;
+
+  log_print("got: BME_DIAGNOSTICS_INFO_REQ\n");
+
+  if (dbus_message_get_no_reply(message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  reply = dbus_message_new_method_return(message);
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+  for (i = 0; i < N_ELEMENTS(diagnostic_properties); i++)
+  {
+    diagnostic_property *property = &diagnostic_properties[i];
+    const char *string = property->string;
+
+    hald_addon_bme_read_diagnostic(property, now);
+    if (!property->valid)
+      continue;
+
+    if (property->type == DBUS_TYPE_STRING)
+      append_dict_entry(&dict, property->key, DBUS_TYPE_STRING, &string);
     else
-      capacity_state = OK;
-  }
-  /* battery is not calibrated and no access to FC, EDV1 or EDVF flags */
-  /* use voltage threshold (if voltage is accessable) */
-  else if (!no_voltage)
-  {
-    if (battery_info->power_supply_voltage_now <= POWER_SUPPLY_VOLTAGE_THRESHOLD_EMPTY)
-      capacity_state = EMPTY;
-    else if (battery_info->power_supply_voltage_now <= POWER_SUPPLY_VOLTAGE_THRESHOLD_VERYLOW) {
-      very_low = 1;
-      capacity_state = LOW;
-    } else if (battery_info->power_supply_voltage_now <= POWER_SUPPLY_VOLTAGE_THRESHOLD_LOW)
-      capacity_state = LOW;
-    else if (battery_info->power_supply_voltage_now > POWER_SUPPLY_VOLTAGE_THRESHOLD_FULL)
+      append_dict_entry(&dict, property->key, property->type, &property->value);
+  }
+  dbus_message_iter_close_container(&iter, &dict);
+
+  dbus_connection_send(connection, reply, 0);
+  dbus_message_unref(reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult hald_addon_bme_dbus_proxy(DBusConnection *connection, DBusMessage *message)
+{
+  const char *member = dbus_message_get_member(message);
+  int type = dbus_message_get_type(message);
+
+  log_print("DBUS RECV: %s %s.%s\n\n", BME_REQUEST_PATH, BME_REQUEST_IF, dbus_message_type_to_string(type));
+
+  if (!request_account(message))
+    log_print("%s over the limit, no broadcast\n", member);
+  else if (!strcmp(member, BME_STATUS_INFO_REQ))
+  {
+    log_print("got: BME_STATUS_INFO_REQ\n");
+    hald_addon_bme_status_info();
+  }
+  else
+  {
+    log_print("got: BME_TIMELEFT_INFO_REQ\n");
+    hald_addon_bme_timeleft_info();
+  }
+
+  if(type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+  {
+    if ( !dbus_message_get_no_reply(message) )
     {
-      if (is_charging)
-        capacity_state = OK;
-      else
-        capacity_state = FULL;
+      DBusMessage * msg = dbus_message_new_method_return(message);
+      if ( msg )
+      {
+        dbus_connection_send(connection, msg, 0);
+        dbus_message_unref(msg);
+      }
     }
-    else
-      capacity_state = OK;
   }
-  else /* we do not know anything, report OK which will prevent device shutdown */
-    capacity_state = OK;
 
-  if (battery_info->power_supply_status == STATUS_FULL)
-    capacity_state = FULL;
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static int hald_addon_bme_setup_dbus_proxy()
+{
+  DBusError error;
+  int result = -1;
+
+  dbus_error_init(&error);
+
+  system_dbus = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
+  if(!system_dbus)
+    goto error;
+  else
+  {
+    bme_loop_setup_connection(system_dbus);
+    dbus_connection_set_exit_on_disconnect(system_dbus, FALSE);
+    if ( !dbus_bus_request_name(system_dbus,
+                               BME_SERVICE,
+                               DBUS_REQUEST_NAME_REPLY_ALREADY_OWNER,
+                               &error))
+    {
+      if ( dbus_error_is_set(&error) )
+        goto dbus_error;
+    }
+  }
+  result = 0;
+  goto out;
+error:
+  log_print("proxy_init");
+  goto out;
+dbus_error:
+    log_print("proxy_init %s: %s\n",error.name,error.message);
+out:
+  dbus_error_free(&error);
+  return result;
+}
+
+static const char * get_capacity_state_string()
+{
+  switch(global_bme.charge_level.capacity_state)
+  {
+    case BME_CAPACITY_LOW:return "low";
+    case BME_CAPACITY_FULL:return "full";
+    case BME_CAPACITY_EMPTY:return "empty";
+    default:return "ok";
+  }
+}
+
+static void hald_addon_bme_announce_capacity_state(bme_capacity_state capacity_state)
+{
+  global_bme.charge_level.capacity_state = capacity_state;
+  capacity_state_announced = 1;
+  log_print("capacity state changed to %s\n", get_capacity_state_string());
+
+  /* EMPTY starts the shutdown deadline, do not queue it behind hald round trips */
+  if (capacity_state == BME_CAPACITY_EMPTY)
+    send_capacity_state_change();
+
+  /* Before changing capacity_state to new value, battery status area plugin needs empty string first */
+  bme_hal_set_string("battery.charge_level.capacity_state", "", BME_HAL_CRITICAL);
+  bme_hal_set_string("battery.charge_level.capacity_state", get_capacity_state_string(), BME_HAL_CRITICAL);
+
+  if (capacity_state != BME_CAPACITY_EMPTY)
+    send_capacity_state_change();
+}
+
+static void hald_addon_bme_set_emergency(int emergency);
+
+/* maemo.charger.type by bme_charger */
+static const char * const charger_types[] = {
+  "none",
+  "host 100 mA",
+  "host 500 mA",
+  "wall charger",
+};
+
+static void hald_addon_bme_set_static_properties(void)
+{
+  bme_hal_set_int("battery.charge_level.design", 8, 0);
+  bme_hal_set_string("battery.charge_level.unit", "bars", 0);
+  bme_hal_set_bool("battery.is_rechargeable", TRUE, 0);
+  bme_hal_set_bool("battery.present", TRUE, 0);
+  bme_hal_set_bool("battery.remaining_time.calculate_per_time", FALSE, 0);
+  bme_hal_set_string("battery.reporting.unit", "mAh", 0);
+  bme_hal_set_string("battery.type", "pda", 0);
+  bme_hal_set_string("battery.voltage.unit", "mV", 0);
+  bme_hal_set_string("maemo.bme.version", "1.0", 0);
+}
+
+/* When the addon is restarted under a running hald, the device still has
+ * what the previous instance published. That is taken as the published
+ * state, so the first poll only writes and signals real differences
+ * instead of placeholders, charger signals and the dsme charger state
+ * all over again. Returns FALSE when there is nothing to start from. */
+static int hald_addon_bme_reconcile_hal(void)
+{
+  const char *value;
+  int32 level;
+  int flag;
+  int n;
+
+  n = bme_hal_load();
+  if (!bme_hal_get_string("maemo.charger.connection_status", &value))
+  {
+    log_print("cold start, %d properties on the device\n", n);
+    return FALSE;
+  }
+
+  log_print("warm restart, reconciling %d properties\n", n);
 
-  if ((capacity_state == LOW || capacity_state == EMPTY) && charger_connected)
-    capacity_state = OK;
+  global_charger_connected = !strcmp(value, "connected");
+  if (bme_hal_get_bool("battery.rechargeable.is_charging", &flag))
+    global_is_charging = flag;
+  if (bme_hal_get_int("battery.charge_level.current", &level))
+    global_bme.charge_level.current = level;
+  if (bme_hal_get_int("battery.charge_level.percentage", &level))
+    global_bme.charge_level.percentage = level;
 
-  if (capacity_state == FULL)
-    global_is_full = 1;
-  else if (!charger_connected)
-    global_is_full = 0;
+  /* EMPTY is announced again, it starts the shutdown deadline */
+  if (bme_hal_get_string("battery.charge_level.capacity_state", &value) &&
+      (!strcmp(value, "ok") || !strcmp(value, "low") || !strcmp(value, "full")))
+  {
+    global_bme.charge_level.capacity_state = !strcmp(value, "low") ? BME_CAPACITY_LOW : !strcmp(value, "full") ? BME_CAPACITY_FULL : BME_CAPACITY_OK;
+    policy_state.capacity_state = global_bme.charge_level.capacity_state;
+    policy_state.announced = monotonic_time();
+    policy_state.announced_capacity = global_bme.charge_level.percentage;
+    policy_state.full_charger_connected = policy_state.capacity_state == BME_CAPACITY_FULL && global_charger_connected;
+  }
 
-  if (global_is_full)
-    capacity_state = FULL;
+  get_properties(&published_properties);
+  published_properties_valid = 1;
+
+  return TRUE;
+}
 
-  if (capacity_state == FULL && !calibrated)
+static int hald_addon_bme_update_hal(battery * battery_info,int check_for_changes)
+{
+#define CHECK_INT(f,fun) do { \
+  if( !check_for_changes || (global_battery.f != battery_info->f)) \
+    log_print(#f " changed,updating to %d",battery_info->f);fun; \
+  } while ( 0 )
+
+  bme_policy_result result;
+  uint32 charge_level_current;
+  bme_capacity_state capacity_state;
+  int calibrated;
+  int charger_connected;
+  int is_charging;
+  int positive_rate;
+  int capacity;
+  time_t now = monotonic_time();
+
+  bme_policy_evaluate(&policy_params, &policy_state, battery_info, now, &result);
+  *battery_info = result.battery;
+  calibrated = result.calibrated;
+  charger_connected = result.charger_connected;
+  is_charging = result.is_charging;
+  positive_rate = result.positive_rate;
+  capacity = result.capacity;
+  capacity_state = result.capacity_state;
+  charge_level_current = result.charge_level_current;
+
+  /* the initial update only publishes, announcements start with the first poll */
+  if (check_for_changes)
+    policy_state = result.next;
+  else
+    policy_state.is_full = result.next.is_full;
+
+  if (empty_shutdown_timer && charger_connected)
   {
-    battery_info->power_supply_capacity = 100;
-    capacity = 100;
+    log_print("charger connected, shutdown cancelled\n");
+    bme_loop_source_remove(empty_shutdown_timer);
+    empty_shutdown_timer = 0;
   }
 
-  if (very_low)
-    capacity = 0;
+  if (check_for_changes)
+    hald_addon_bme_set_emergency(result.emergency);
+
+  if (check_for_changes && result.announce && capacity_state == BME_CAPACITY_EMPTY)
+    hald_addon_bme_announce_capacity_state(capacity_state);
 
-  if(check_for_changes && (
-       global_bme.charge_level.capacity_state != capacity_state ||
-       capacity_state == FULL ||
-       capacity_state == EMPTY ||
-       (capacity_state == LOW && battery_info->power_supply_capacity != global_battery.power_supply_capacity && battery_info->power_supply_capacity%2 == 0) ||
-       (capacity == 0 && battery_info->power_supply_capacity != global_battery.power_supply_capacity)
-    ))
+  if(!check_for_changes)
   {
-    global_bme.charge_level.capacity_state = capacity_state;
-    log_print("capacity state changed to %s\n", get_capacity_state_string());
-    /* Before changing capacity_state to new value, battery status area plugin needs empty string first */
-    libhal_device_set_property_string(hal_ctx, udi, "battery.charge_level.capacity_state", "", NULL);
-    libhal_device_set_property_string(hal_ctx, udi, "battery.charge_level.capacity_state", get_capacity_state_string(), NULL);
-    send_capacity_state_change();
+    bme_hal_set_string("battery.charge_level.capacity_state", "ok", BME_HAL_CRITICAL);
+    bme_hal_set_int("battery.charge_level.current", 0, 0);
+    bme_hal_set_int("battery.charge_level.last_full", 0, 0);
+    bme_hal_set_int("battery.charge_level.percentage", 0, 0);
+    bme_hal_set_bool("battery.rechargeable.is_charging", FALSE, 0);
+    bme_hal_set_bool("battery.rechargeable.is_discharging", TRUE, 0);
+    bme_hal_set_int("battery.remaining_time", 0, 0);
+    bme_hal_set_int("battery.reporting.current", 0, 0);
+    bme_hal_set_int("battery.reporting.design", 0, 0);
+    bme_hal_set_int("battery.reporting.last_full", 0, 0);
+    bme_hal_set_int("battery.voltage.current", 0, 0);
+    bme_hal_set_int("battery.voltage.design", 4200, 0);
+    bme_hal_set_string("maemo.charger.connection_status", "disconnected", 0);
+    bme_hal_set_string("maemo.charger.type", "none", 0);
+    bme_hal_set_string("maemo.rechargeable.charging_status", "off", 0);
+    bme_hal_set_bool("maemo.rechargeable.positive_rate", FALSE, 0);
+    hald_addon_bme_set_static_properties();
   }
 
+  CHECK_INT(power_supply_voltage_now,
+        bme_hal_set_int("battery.voltage.current", battery_info->power_supply_voltage_now, BME_HAL_DEFERRABLE));
+
+  CHECK_INT(power_supply_voltage_design,
+        bme_hal_set_int("battery.voltage.design", battery_info->power_supply_voltage_design, 0));
+
+  CHECK_INT(power_supply_charge_design,
+        bme_hal_set_int("battery.reporting.design", battery_info->power_supply_charge_design, 0));
+
+  if(check_for_changes && result.announce && capacity_state != BME_CAPACITY_EMPTY)
+    hald_addon_bme_announce_capacity_state(capacity_state);
+
   if (!check_for_changes || (global_battery.power_supply_capacity != battery_info->power_supply_capacity)) {
     log_print("power_supply_capacity changed,updating to %d", battery_info->power_supply_capacity);
     global_battery.power_supply_capacity = battery_info->power_supply_capacity;
   }
 
   CHECK_INT(capacity,
-    libhal_device_set_property_int(hal_ctx, udi, "battery.charge_level.percentage", capacity, NULL));
+    bme_hal_set_int("battery.charge_level.percentage", capacity, BME_HAL_DEFERRABLE));
+  global_bme.charge_level.percentage = capacity;
 
-  if (capacity_state == FULL && charger_connected)
+  if (capacity_state == BME_CAPACITY_FULL && charger_connected)
   {
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.rechargeable.charging_status", "full", NULL);
-    libhal_device_set_property_bool(hal_ctx, udi, "battery.rechargeable.is_discharging", TRUE, NULL);
-    libhal_device_set_property_bool(hal_ctx, udi, "battery.rechargeable.is_charging", TRUE, NULL);
-    libhal_device_set_property_bool(hal_ctx, udi, "maemo.rechargeable.positive_rate", TRUE, NULL);
+    bme_hal_set_string("maemo.rechargeable.charging_status", "full", 0);
+    bme_hal_set_bool("battery.rechargeable.is_discharging", TRUE, 0);
+    bme_hal_set_bool("battery.rechargeable.is_charging", TRUE, 0);
+    bme_hal_set_bool("maemo.rechargeable.positive_rate", TRUE, 0);
   }
   else
   {
     if (charger_connected && !is_charging)
-      libhal_device_set_property_string(hal_ctx, udi, "maemo.rechargeable.charging_status", "error", NULL);
+      bme_hal_set_string("maemo.rechargeable.charging_status", "error", 0);
     else
-      libhal_device_set_property_string(hal_ctx, udi, "maemo.rechargeable.charging_status", is_charging ? "on" : "off", NULL);
-    libhal_device_set_property_bool(hal_ctx, udi, "maemo.rechargeable.positive_rate", positive_rate, NULL);
-    libhal_device_set_property_bool(hal_ctx, udi, "battery.rechargeable.is_discharging", !is_charging, NULL);
-    libhal_device_set_property_bool(hal_ctx, udi, "battery.rechargeable.is_charging", is_charging, NULL);
+      bme_hal_set_string("maemo.rechargeable.charging_status", is_charging ? "on" : "off", 0);
+    bme_hal_set_bool("maemo.rechargeable.positive_rate", positive_rate, 0);
+    bme_hal_set_bool("battery.rechargeable.is_discharging", !is_charging, 0);
+    bme_hal_set_bool("battery.rechargeable.is_charging", is_charging, 0);
   }
 
-  if (!calibrated && battery_info->power_supply_charge_design)
-    battery_info->power_supply_charge_now = capacity*battery_info->power_supply_charge_design/100;
-
   CHECK_INT(power_supply_charge_now,
-        libhal_device_set_property_int (hal_ctx, udi, "battery.reporting.current", battery_info->power_supply_charge_now, NULL));
+        bme_hal_set_int("battery.reporting.current", battery_info->power_supply_charge_now, BME_HAL_DEFERRABLE));
 
   if (calibrated)
   {
@@ -961,40 +2056,47 @@ static gboolean hald_addon_bme_update_hal(battery * battery_info,gboolean check_
       if (battery_info->power_supply_charge_full <= battery_info->power_supply_charge_design)
       {
         CHECK_INT(power_supply_charge_full,
-              libhal_device_set_property_int (hal_ctx, udi, "battery.charge_level.last_full", 8*battery_info->power_supply_charge_full/battery_info->power_supply_charge_design, NULL));
+              bme_hal_set_int("battery.charge_level.last_full", 8*battery_info->power_supply_charge_full/battery_info->power_supply_charge_design, 0));
       }
       else
       {
         CHECK_INT(power_supply_charge_full,
-              libhal_device_set_property_int (hal_ctx, udi, "battery.charge_level.last_full", 8, NULL));
+              bme_hal_set_int("battery.charge_level.last_full", 8, 0));
       }
     }
     CHECK_INT(power_supply_charge_full,
-          libhal_device_set_property_int (hal_ctx, udi, "battery.reporting.last_full", battery_info->power_supply_charge_full, NULL));
+          bme_hal_set_int("battery.reporting.last_full", battery_info->power_supply_charge_full, 0));
   }
   else
   {
-    battery_info->power_supply_charge_full = 0;
     CHECK_INT(power_supply_charge_full,
-          libhal_device_set_property_int (hal_ctx, udi, "battery.reporting.last_full", 0, NULL);
-          libhal_device_set_property_int (hal_ctx, udi, "battery.charge_level.last_full", 0, NULL));
+          bme_hal_set_int("battery.reporting.last_full", 0, 0);
+          bme_hal_set_int("battery.charge_level.last_full", 0, 0));
   }
 
-  charge_level_current = 8*(6.25+capacity)/100;
   if(global_bme.charge_level.current != charge_level_current)
   {
     global_bme.charge_level.current = charge_level_current;
-    if (capacity_state != EMPTY)
+    if (capacity_state != BME_CAPACITY_EMPTY)
     {
-      libhal_device_set_property_int (hal_ctx, udi, "battery.charge_level.current",charge_level_current, NULL);
-      send_battery_state_changed(charge_level_current);
+      bme_hal_set_int("battery.charge_level.current", charge_level_current, BME_HAL_DEFERRABLE);
+      if (display_off_deferring())
+      {
+        battery_state_deferred = 1;
+        signal_stats.signals_deferred++;
+      }
+      else
+      {
+        battery_state_deferred = 0;
+        send_battery_state_changed(charge_level_current);
+      }
     }
   }
 
   if (!calibrated)
   {
       if (global_battery.power_supply_time_to_empty_avg != 0 || global_battery.power_supply_time_to_full_now != 0)
-        libhal_device_set_property_int (hal_ctx, udi, "battery.remaining_time", 0, NULL);
+        bme_hal_set_int("battery.remaining_time", 0, BME_HAL_DEFERRABLE);
       global_battery.power_supply_time_to_empty_avg = 0;
       global_battery.power_supply_time_to_empty_idle = 0;
       global_battery.power_supply_time_to_full_now = 0;
@@ -1006,47 +2108,28 @@ static gboolean hald_addon_bme_update_hal(battery * battery_info,gboolean check_
       global_battery.power_supply_time_to_empty_avg = 0;
       global_battery.power_supply_time_to_empty_idle = 0;
       CHECK_INT(power_supply_time_to_full_now,
-            libhal_device_set_property_int (hal_ctx, udi, "battery.remaining_time", battery_info->power_supply_time_to_full_now, NULL));
+            bme_hal_set_int("battery.remaining_time", battery_info->power_supply_time_to_full_now, BME_HAL_DEFERRABLE));
     }
     else if (battery_info->power_supply_status == STATUS_DISCHARGING)
     {
       global_battery.power_supply_time_to_full_now = 0;
       if (global_battery.power_supply_time_to_empty_idle != battery_info->power_supply_time_to_empty_idle)
         global_battery.power_supply_time_to_empty_idle = battery_info->power_supply_time_to_empty_idle;
-      if (battery_info->power_supply_time_to_empty_avg > battery_info->power_supply_time_to_empty_idle && battery_info->power_supply_time_to_empty_idle)
-        battery_info->power_supply_time_to_empty_avg = battery_info->power_supply_time_to_empty_idle;
       CHECK_INT(power_supply_time_to_empty_avg,
-            libhal_device_set_property_int (hal_ctx, udi, "battery.remaining_time", battery_info->power_supply_time_to_empty_avg, NULL));
+            bme_hal_set_int("battery.remaining_time", battery_info->power_supply_time_to_empty_avg, BME_HAL_DEFERRABLE));
     }
   }
 
-  if (strstr(battery_info->power_supply_mode, "none"))
-  {
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.charger.connection_status", "connected", NULL);
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.charger.type", "host 100 mA", NULL);
-  }
-  else if (strstr(battery_info->power_supply_mode, "host"))
-  {
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.charger.connection_status", "connected", NULL);
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.charger.type", "host 500 mA", NULL);
-  }
-  else if (strstr(battery_info->power_supply_mode, "dedicated"))
-  {
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.charger.connection_status", "connected", NULL);
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.charger.type", "wall charger", NULL);
-  }
-  else
-  {
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.charger.connection_status", "disconnected", NULL);
-    libhal_device_set_property_string(hal_ctx, udi, "maemo.charger.type", "none", NULL);
-  }
+  bme_hal_set_string("maemo.charger.connection_status",
+                     battery_info->charger != CHARGER_NONE ? "connected" : "disconnected", 0);
+  bme_hal_set_string("maemo.charger.type", charger_types[battery_info->charger], 0);
 
   if (!check_for_changes || global_charger_connected != charger_connected)
   {
     DSM_MSGTYPE_SET_CHARGER_STATE msg =
       DSME_MSG_INIT(DSM_MSGTYPE_SET_CHARGER_STATE);
     global_charger_connected = charger_connected;
-    send_dbus_signal_(charger_connected ? "charger_connected" : "charger_disconnected");
+    send_dbus_signal_(charger_connected ? SIGNAL_CHARGER_CONNECTED : SIGNAL_CHARGER_DISCONNECTED);
     msg.connected = charger_connected;
     dsmesock_send(dsme_conn, &msg);
   }
@@ -1054,19 +2137,21 @@ static gboolean hald_addon_bme_update_hal(battery * battery_info,gboolean check_
   if (!check_for_changes || global_is_charging != is_charging)
   {
     global_is_charging = is_charging;
-    if (capacity_state != FULL || !is_charging)
-      send_dbus_signal_(is_charging ? "charger_charging_on" : "charger_charging_off");
+    if (capacity_state != BME_CAPACITY_FULL || !is_charging)
+      send_dbus_signal_(is_charging ? SIGNAL_CHARGER_CHARGING_ON : SIGNAL_CHARGER_CHARGING_OFF);
   }
 
+  bme_upower_update(&result, global_bme.charge_level.capacity_state);
+
   return TRUE;
 }
 
-static gboolean mce_request(const char * argument, const char * request)
+static int mce_request(const char * argument, const char * request)
 {
   DBusMessage * msg;
   int sent = 0;
 
-  msg = dbus_message_new_method_call("com.nokia.mce", "/com/nokia/mce/request", "com.nokia.mce.request", request);
+  msg = dbus_message_new_method_call(MCE_SERVICE, MCE_REQUEST_PATH, MCE_REQUEST_IF, request);
   if (!msg)
     return FALSE;
 
@@ -1084,30 +2169,90 @@ static gboolean mce_request(const char * argument, const char * request)
   return TRUE;
 }
 
-static gboolean poll_uevent(gpointer data)
+/* work a poll has to do even when its input did not change */
+static int poll_time_pending(time_t now)
 {
-  gboolean boost;
-  battery battery_info;
+  if (!poll_snapshot.settled || archive_due(now))
+    return TRUE;
+
+  /* shed writes are only flushed by the next write */
+  if (bme_hal_get_stats()->breaker_open)
+    return TRUE;
+
+  return FALSE;
+}
+
+static int poll_uevent(void *data)
+{
+  static sysfs_source bq27200_uevent, bq27200_registers, rx51_uevent;
+  uint64_t hash = 14695981039346656037ULL;
+  time_t now = time(NULL);
+  int boost;
+  battery battery_info, sample;
   memset(&battery_info, 0, sizeof(battery_info));
   battery_info.power_supply_capacity = -1;
   battery_info.power_supply_flags_register = -1;
-  strcpy(battery_info.power_supply_mode, global_battery.power_supply_mode);
+  battery_info.charger = global_battery.charger;
+  battery_info.boost = global_battery.boost;
 
   log_print("poll_uevent");
 
-  hald_addon_bme_get_bq27200_data(&battery_info);
-  hald_addon_bme_get_bq27200_registers(&battery_info);
-  hald_addon_bme_get_rx51_data(&battery_info);
+  if (sysfs_root)
+    hald_addon_bme_get_bq24150a_mode(&battery_info);
+
+  hald_addon_bme_read_source(bq27200_registers_path, &bq27200_registers);
+  hash = hash_source(hash, &bq27200_registers);
 
-  /* set negative fake current now which means that battery is charging */
-  if (force_charging > time(NULL))
-     battery_info.power_supply_current_now = -1;
+  if (sysfs_attributes)
+  {
+    /* the attributes are parsed as they are read */
+    hald_addon_bme_get_attributes(&battery_info);
+    hash = hash_bytes(hash, &battery_info, sizeof(battery_info));
+  }
+  else
+  {
+    hald_addon_bme_read_source(bq27200_uevent_path, &bq27200_uevent);
+    hald_addon_bme_read_source(rx51_uevent_path, &rx51_uevent);
+    hash = hash_source(hash, &bq27200_uevent);
+    hash = hash_source(hash, &rx51_uevent);
+    hash = hash_bytes(hash, &battery_info.charger, sizeof(battery_info.charger));
+    hash = hash_bytes(hash, &battery_info.boost, sizeof(battery_info.boost));
+  }
+
+  if (poll_snapshot.valid && poll_snapshot.hash == hash && !poll_time_pending(now))
+  {
+    log_print("poll_uevent: unchanged");
+    sysfs_stats.polls_skipped++;
+    return data ? FALSE : TRUE;
+  }
+
+  if (sysfs_attributes)
+    hald_addon_bme_get_bq27200_registers(&battery_info, &bq27200_registers);
+  else
+  {
+    hald_addon_bme_get_bq27200_data(&battery_info, &bq27200_uevent);
+    hald_addon_bme_get_bq27200_registers(&battery_info, &bq27200_registers);
+    hald_addon_bme_get_rx51_data(&battery_info, &rx51_uevent);
+  }
+
+  energy_account_sample(&battery_info);
+  sample = battery_info;
 
   hald_addon_bme_update_hal(&battery_info,TRUE);
 
+  /* may write to flash, so only after the state is published */
+  archive_sample(&sample);
+
+  poll_snapshot.valid = 1;
+  poll_snapshot.hash = hash;
+  poll_snapshot.time = now;
+  poll_snapshot.settled = bme_policy_settled(&policy_params, &policy_state, &sample);
+
   memcpy(&global_battery,&battery_info,sizeof(global_battery));
 
-  boost = (gboolean)strstr(global_battery.power_supply_mode, "boost");
+  send_state_changed();
+
+  boost = global_battery.boost;
 
   if (global_boost != boost)
   {
@@ -1123,50 +2268,150 @@ static gboolean poll_uevent(gpointer data)
   return TRUE;
 }
 
-static gboolean hald_addon_bme_bq24150a_setup_poll(gpointer data);
+/* the regular poll, also measures how late the main loop runs it; seconds
+ * timers may be coalesced, so up to a second of lag is normal */
+static int poll_periodic(void *data UNUSED)
+{
+  int64 now_ms = monotonic_time_ms();
+  int64 lag_ms = now_ms - loop_stats.next_poll_ms;
+  int64 poll_ms;
+
+  if (lag_ms < 0)
+    lag_ms = 0;
+  loop_stats.lag_ms = lag_ms;
+  if (loop_stats.lag_max_ms < lag_ms)
+    loop_stats.lag_max_ms = lag_ms;
+  if (lag_ms > LOOP_LAG_WARNING)
+    log_print("poll ran %d ms late\n", (int)lag_ms);
+
+  poll_uevent(NULL);
+
+  poll_ms = monotonic_time_ms() - now_ms;
+  if (loop_stats.poll_max_ms < poll_ms)
+    loop_stats.poll_max_ms = poll_ms;
+
+  loop_stats.next_poll_ms = monotonic_time_ms() + (int64)poll_period*1000;
+  return TRUE;
+}
+
+static int poll_emergency(void *data UNUSED)
+{
+  if (emergency_mode)
+    poll_uevent(NULL);
+
+  /* left emergency mode, possibly in the poll above */
+  if (!emergency_mode)
+  {
+    emergency_timer = 0;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* near empty, poll_period is too coarse to catch EDVF or the charger in
+ * time, so sample densely until the battery recovers or a charger shows up */
+static void hald_addon_bme_set_emergency(int emergency)
+{
+  if (emergency == emergency_mode)
+    return;
+
+  emergency_mode = emergency;
+  log_print("emergency mode %s\n", emergency ? "on" : "off");
+
+  if (emergency && !emergency_timer)
+    emergency_timer = bme_loop_timeout_add(EMERGENCY_POLL_PERIOD, poll_emergency, NULL);
+}
+
+static int hald_addon_bme_bq24150a_setup_poll(void *data);
+
+/* sysfs only signals the next change after the attribute was read again
+ * from the start */
+static int hald_addon_bme_bq24150a_read_mode(int fd)
+{
+  char mode[32];
+  ssize_t len;
+
+  if (lseek(fd, 0, SEEK_SET) < 0)
+    return -1;
+  len = read(fd, mode, sizeof(mode)-1);
+  if (len <= 0)
+    return -1;
+  mode[len] = 0;
+  bq24150a_charger = bme_charger_parse_mode(mode, &global_battery.boost);
+  global_battery.charger = hald_addon_bme_charger();
+  return 0;
+}
+
+/* hald stops addons with SIGTERM, leave the main loop so the archive
+ * tail that is only in memory gets written. SIGUSR1 polls right away,
+ * for tests and debugging. */
+static int hald_addon_bme_signal(int fd, unsigned int events UNUSED, void *data UNUSED)
+{
+  struct signalfd_siginfo info;
+
+  if (read(fd, &info, sizeof(info)) != sizeof(info))
+    return TRUE;
+
+  log_print("signal %u\n", info.ssi_signo);
+  if (info.ssi_signo == SIGUSR1)
+  {
+    poll_uevent(NULL);
+    return TRUE;
+  }
+
+  close(fd);
+  bme_loop_quit();
+  return FALSE;
+}
+
+static void hald_addon_bme_setup_signals(void)
+{
+  sigset_t set;
+  int fd;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGUSR1);
+
+  if (sigprocmask(SIG_BLOCK, &set, NULL) < 0 ||
+      (fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+  {
+    log_print("signalfd: %s\n", strerror(errno));
+    return;
+  }
+
+  if (!bme_loop_io_add(fd, BME_LOOP_IN, hald_addon_bme_signal, NULL))
+    close(fd);
+}
 
-static gboolean hald_addon_bme_bq24150a_cb(GIOChannel *source, GIOCondition condition, gpointer data G_GNUC_UNUSED)
+/* plug-in and removal, straight from the uevent */
+static void hald_addon_bme_charger_changed(bme_charger charger)
 {
-  GIOStatus ret;
-  gchar *line = NULL;
-  gsize len;
-  GError *gerror = NULL;
+  log_print("charger changed to %s\n", charger_types[charger]);
+  global_battery.charger = charger;
+  poll_uevent(NULL);
+}
 
+static int hald_addon_bme_bq24150a_cb(int fd, unsigned int events, void *data UNUSED)
+{
   log_print("hald_addon_bme_bq24150a_cb");
 
-  if (condition & G_IO_IN || condition & G_IO_PRI)
+  if (events & (BME_LOOP_IN | BME_LOOP_PRI))
   {
-    ret = g_io_channel_read_line(source, &line, &len, NULL, &gerror);
-    g_io_channel_seek_position(source, 0, G_SEEK_SET, &gerror);
-    if (line)
+    if (hald_addon_bme_bq24150a_read_mode(fd) == 0)
     {
-      strncpy(global_battery.power_supply_mode, line, sizeof(global_battery.power_supply_mode)-1);
-      g_free(line);
-      /* force charging for next 10s */
-      force_charging = time(NULL)+10;
       poll_uevent(NULL);
       return TRUE;
     }
-    log_print("Error");
-    g_io_channel_unref(source);
-    g_timeout_add_seconds(60,hald_addon_bme_bq24150a_setup_poll,NULL);
-    return FALSE;
-  }
-  else if (condition & G_IO_ERR || condition & G_IO_HUP || condition & G_IO_NVAL)
-  {
-    log_print("Error");
-    g_io_channel_unref(source);
-    g_timeout_add_seconds(60,hald_addon_bme_bq24150a_setup_poll,NULL);
-    return FALSE;
-  }
-  else
-  {
-    log_print("unknown GIOCondition: %d", condition);
-    g_io_channel_unref(source);
-    g_timeout_add_seconds(60,hald_addon_bme_bq24150a_setup_poll,NULL);
-    return FALSE;
   }
+  else if (!(events & (BME_LOOP_ERR | BME_LOOP_HUP)))
+    log_print("unknown events: %u", events);
 
+  log_print("Error");
+  close(fd);
+  bme_loop_timeout_add_seconds(60,hald_addon_bme_bq24150a_setup_poll,NULL);
   return FALSE;
 }
 
@@ -1174,9 +2419,9 @@ static int hald_addon_bme_disable_stat_pin(void)
 {
   FILE * fp;
   int ret;
-  if((fp = fopen(BQ24150A_STAT_PIN_FILE_PATH,"w")) == NULL)
+  if((fp = fopen(bq24150a_stat_pin_path,"w")) == NULL)
   {
-    log_print("unable to open %s(%s)\n",BQ24150A_STAT_PIN_FILE_PATH,strerror(errno));
+    log_print("unable to open %s(%s)\n",bq24150a_stat_pin_path,strerror(errno));
     return -1;
   }
   log_print("disabling stat pin\n");
@@ -1188,50 +2433,27 @@ static int hald_addon_bme_disable_stat_pin(void)
     return 0;
 }
 
-static gboolean hald_addon_bme_bq24150a_setup_poll(gpointer data G_GNUC_UNUSED)
+static int hald_addon_bme_bq24150a_setup_poll(void *data UNUSED)
 {
-  GIOChannel *gioch;
-  GError *error = NULL;
-  gsize len;
-  gchar *line = NULL;
-  GIOStatus ret;
+  int fd;
 
   log_print("calling hald_addon_bme_bq24150a_setup_poll\n");
 
-  gioch = g_io_channel_new_file(BQ24150A_MODE_FILE_PATH, "r", &error);
-  if (gioch == NULL)
+  if ((fd = open(bq24150a_mode_path, O_RDONLY)) < 0)
   {
-    log_print("g_io_channel_new_file() for %s failed: %s", BQ24150A_MODE_FILE_PATH, error->message);
-    g_error_free(error);
-    g_timeout_add_seconds(60,hald_addon_bme_bq24150a_setup_poll,NULL);
+    log_print("unable to open %s(%s)\n",bq24150a_mode_path,strerror(errno));
+    bme_loop_timeout_add_seconds(60,hald_addon_bme_bq24150a_setup_poll,NULL);
     return FALSE;
   }
 
-  ret = g_io_channel_read_line(gioch, &line, &len, NULL, &error);
-  if (line) {
-    strncpy(global_battery.power_supply_mode, line, sizeof(global_battery.power_supply_mode)-1);
-    g_free(line);
-  }
-
-  /* Have to read the contents even though it's not used */
-  ret = g_io_channel_read_to_end(gioch, &line, &len, &error);
-  if (ret == G_IO_STATUS_NORMAL)
-    g_free(line);
-
-  if (error != NULL) {
-    log_print("g_io_channel_read_to_end(): %s", error->message);
-    g_error_free (error);
-  }
+  if (hald_addon_bme_bq24150a_read_mode(fd) < 0)
+    log_print("unable to read %s(%s)\n",bq24150a_mode_path,strerror(errno));
 
-  g_io_channel_seek_position(gioch, 0, G_SEEK_SET, &error);
-  if (error != NULL){
-    log_print("g_io_channel_seek_position(): %s", error->message);
-    g_error_free (error);
-  }
-
-  if ( g_io_add_watch(gioch, G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_HUP | G_IO_NVAL, hald_addon_bme_bq24150a_cb, NULL) == 0 )
+  /* changes are signalled as POLLPRI|POLLERR */
+  if ( bme_loop_io_add(fd, BME_LOOP_PRI, hald_addon_bme_bq24150a_cb, NULL) == 0 )
   {
-    g_timeout_add_seconds(60,hald_addon_bme_bq24150a_setup_poll,NULL);
+    close(fd);
+    bme_loop_timeout_add_seconds(60,hald_addon_bme_bq24150a_setup_poll,NULL);
     return FALSE;
   }
 
@@ -1245,40 +2467,44 @@ static gboolean hald_addon_bme_bq24150a_setup_poll(gpointer data G_GNUC_UNUSED)
   return FALSE;
 }
 
-static DBusHandlerResult hald_addon_bme_mce_signal(DBusConnection *connection G_GNUC_UNUSED, DBusMessage *message, void *user_data G_GNUC_UNUSED)
+/* the batch of everything held back while the display was off */
+static void hald_addon_bme_display_off(int off)
+{
+  if (!display_off_defer || !!off == display_off)
+    return;
+
+  display_off = !!off;
+  bme_hal_defer(display_off);
+  if (display_off)
+    return;
+
+  if (battery_state_deferred && global_bme.charge_level.capacity_state != BME_CAPACITY_EMPTY)
+    send_battery_state_changed(global_bme.charge_level.current);
+  battery_state_deferred = 0;
+  send_state_changed();
+}
+
+static DBusHandlerResult hald_addon_bme_mce_signal(DBusConnection *connection UNUSED, DBusMessage *message)
 {
-  const char *interface, *member, *path;
-  int type;
   DBusError error;
+  const char * tmp = 0, *status = "NULL";
 
   dbus_error_init(&error);
 
-  interface = dbus_message_get_interface(message);
-  member = dbus_message_get_member(message);
-  path = dbus_message_get_path(message);
+  dbus_message_get_args(message,
+                        &error,
+                        DBUS_TYPE_STRING,
+                        &tmp,
+                        DBUS_TYPE_INVALID);
+  if(tmp)
+    status = tmp;
 
-  type = dbus_message_get_type(message);
-  if(interface &&
-     member &&
-     path &&
-     type == DBUS_MESSAGE_TYPE_SIGNAL &&
-     !strcmp(interface, "com.nokia.mce.signal") &&
-     !strcmp(path, "/com/nokia/mce/signal") &&
-     !strcmp(member, "display_status_ind"))
-  {
-    const char * tmp = 0, *status = "NULL";
-    dbus_message_get_args(message,
-                          &error,
-                          DBUS_TYPE_STRING,
-                          &tmp,
-                          DBUS_TYPE_INVALID);
-    if(tmp)
-      status = tmp;
-
-    log_print("MCE RECV: MCE_DISPLAY_SIG '%s'\n\n", status);
-
-    if(tmp && strcmp(tmp,"on"))
-      poll_uevent(NULL);
+  log_print("MCE RECV: MCE_DISPLAY_SIG '%s'\n\n", status);
+
+  if(tmp)
+  {
+    energy_account_display(!strcmp(tmp,"on"));
+    hald_addon_bme_display_off(!strcmp(tmp,"off"));
   }
 
   dbus_error_free(&error);
@@ -1286,37 +2512,194 @@ static DBusHandlerResult hald_addon_bme_mce_signal(DBusConnection *connection G_
   return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
-static gint hald_addon_bme_server_dbus_init()
+/* only arrives for names a match rule was added for */
+static DBusHandlerResult hald_addon_bme_name_owner_changed(DBusConnection *connection UNUSED, DBusMessage *message)
+{
+  const char *name, *old_owner, *new_owner;
+
+  if (dbus_message_get_args(message, NULL,
+                            DBUS_TYPE_STRING, &name,
+                            DBUS_TYPE_STRING, &old_owner,
+                            DBUS_TYPE_STRING, &new_owner,
+                            DBUS_TYPE_INVALID) && !*new_owner)
+  {
+    bme_profile_name_lost(name);
+    subscriber_remove(name);
+    request_sender_remove(name);
+  }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Everything we listen to on the system bus. Match rules are derived from
+ * the same entries, so the bus daemon only routes these messages to us in
+ * the first place. DISPATCH_NO_MATCH entries get their match rules added
+ * later, one per name of interest.
+ */
+#define DISPATCH_SIGNAL (1 << DBUS_MESSAGE_TYPE_SIGNAL)
+#define DISPATCH_METHOD_CALL (1 << DBUS_MESSAGE_TYPE_METHOD_CALL)
+#define DISPATCH_NO_MATCH (1 << 8)
+
+typedef struct {
+  const char *sender;
+  const char *path;
+  const char *interface;
+  const char *member;
+  int types;
+  DBusHandlerResult (*handler)(DBusConnection *connection, DBusMessage *message);
+} dispatch_entry;
+
+static dispatch_entry dispatch_table[] = {
+  { NULL, BME_REQUEST_PATH, BME_REQUEST_IF, BME_STATUS_INFO_REQ,
+    DISPATCH_SIGNAL | DISPATCH_METHOD_CALL, hald_addon_bme_dbus_proxy },
+  { NULL, BME_REQUEST_PATH, BME_REQUEST_IF, BME_TIMELEFT_INFO_REQ,
+    DISPATCH_SIGNAL | DISPATCH_METHOD_CALL, hald_addon_bme_dbus_proxy },
+  { NULL, BME_REQUEST_PATH, BME_REQUEST_IF, BME_STATUS_SNAPSHOT_REQ,
+    DISPATCH_METHOD_CALL, hald_addon_bme_status_snapshot },
+  { NULL, BME_REQUEST_PATH, BME_REQUEST_IF, BME_ENERGY_INFO_REQ,
+    DISPATCH_METHOD_CALL, hald_addon_bme_energy_info },
+  { NULL, BME_REQUEST_PATH, BME_REQUEST_IF, BME_HISTORY_QUERY_REQ,
+    DISPATCH_METHOD_CALL, hald_addon_bme_history_query },
+  { NULL, BME_REQUEST_PATH, BME_REQUEST_IF, BME_STATS_INFO_REQ,
+    DISPATCH_METHOD_CALL, hald_addon_bme_stats_info },
+  { NULL, BME_REQUEST_PATH, BME_REQUEST_IF, BME_REQUEST_STATS_REQ,
+    DISPATCH_METHOD_CALL, hald_addon_bme_request_stats },
+  { NULL, BME_REQUEST_PATH, BME_REQUEST_IF, BME_DIAGNOSTICS_INFO_REQ,
+    DISPATCH_METHOD_CALL, hald_addon_bme_diagnostics_info },
+  { NULL, BME_REQUEST_PATH, BME_REQUEST_IF, BME_PROFILE_START_REQ,
+    DISPATCH_METHOD_CALL, bme_profile_start },
+  { NULL, BME_REQUEST_PATH, BME_REQUEST_IF, BME_SUBSCRIBE_REQ,
+    DISPATCH_METHOD_CALL, hald_addon_bme_subscribe },
+  { NULL, BME_REQUEST_PATH, BME_REQUEST_IF, BME_UNSUBSCRIBE_REQ,
+    DISPATCH_METHOD_CALL, hald_addon_bme_unsubscribe },
+  { NULL, BME_UPOWER_DEVICE_PATH, DBUS_INTERFACE_PROPERTIES, "Get",
+    DISPATCH_METHOD_CALL, bme_upower_get },
+  { NULL, BME_UPOWER_DEVICE_PATH, DBUS_INTERFACE_PROPERTIES, "GetAll",
+    DISPATCH_METHOD_CALL, bme_upower_get_all },
+  { NULL, BME_UPOWER_DEVICE_PATH, DBUS_INTERFACE_INTROSPECTABLE, "Introspect",
+    DISPATCH_METHOD_CALL, bme_upower_introspect },
+  { MCE_SERVICE, MCE_SIGNAL_PATH, MCE_SIGNAL_IF, MCE_DISPLAY_SIG,
+    DISPATCH_SIGNAL, hald_addon_bme_mce_signal },
+  { DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "NameOwnerChanged",
+    DISPATCH_SIGNAL | DISPATCH_NO_MATCH, hald_addon_bme_name_owner_changed },
+};
+
+/* Every message on the system connection passes the filter, most of them
+ * are not for us. The entries are hashed by interface and member into an
+ * open addressing table once, a lookup hashes the two strings and only
+ * compares them on a hash hit. The table is kept at most half full. */
+#define DISPATCH_HASH_SIZE 64
+
+static struct {
+  uint32 hash;
+  dispatch_entry *entry;
+} dispatch_hash[DISPATCH_HASH_SIZE];
+
+/* FNV-1a over "interface.member" */
+static uint32 dispatch_key(const char *interface, const char *member)
+{
+  uint32 hash = 2166136261u;
+
+  for (; *interface; interface++)
+    hash = (hash ^ (unsigned char)*interface) * 16777619u;
+  hash = (hash ^ '.') * 16777619u;
+  for (; *member; member++)
+    hash = (hash ^ (unsigned char)*member) * 16777619u;
+
+  return hash;
+}
+
+static dispatch_entry * dispatch_lookup(const char *interface, const char *member)
+{
+  uint32 hash = dispatch_key(interface, member);
+  unsigned int slot;
+
+  for (slot = hash % DISPATCH_HASH_SIZE; dispatch_hash[slot].entry; slot = (slot + 1) % DISPATCH_HASH_SIZE)
+    if (dispatch_hash[slot].hash == hash &&
+        !strcmp(dispatch_hash[slot].entry->member, member) &&
+        !strcmp(dispatch_hash[slot].entry->interface, interface))
+      return dispatch_hash[slot].entry;
+
+  return NULL;
+}
+
+static void dispatch_hash_add(dispatch_entry *entry)
+{
+  uint32 hash = dispatch_key(entry->interface, entry->member);
+  unsigned int slot;
+
+  for (slot = hash % DISPATCH_HASH_SIZE; dispatch_hash[slot].entry; slot = (slot + 1) % DISPATCH_HASH_SIZE)
+    ;
+  dispatch_hash[slot].hash = hash;
+  dispatch_hash[slot].entry = entry;
+}
+
+static DBusHandlerResult hald_addon_bme_dbus_filter(DBusConnection *connection, DBusMessage *message, void *user_data UNUSED)
+{
+  const char *interface, *member, *path;
+  dispatch_entry *entry;
+
+  member = dbus_message_get_member(message);
+  interface = dbus_message_get_interface(message);
+  if (!member || !interface)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  entry = dispatch_lookup(interface, member);
+  if (!entry || !(entry->types & (1 << dbus_message_get_type(message))))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  path = dbus_message_get_path(message);
+  if (!path || strcmp(path, entry->path))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  return entry->handler(connection, message);
+}
+
+static int hald_addon_bme_setup_dispatch()
 {
   DBusError error;
-  gint result = -1;
+  int result = -1;
+  unsigned int i;
 
   dbus_error_init(&error);
 
-  if(!(server_dbus = dbus_bus_get(DBUS_BUS_SYSTEM, &error)))
+  if (2*N_ELEMENTS(dispatch_table) > DISPATCH_HASH_SIZE)
   {
-    if (dbus_error_is_set(&error))
-      print_dbus_error("server_dbus_init",&error);
-    else
-      log_print("server_dbus_init");
+    log_print("setup_dispatch: DISPATCH_HASH_SIZE too small\n");
     goto out;
   }
+  for (i = 0; i < N_ELEMENTS(dispatch_table); i++)
+    dispatch_hash_add(&dispatch_table[i]);
 
-  dbus_connection_setup_with_g_main(server_dbus, 0);
-  dbus_connection_set_exit_on_disconnect(server_dbus, FALSE);
-
-  if(!dbus_connection_add_filter(system_dbus, hald_addon_bme_mce_signal, NULL, NULL))
+  if(!dbus_connection_add_filter(system_dbus, hald_addon_bme_dbus_filter, NULL, NULL))
   {
-    log_print("server_dbus_init");
+    log_print("setup_dispatch");
     goto out;
   }
-  dbus_bus_add_match(system_dbus,
-                     "type='signal',interface='com.nokia.mce.signal'",
-                     &error);
-  if (dbus_error_is_set(&error))
+
+  for (i = 0; i < N_ELEMENTS(dispatch_table); i++)
   {
-    print_dbus_error("server_dbus_init",&error);
-    goto out;
+    char match[256];
+
+    /* method calls are addressed to us, only signals need a match rule */
+    if (!(dispatch_table[i].types & DISPATCH_SIGNAL) || (dispatch_table[i].types & DISPATCH_NO_MATCH))
+      continue;
+
+    snprintf(match, sizeof(match),
+             "type='signal',%s%s%spath='%s',interface='%s',member='%s'",
+             dispatch_table[i].sender ? "sender='" : "",
+             dispatch_table[i].sender ? dispatch_table[i].sender : "",
+             dispatch_table[i].sender ? "'," : "",
+             dispatch_table[i].path,
+             dispatch_table[i].interface,
+             dispatch_table[i].member);
+
+    dbus_bus_add_match(system_dbus, match, &error);
+    if (dbus_error_is_set(&error))
+    {
+      print_dbus_error("setup_dispatch",&error);
+      goto out;
+    }
   }
   result = 0;
 
@@ -1328,31 +2711,95 @@ out:
 int main ()
 {
   int result = 1;
+  unsigned int i;
   const char * bq27200_poll_period = getenv ("HAL_PROP_BQ27200_POLL_PERIOD_SECONDS");
+  const char * bme_archive_period = getenv ("HAL_PROP_BME_ARCHIVE_PERIOD_SECONDS");
+  const char * bme_battery_resistance = getenv ("HAL_PROP_BME_BATTERY_RESISTANCE_MOHM");
+  const char * bme_current_average = getenv ("HAL_PROP_BME_CURRENT_AVERAGE_SECONDS");
+  const char * bme_current_hysteresis = getenv ("HAL_PROP_BME_CURRENT_HYSTERESIS_MA");
+  const char * bme_sysfs_root = getenv ("HAL_PROP_BME_SYSFS_ROOT");
+  const char * bme_upower = getenv ("HAL_PROP_BME_UPOWER");
+  const char * bme_sysfs_attributes = getenv ("HAL_PROP_BME_SYSFS_ATTRIBUTES");
+  const char * bme_request_limit = getenv ("HAL_PROP_BME_REQUEST_LIMIT");
+  const char * bme_display_off_defer = getenv ("HAL_PROP_BME_DISPLAY_OFF_DEFER");
 
   log_print (("STARTUP\n\n"));
-  global_bme.charge_level.capacity_state = OK;
+  global_bme.charge_level.capacity_state = BME_CAPACITY_OK;
+  bme_policy_params_init(&policy_params);
+  bme_policy_state_init(&policy_state);
+
+  if(bme_loop_init() < 0)
+  {
+    log_print("main loop setup failed\n\n");
+    goto out;
+  }
 
   if(bq27200_poll_period)
     poll_period =  atoi(bq27200_poll_period);
   if(!poll_period)
     poll_period = 30;
 
+  /* 0 disables the history archive */
+  if(bme_archive_period)
+    archive_period = atoi(bme_archive_period);
+
+  if(bme_battery_resistance)
+    policy_params.voltage_filter_resistance = atoi(bme_battery_resistance);
+
+  if(bme_current_average)
+    policy_params.current_average_window = atoi(bme_current_average);
+  if(bme_current_hysteresis)
+    policy_params.current_hysteresis = atoi(bme_current_hysteresis);
+
+  /* a fake sysfs tree, for testing */
+  if(bme_sysfs_root && *bme_sysfs_root)
+  {
+    sysfs_root = bme_sysfs_root;
+    bq27200_uevent_path = sysfs_path(BQ27200_UEVENT_FILE_PATH);
+    bq27200_registers_path = sysfs_path(BQ27200_REGISTERS_FILE_PATH);
+    bq24150a_mode_path = sysfs_path(BQ24150A_MODE_FILE_PATH);
+    bq24150a_stat_pin_path = sysfs_path(BQ24150A_STAT_PIN_FILE_PATH);
+    rx51_uevent_path = sysfs_path(RX51_UEVENT_FILE_PATH);
+    for (i = 0; i < N_ELEMENTS(power_supply_attributes); i++)
+      power_supply_attributes[i].path = sysfs_path(power_supply_attributes[i].path);
+    for (i = 0; i < N_ELEMENTS(diagnostic_properties); i++)
+      diagnostic_properties[i].path = sysfs_path(diagnostic_properties[i].path);
+  }
+
+  if(bme_sysfs_attributes)
+    sysfs_attributes = atoi(bme_sysfs_attributes);
+
+  /* status_info_req and timeleft_info_req per sender and minute, 0 disables the limit */
+  if(bme_request_limit)
+    request_limit = atoi(bme_request_limit);
+
+  /* 0 publishes everything right away, display on or off */
+  if(bme_display_off_defer)
+    display_off_defer = atoi(bme_display_off_defer);
+
   if(!hald_addon_bme_setup_hal())
   {
     log_print("hal addon setup failed\n\n");
     goto out;
   }
 
+  bme_hal_init(hal_dbus, udi);
+
   if(hald_addon_bme_setup_dbus_proxy() == -1)
   {
     log_print("dbus proxy setup failed\n\n");
     goto out;
   }
 
-  if ( hald_addon_bme_server_dbus_init() == -1 )
+  if(bme_upower && atoi(bme_upower))
+    bme_upower_init(system_dbus);
+
+  bme_profile_init(system_dbus, sysfs_path(BQ27200_ATTRIBUTE("current_now")),
+                   sysfs_path(BQ27200_ATTRIBUTE("voltage_now")));
+
+  if ( hald_addon_bme_setup_dispatch() == -1 )
   {
-    log_print("server setup failed\n\n");
+    log_print("dispatch setup failed\n\n");
     goto out;
   }
 
@@ -1363,16 +2810,27 @@ int main ()
     goto out;
   }
 
+  if (archive_period && !(archive = bme_archive_open(BME_ARCHIVE_FILE_PATH, BME_ARCHIVE_MAX_BLOCKS)))
+    log_print("unable to open %s(%s)\n",BME_ARCHIVE_FILE_PATH,strerror(errno));
+
+  if (bme_charger_init(sysfs_root, hald_addon_bme_charger_changed))
+    log_print("USB charger detection available\n");
   hald_addon_bme_bq24150a_setup_poll(NULL);
-  hald_addon_bme_update_hal(&global_battery,FALSE);
+  if (hald_addon_bme_reconcile_hal())
+    hald_addon_bme_set_static_properties();
+  else
+    hald_addon_bme_update_hal(&global_battery,FALSE);
 
-  mainloop = g_main_loop_new(0,FALSE);
   /* add poll callback */
-  g_timeout_add_seconds(poll_period,poll_uevent,NULL);
-  g_timeout_add_seconds(0,poll_uevent,(gpointer)1);
+  loop_stats.next_poll_ms = monotonic_time_ms() + (int64)poll_period*1000;
+  bme_loop_timeout_add_seconds(poll_period,poll_periodic,NULL);
+  bme_loop_timeout_add_seconds(0,poll_uevent,(void *)1);
+  if (archive)
+    bme_loop_timeout_add_seconds(BME_ARCHIVE_FLUSH_PERIOD,archive_flush,NULL);
+  hald_addon_bme_setup_signals();
 
   log_print("ENTER MAIN LOOP\n\n");
-  g_main_loop_run(mainloop);
+  bme_loop_run();
   log_print("LEAVE MAIN LOOP\n\n");
 
   result = 0;
@@ -1380,6 +2838,7 @@ int main ()
 out:
   log_print("CLEANUP\n\n");
   cleanup_system_dbus();
+  bme_archive_close(archive);
   log_print("EXIT %d\n\n", result);
 
   return result;